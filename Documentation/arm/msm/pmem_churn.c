@@ -0,0 +1,148 @@
+/* pmem_churn.c - allocate/free churn against a pmem region
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * Keeps up to -n allocations live on one pmem device. Each step picks a
+ * random slot and either frees the allocation in it (by closing its file)
+ * or makes a new one with PMEM_ALLOCATE_ALIGNED, of 4K to -m KB, every
+ * fourth one 64K aligned unless -4 is given (only bitmap regions take
+ * other alignments). Only the allocate and free calls are timed.
+ * At the end it prints operations per second, the mean and worst
+ * allocation latency, failed allocations and the free space left.
+ * /sys/kernel/pmem_regions/<name>/fragmentation shows the state the
+ * churn left behind.
+ *
+ * The region should not be in use by anything else while this runs.
+ *
+ *	gcc -O2 -o pmem_churn pmem_churn.c
+ *	pmem_churn [-d /dev/pmem_adsp] [-n slots] [-m max KB] [-i iterations]
+ *		   [-4]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/* from include/linux/android_pmem.h */
+#define PMEM_IOCTL_MAGIC 'p'
+#define PMEM_GET_FREE_SPACE	_IOW(PMEM_IOCTL_MAGIC, 14, unsigned int)
+#define PMEM_ALLOCATE_ALIGNED	_IOW(PMEM_IOCTL_MAGIC, 15, unsigned int)
+
+struct pmem_freespace {
+	unsigned long total;
+	unsigned long largest;
+};
+
+struct pmem_allocation {
+	unsigned long size;
+	unsigned int align;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = "/dev/pmem_adsp";
+	int slots = 64, max_kb = 1024, iterations = 100000, big_align = 1;
+	double t, t_alloc = 0, t_free = 0, worst = 0;
+	unsigned long allocs = 0, frees = 0, failed = 0;
+	struct pmem_freespace fs;
+	int opt, i, live, fd, *fds;
+
+	while ((opt = getopt(argc, argv, "d:n:m:i:4")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'n':
+			slots = atoi(optarg);
+			break;
+		case 'm':
+			max_kb = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case '4':
+			big_align = 0;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d dev] [-n slots] "
+				"[-m max KB] [-i iterations] [-4]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (slots <= 0 || max_kb < 4)
+		return 1;
+
+	fds = malloc(slots * sizeof(*fds));
+	if (!fds)
+		return 1;
+	for (i = 0; i < slots; i++)
+		fds[i] = -1;
+	srand(1);
+
+	for (i = 0; i < iterations; i++) {
+		int s = rand() % slots;
+		struct pmem_allocation a;
+
+		if (fds[s] >= 0) {
+			t = now();
+			close(fds[s]);
+			t_free += now() - t;
+			fds[s] = -1;
+			frees++;
+			continue;
+		}
+
+		fds[s] = open(dev, O_RDWR);
+		if (fds[s] < 0) {
+			perror(dev);
+			return 1;
+		}
+		a.size = (rand() % (max_kb / 4) + 1) * 4096;
+		a.align = big_align && !(i & 3) ? 65536 : 4096;
+		t = now();
+		if (ioctl(fds[s], PMEM_ALLOCATE_ALIGNED, &a) < 0) {
+			failed++;
+			close(fds[s]);
+			fds[s] = -1;
+			continue;
+		}
+		t = now() - t;
+		t_alloc += t;
+		if (t > worst)
+			worst = t;
+		allocs++;
+	}
+
+	for (i = 0, live = 0; i < slots; i++)
+		live += fds[i] >= 0;
+	fd = open(dev, O_RDWR);
+	if (fd >= 0 && ioctl(fd, PMEM_GET_FREE_SPACE, &fs) == 0)
+		printf("free %lu KB, largest %lu KB with %d allocations live\n",
+		       fs.total >> 10, fs.largest >> 10, live);
+	if (fd >= 0)
+		close(fd);
+	printf("%lu allocs (%lu failed), %lu frees, %.0f ops/s\n",
+	       allocs, failed, frees, (allocs + frees) / (t_alloc + t_free));
+	printf("alloc mean %.1f us worst %.1f us, free mean %.1f us\n",
+	       allocs ? t_alloc * 1e6 / allocs : 0, worst * 1e6,
+	       frees ? t_free * 1e6 / frees : 0);
+
+	for (i = 0; i < slots; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# sio-compare.sh - read latency under a heavy writer, per io scheduler
+#
+# Usage: sio-compare.sh <disk> <dir> [seconds] ["sio deadline cfq bfq"]
+#
+# <disk> is the name under /sys/block (mmcblk0, sda, ...) and <dir> a
+# directory on a filesystem on it with about 400 MB free. For each
+# scheduler the disk offers, fio runs one buffered sequential writer next to
+# one O_DIRECT 4K random reader for the given time (60 s by default).
+# The table shows what the reader saw (IOPS, mean and 99th percentile
+# completion latency) and the bandwidth the writer kept up.
+#
+# Needs fio with terse output version 3 (fio 2.0.9 or later).
+
+disk=$1
+dir=$2
+secs=${3:-60}
+scheds=${4:-"sio deadline cfq bfq"}
+queue=/sys/block/$disk/queue
+
+if [ ! -d "$queue" ] || [ ! -d "$dir" ]; then
+	echo "usage: $0 <disk> <dir> [seconds] [\"schedulers\"]" >&2
+	exit 1
+fi
+old=$(sed 's/.*\[\(.*\)\].*/\1/' $queue/scheduler)
+
+printf "%-10s %8s %12s %12s %12s\n" sched "rd IOPS" "rd mean us" \
+	"rd p99 us" "wr KB/s"
+for s in $scheds; do
+	grep -qw $s $queue/scheduler || continue
+	echo $s > $queue/scheduler
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	fio --minimal --terse-version=3 --directory=$dir \
+		--time_based --runtime=$secs --ioengine=sync \
+		--name=writer --rw=write --bs=128k --size=256m \
+		--name=reader --rw=randread --bs=4k --size=64m --direct=1 |
+	awk -F';' -v s=$s '
+		# fields: 3 job, 8 read IOPS, 16 read clat mean,
+		# 30 read clat p99 as "99.000000%=usec", 48 write KB/s
+		$3 == "reader" {
+			split($30, p, "=")
+			iops = $8; mean = $16; p99 = p[2]
+		}
+		$3 == "writer" { wbw = $48 }
+		END {
+			printf "%-10s %8d %12.0f %12d %12d\n",
+				s, iops, mean, p99, wbw
+		}'
+	rm -f $dir/writer.* $dir/reader.*
+done
+echo $old > $queue/scheduler
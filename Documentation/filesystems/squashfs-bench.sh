@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# squashfs-bench.sh - cold read throughput of a squashfs mount, N readers
+#
+# Usage: squashfs-bench.sh <dir> ["1 2 4"]
+#
+# <dir> is a directory in a mounted squashfs image, ideally one with a few
+# hundred MB of files (a /system image will do). For each reader count the
+# page cache is dropped, the regular files under <dir> are dealt round robin
+# to that many readers, and all of them cat their share to /dev/null at the
+# same time.
+#
+# Prints the MB/s of each run and how many CPUs were busy on average,
+# mostly decompressing. With a single decompressor both stay flat as
+# readers are added, at about one CPU; per-CPU decompressors should scale
+# up to the number of CPUs, unless the device runs out of bandwidth first.
+# Run it on kernels built with each SQUASHFS_DECOMP_* and SQUASHFS_FILE_*
+# choice to compare them.
+
+dir=$1
+jobs=${2:-"1 2 4"}
+list=${TMPDIR:-/tmp}/squashfs-bench.$$
+
+[ -d "$dir" ] || { echo "usage: $0 <dir> [\"readers...\"]" >&2; exit 1; }
+trap 'rm -f $list $list.*' EXIT
+
+find "$dir" -xdev -type f > $list
+bytes=$(tr '\n' '\0' < $list | xargs -0 cat | wc -c)
+
+# centiseconds since boot
+now() {
+	read up idle < /proc/uptime
+	echo ${up%.*}${up#*.}
+}
+
+# busy jiffies (USER_HZ, so also centiseconds) summed over all CPUs
+cpu() {
+	awk '/^cpu / { print $2 + $3 + $4 + $7 + $8 }' /proc/stat
+}
+
+echo "$(wc -l < $list) files, $((bytes >> 20)) MB"
+printf "%7s %8s %8s %6s\n" readers "MB/s" "secs" "CPUs"
+for n in $jobs; do
+	j=0
+	while [ $j -lt $n ]; do
+		awk -v n=$n -v j=$j 'NR % n == j' $list > $list.$j
+		j=$((j + 1))
+	done
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+
+	c0=$(cpu)
+	t0=$(now)
+	j=0
+	while [ $j -lt $n ]; do
+		tr '\n' '\0' < $list.$j | xargs -0 cat > /dev/null &
+		j=$((j + 1))
+	done
+	wait
+	t1=$(now)
+	busy=$(($(cpu) - c0))
+	t=$((t1 - t0))
+	[ $t -gt 0 ] || t=1
+	printf "%7d %8d %5d.%02d %3d.%02d\n" $n $(((bytes >> 10) * 100 / t >> 10)) \
+		$((t / 100)) $((t % 100)) $((busy / t)) $((busy * 100 / t % 100))
+	rm -f $list.*
+done
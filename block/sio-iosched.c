@@ -12,6 +12,12 @@
  * Asynchronous and synchronous requests are not treated separately, but
  * we relay on deadlines to ensure fairness.
  *
+ * Within each class, requests are kept in one fifo per submitting
+ * io_context and the fifos are served round-robin, queue_quantum
+ * requests at a time, so that one heavy writer can't fill a whole batch
+ * ahead of everybody else. The asynchronous batch shrinks while reads
+ * complete later than read_latency and grows back once they are fast.
+ *
  */
 #include <linux/blkdev.h>
 #include <linux/elevator.h>
@@ -19,6 +25,9 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
+#include <linux/iocontext.h>
 
 enum {
 	ASYNC,
@@ -30,37 +39,136 @@ static const int sync_expire = HZ / 2;	/* max time before a sync is submitted. *
 static const int async_expire = 5 * HZ;	/* ditto for async, these limits are SOFT! */
 static const int fifo_batch = 16;	/* # of sequential requests treated as one
 					   by the above parameters. For throughput. */
+static const int queue_quantum = 4;	/* # of requests served from one io_context
+					   before moving on to the next one. */
+static const int read_latency = 20;	/* target read latency in ms, the async batch
+					   adapts to it. 0 disables. */
+
+#define SIO_HASH_SHIFT	4
+
+/* Per io_context request fifo */
+struct sio_queue {
+	struct list_head fifo;
+	struct list_head rr;		/* in sio_data rr_list while not empty */
+	struct hlist_node hash;
+	void *key;
+	int sync;
+	int served;			/* requests dispatched in this turn */
+};
 
 /* Elevator data */
 struct sio_data {
-	/* Request queues */
-	struct list_head fifo_list[2];
+	/* Active queues of each class, served round-robin */
+	struct list_head rr_list[2];
+	struct hlist_head hash[1 << SIO_HASH_SHIFT];
+
+	/* Used when a queue can't be allocated */
+	struct sio_queue shared[2];
 
 	/* Attributes */
 	unsigned int batched;
+	int cur_class;
+	int async_batch;
+	unsigned int read_lat_us;	/* average, for the async batch */
 
 	/* Settings */
 	int fifo_expire[2];
 	int fifo_batch;
+	int queue_quantum;
+	int read_latency;
 };
 
+static struct kmem_cache *sio_pool;
+
+static inline unsigned long sio_now_us(void)
+{
+	return (unsigned long)ktime_to_us(ktime_get());
+}
+
+static inline struct sio_queue *rq_sio_queue(struct request *rq)
+{
+	return rq->elevator_private;
+}
+
+static void
+sio_init_sio_queue(struct sio_queue *sq, void *key, int sync)
+{
+	INIT_LIST_HEAD(&sq->fifo);
+	INIT_LIST_HEAD(&sq->rr);
+	INIT_HLIST_NODE(&sq->hash);
+	sq->key = key;
+	sq->sync = sync;
+	sq->served = 0;
+}
+
+static struct sio_queue *
+sio_find_queue(struct sio_data *sd, void *key, int sync)
+{
+	struct hlist_head *head = &sd->hash[hash_ptr(key, SIO_HASH_SHIFT)];
+	struct hlist_node *entry;
+	struct sio_queue *sq;
+
+	hlist_for_each_entry(sq, entry, head, hash)
+		if (sq->key == key && sq->sync == sync)
+			return sq;
+
+	/*
+	 * Queues live only while they hold requests, so this is called
+	 * under the queue lock and has to allocate atomically.
+	 */
+	sq = kmem_cache_alloc(sio_pool, GFP_ATOMIC);
+	if (!sq)
+		return &sd->shared[sync];
+
+	sio_init_sio_queue(sq, key, sync);
+	hlist_add_head(&sq->hash, head);
+
+	return sq;
+}
+
+static void
+sio_put_queue(struct sio_data *sd, struct sio_queue *sq)
+{
+	/* Free the queue once its last request is gone */
+	if (!list_empty(&sq->fifo))
+		return;
+
+	list_del_init(&sq->rr);
+	sq->served = 0;
+	if (sq != &sd->shared[sq->sync]) {
+		hlist_del(&sq->hash);
+		kmem_cache_free(sio_pool, sq);
+	}
+}
+
 static void
 sio_merged_requests(struct request_queue *q, struct request *rq,
 		    struct request *next)
 {
+	struct sio_data *sd = q->elevator->elevator_data;
+	struct sio_queue *sq = rq_sio_queue(rq);
+	struct sio_queue *next_sq = rq_sio_queue(next);
+
 	/*
 	 * If next expires before rq, assign its expire time to rq
 	 * and move into next position (next will be deleted) in fifo.
+	 * Next may belong to another io_context, then rq moves along.
 	 */
 	if (!list_empty(&rq->queuelist) && !list_empty(&next->queuelist)) {
 		if (time_before(rq_fifo_time(next), rq_fifo_time(rq))) {
 			list_move(&rq->queuelist, &next->queuelist);
 			rq_set_fifo_time(rq, rq_fifo_time(next));
+			rq->elevator_private = next_sq;
 		}
 	}
 
 	/* Delete next request */
 	rq_fifo_clear(next);
+	next->elevator_private = NULL;
+
+	sio_put_queue(sd, next_sq);
+	if (sq != next_sq)
+		sio_put_queue(sd, sq);
 }
 
 static void
@@ -68,13 +176,29 @@ sio_add_request(struct request_queue *q, struct request *rq)
 {
 	struct sio_data *sd = q->elevator->elevator_data;
 	const int sync = rq_is_sync(rq);
+	struct sio_queue *sq;
+	void *key;
+
+	/*
+	 * Requests are added from the submitting task. Tasks that never
+	 * needed an io_context get a queue of their own all the same.
+	 */
+	key = current->io_context;
+	if (!key)
+		key = current;
+	sq = sio_find_queue(sd, key, sync);
 
 	/*
 	 * Add request to the proper fifo list and set its
 	 * expire time.
 	 */
+	rq->elevator_private = sq;
+	rq->elevator_private2 = (void *)sio_now_us();
 	rq_set_fifo_time(rq, jiffies + sd->fifo_expire[sync]);
-	list_add_tail(&rq->queuelist, &sd->fifo_list[sync]);
+	list_add_tail(&rq->queuelist, &sq->fifo);
+
+	if (list_empty(&sq->rr))
+		list_add_tail(&sq->rr, &sd->rr_list[sync]);
 }
 
 static int
@@ -82,112 +206,149 @@ sio_queue_empty(struct request_queue *q)
 {
 	struct sio_data *sd = q->elevator->elevator_data;
 
-	/* Check if fifo lists are empty */
-	return list_empty(&sd->fifo_list[SYNC]) &&
-	       list_empty(&sd->fifo_list[ASYNC]);
+	/* Check if there are active queues */
+	return list_empty(&sd->rr_list[SYNC]) &&
+	       list_empty(&sd->rr_list[ASYNC]);
 }
 
-static struct request *
-sio_expired_request(struct sio_data *sd, int sync)
+static int
+sio_class_expired(struct sio_data *sd, int sync)
 {
+	struct sio_queue *sq;
 	struct request *rq;
 
-	if (list_empty(&sd->fifo_list[sync]))
-		return NULL;
-
-	/* Retrieve request */
-	rq = rq_entry_fifo(sd->fifo_list[sync].next);
+	/* The oldest request of each queue is at its head */
+	list_for_each_entry(sq, &sd->rr_list[sync], rr) {
+		rq = rq_entry_fifo(sq->fifo.next);
 
-	/* Request has expired */
-	if (time_after(jiffies, rq_fifo_time(rq)))
-		return rq;
+		/* Request has expired */
+		if (time_after(jiffies, rq_fifo_time(rq)))
+			return 1;
+	}
 
-	return NULL;
+	return 0;
 }
 
-static struct request *
-sio_choose_expired_request(struct sio_data *sd)
+static int
+sio_choose_class(struct sio_data *sd)
 {
-	struct request *sync = sio_expired_request(sd, SYNC);
-	struct request *async = sio_expired_request(sd, ASYNC);
-
 	/*
 	 * Check expired requests. Asynchronous requests have
 	 * priority over synchronous.
 	 */
-	if (sync && async)
-		return async;
-	if (sync)
-		return sync;
+	if (sio_class_expired(sd, ASYNC))
+		return ASYNC;
+	if (sio_class_expired(sd, SYNC))
+		return SYNC;
 
-	return async;
-
-}
-
-static struct request *
-sio_choose_request(struct sio_data *sd)
-{
 	/*
-	 * Retrieve request from available fifo list.
-	 * Synchronous requests have priority over asynchronous.
+	 * Otherwise synchronous requests have priority over
+	 * asynchronous.
 	 */
-	if (!list_empty(&sd->fifo_list[SYNC]))
-		return rq_entry_fifo(sd->fifo_list[SYNC].next);
-
-	if (!list_empty(&sd->fifo_list[ASYNC]))
-		return rq_entry_fifo(sd->fifo_list[ASYNC].next);
+	if (!list_empty(&sd->rr_list[SYNC]))
+		return SYNC;
+	if (!list_empty(&sd->rr_list[ASYNC]))
+		return ASYNC;
 
-	return NULL;
+	return -1;
 }
 
 static inline void
 sio_dispatch_request(struct sio_data *sd, struct request *rq)
 {
+	struct sio_queue *sq = rq_sio_queue(rq);
+
 	/*
 	 * Remove the request from the fifo list
 	 * and dispatch it.
 	 */
 	rq_fifo_clear(rq);
+	rq->elevator_private = NULL;
 	elv_dispatch_add_tail(rq->q, rq);
 
 	sd->batched++;
+
+	/* Move on to the next io_context after a quantum */
+	if (list_empty(&sq->fifo)) {
+		sio_put_queue(sd, sq);
+	} else if (++sq->served >= sd->queue_quantum) {
+		sq->served = 0;
+		list_move_tail(&sq->rr, &sd->rr_list[sq->sync]);
+	}
+}
+
+/*
+ * Batch size for asynchronous requests: fifo_batch unless read latency
+ * tuning is on, and never more than fifo_batch.
+ */
+static inline int sio_async_batch(struct sio_data *sd)
+{
+	if (!sd->read_latency)
+		return sd->fifo_batch;
+	return min(sd->async_batch, sd->fifo_batch);
 }
 
 static int
 sio_dispatch_requests(struct request_queue *q, int force)
 {
 	struct sio_data *sd = q->elevator->elevator_data;
-	struct request *rq = NULL;
+	int class = sd->cur_class;
+	int batch = class == SYNC ? sd->fifo_batch : sio_async_batch(sd);
+	struct sio_queue *sq;
 
 	/*
-	 * Retrieve any expired request after a batch of
-	 * sequential requests.
+	 * Choose the class again, checking for expired requests, after
+	 * a batch of requests or once the current class runs dry.
 	 */
-	if (sd->batched > sd->fifo_batch) {
-		sd->batched = 0;
-		rq = sio_choose_expired_request(sd);
-	}
-
-	/* Retrieve request */
-	if (!rq) {
-		rq = sio_choose_request(sd);
-		if (!rq)
+	if (sd->batched >= batch || list_empty(&sd->rr_list[class])) {
+		class = sio_choose_class(sd);
+		if (class < 0)
 			return 0;
+
+		sd->cur_class = class;
+		sd->batched = 0;
 	}
 
 	/* Dispatch request */
-	sio_dispatch_request(sd, rq);
+	sq = list_entry(sd->rr_list[class].next, struct sio_queue, rr);
+	sio_dispatch_request(sd, rq_entry_fifo(sq->fifo.next));
 
 	return 1;
 }
 
+static void
+sio_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+	unsigned int lat, target = sd->read_latency * USEC_PER_MSEC;
+
+	if (!target || rq_data_dir(rq) != READ || !rq->elevator_private2)
+		return;
+
+	/* Average over the last few reads */
+	lat = sio_now_us() - (unsigned long)rq->elevator_private2;
+	if (sd->read_lat_us)
+		sd->read_lat_us = (7 * sd->read_lat_us + lat) / 8;
+	else
+		sd->read_lat_us = lat;
+
+	/*
+	 * Back off quickly while reads are late, grow slowly while they
+	 * are well within the target.
+	 */
+	if (sd->read_lat_us > target)
+		sd->async_batch = max(sd->async_batch / 2, 1);
+	else if (sd->read_lat_us < target / 2 &&
+		 sd->async_batch < sd->fifo_batch)
+		sd->async_batch++;
+}
+
 static struct request *
 sio_former_request(struct request_queue *q, struct request *rq)
 {
-	struct sio_data *sd = q->elevator->elevator_data;
-	const int sync = rq_is_sync(rq);
+	struct sio_queue *sq = rq_sio_queue(rq);
 
-	if (rq->queuelist.prev == &sd->fifo_list[sync])
+	if (!sq || rq->queuelist.prev == &sq->fifo)
 		return NULL;
 
 	/* Return former request */
@@ -197,10 +358,9 @@ sio_former_request(struct request_queue *q, struct request *rq)
 static struct request *
 sio_latter_request(struct request_queue *q, struct request *rq)
 {
-	struct sio_data *sd = q->elevator->elevator_data;
-	const int sync = rq_is_sync(rq);
+	struct sio_queue *sq = rq_sio_queue(rq);
 
-	if (rq->queuelist.next == &sd->fifo_list[sync])
+	if (!sq || rq->queuelist.next == &sq->fifo)
 		return NULL;
 
 	/* Return latter request */
@@ -211,21 +371,31 @@ static void *
 sio_init_queue(struct request_queue *q)
 {
 	struct sio_data *sd;
+	int i;
 
 	/* Allocate structure */
 	sd = kmalloc_node(sizeof(*sd), GFP_KERNEL, q->node);
 	if (!sd)
 		return NULL;
 
-	/* Initialize fifo lists */
-	INIT_LIST_HEAD(&sd->fifo_list[SYNC]);
-	INIT_LIST_HEAD(&sd->fifo_list[ASYNC]);
+	/* Initialize queue lists */
+	INIT_LIST_HEAD(&sd->rr_list[SYNC]);
+	INIT_LIST_HEAD(&sd->rr_list[ASYNC]);
+	for (i = 0; i < ARRAY_SIZE(sd->hash); i++)
+		INIT_HLIST_HEAD(&sd->hash[i]);
+	sio_init_sio_queue(&sd->shared[SYNC], NULL, SYNC);
+	sio_init_sio_queue(&sd->shared[ASYNC], NULL, ASYNC);
 
 	/* Initialize data */
 	sd->batched = 0;
+	sd->cur_class = SYNC;
+	sd->async_batch = fifo_batch;
+	sd->read_lat_us = 0;
 	sd->fifo_expire[SYNC] = sync_expire;
 	sd->fifo_expire[ASYNC] = async_expire;
 	sd->fifo_batch = fifo_batch;
+	sd->queue_quantum = queue_quantum;
+	sd->read_latency = read_latency;
 
 	return sd;
 }
@@ -235,8 +405,8 @@ sio_exit_queue(struct elevator_queue *e)
 {
 	struct sio_data *sd = e->elevator_data;
 
-	BUG_ON(!list_empty(&sd->fifo_list[SYNC]));
-	BUG_ON(!list_empty(&sd->fifo_list[ASYNC]));
+	BUG_ON(!list_empty(&sd->rr_list[SYNC]));
+	BUG_ON(!list_empty(&sd->rr_list[ASYNC]));
 
 	/* Free structure */
 	kfree(sd);
@@ -273,6 +443,9 @@ static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
 SHOW_FUNCTION(sio_sync_expire_show, sd->fifo_expire[SYNC], 1);
 SHOW_FUNCTION(sio_async_expire_show, sd->fifo_expire[ASYNC], 1);
 SHOW_FUNCTION(sio_fifo_batch_show, sd->fifo_batch, 0);
+SHOW_FUNCTION(sio_queue_quantum_show, sd->queue_quantum, 0);
+SHOW_FUNCTION(sio_read_latency_show, sd->read_latency, 0);
+SHOW_FUNCTION(sio_async_batch_show, sd->async_batch, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -293,9 +466,28 @@ static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)
 }
 STORE_FUNCTION(sio_sync_expire_store, &sd->fifo_expire[SYNC], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_async_expire_store, &sd->fifo_expire[ASYNC], 0, INT_MAX, 1);
-STORE_FUNCTION(sio_fifo_batch_store, &sd->fifo_batch, 0, INT_MAX, 0);
+STORE_FUNCTION(sio_queue_quantum_store, &sd->queue_quantum, 1, INT_MAX, 0);
+STORE_FUNCTION(sio_read_latency_store, &sd->read_latency, 0, 10000, 0);
 #undef STORE_FUNCTION
 
+static ssize_t
+sio_fifo_batch_store(struct elevator_queue *e, const char *page, size_t count)
+{
+	struct sio_data *sd = e->elevator_data;
+	int data;
+	int ret = sio_var_store(&data, page, count);
+
+	if (data < 0)
+		data = 0;
+	sd->fifo_batch = data;
+
+	/* The async batch only ever shrinks below fifo_batch */
+	if (sd->async_batch > data)
+		sd->async_batch = data;
+
+	return ret;
+}
+
 #define DD_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, sio_##name##_show, \
 				      sio_##name##_store)
@@ -304,6 +496,9 @@ static struct elv_fs_entry sio_attrs[] = {
 	DD_ATTR(sync_expire),
 	DD_ATTR(async_expire),
 	DD_ATTR(fifo_batch),
+	DD_ATTR(queue_quantum),
+	DD_ATTR(read_latency),
+	__ATTR(async_batch, S_IRUGO, sio_async_batch_show, NULL),
 	__ATTR_NULL
 };
 
@@ -312,6 +507,7 @@ static struct elevator_type iosched_sio = {
 		.elevator_merge_req_fn		= sio_merged_requests,
 		.elevator_dispatch_fn		= sio_dispatch_requests,
 		.elevator_add_req_fn		= sio_add_request,
+		.elevator_completed_req_fn	= sio_completed_request,
 		.elevator_queue_empty_fn	= sio_queue_empty,
 		.elevator_former_req_fn		= sio_former_request,
 		.elevator_latter_req_fn		= sio_latter_request,
@@ -326,6 +522,10 @@ static struct elevator_type iosched_sio = {
 
 static int __init sio_init(void)
 {
+	sio_pool = KMEM_CACHE(sio_queue, 0);
+	if (!sio_pool)
+		return -ENOMEM;
+
 	/* Register elevator */
 	elv_register(&iosched_sio);
 
@@ -336,6 +536,8 @@ static void __exit sio_exit(void)
 {
 	/* Unregister elevator */
 	elv_unregister(&iosched_sio);
+
+	kmem_cache_destroy(sio_pool);
 }
 
 module_init(sio_init);
@@ -344,4 +546,3 @@ module_exit(sio_exit);
 MODULE_AUTHOR("Miguel Boton");
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Simple IO scheduler");
-
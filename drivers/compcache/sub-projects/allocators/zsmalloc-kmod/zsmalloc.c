@@ -0,0 +1,582 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped by size into classes 16 bytes apart. Each class
+ * carves "zspages" of one to four (not necessarily contiguous) pages
+ * into equally sized slots, choosing the zspage size that wastes the
+ * least space. An object may straddle two pages of its zspage, in which
+ * case it is mapped through a per-CPU bounce buffer.
+ *
+ * Users only get an opaque handle. Since the handle, not the object, is
+ * what they hold on to, objects can be moved from sparsely used zspages
+ * into others by zs_compact(), returning whole pages to the system.
+ */
+
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static u32 get_class_idx(size_t size)
+{
+	if (size <= ZS_MIN_CLASS_SIZE)
+		return 0;
+
+	return DIV_ROUND_UP(size - ZS_MIN_CLASS_SIZE, ZS_CLASS_DELTA);
+}
+
+static struct size_class *handle_class(struct zs_pool *pool,
+				struct zs_handle *h)
+{
+	return &pool->classes[get_class_idx(h->size + ZS_OBJ_HEADER_SIZE)];
+}
+
+/* Offset of object 'idx' from the start of its zspage */
+static unsigned long obj_offset(struct size_class *class, u32 idx)
+{
+	return (unsigned long)idx * class->size;
+}
+
+/*
+ * Map the header word of an object. Slots start at a multiple of
+ * ZS_CLASS_DELTA, so the word never crosses a page boundary.
+ */
+static unsigned long *obj_header_map(struct zspage *zspage, u32 idx,
+				enum km_type km)
+{
+	unsigned long off = obj_offset(zspage->class, idx);
+
+	return kmap_atomic(zspage->pages[off >> PAGE_SHIFT], km) +
+			(off & ~PAGE_MASK);
+}
+
+static void obj_header_unmap(unsigned long *hdr, enum km_type km)
+{
+	kunmap_atomic(hdr, km);
+}
+
+/* Copy len bytes between buf and offset 'off' of a zspage */
+static void zspage_copy(struct zspage *zspage, unsigned long off,
+			char *buf, size_t len, int to_zspage, enum km_type km)
+{
+	while (len) {
+		char *vaddr;
+		size_t n = min_t(size_t, len, PAGE_SIZE - (off & ~PAGE_MASK));
+
+		vaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], km) +
+				(off & ~PAGE_MASK);
+		if (to_zspage)
+			memcpy(vaddr, buf, n);
+		else
+			memcpy(buf, vaddr, n);
+		kunmap_atomic(vaddr, km);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/*
+ * Choose the no. of pages per zspage that leaves the least unused
+ * space at its end.
+ */
+static void init_size_class(struct size_class *class, u32 size)
+{
+	int i, best_used = 0;
+
+	class->size = size;
+	class->pages_per_zspage = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		u32 zspage_size = i * PAGE_SIZE;
+		int used = (zspage_size - zspage_size % size) * 100 /
+				zspage_size;
+
+		if (used > best_used) {
+			best_used = used;
+			class->pages_per_zspage = i;
+		}
+	}
+
+	class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE / size;
+
+	spin_lock_init(&class->lock);
+	INIT_LIST_HEAD(&class->partial);
+	INIT_LIST_HEAD(&class->full);
+}
+
+static void free_zspage(struct zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < zspage->class->pages_per_zspage; i++) {
+		if (zspage->pages[i])
+			__free_page(zspage->pages[i]);
+	}
+
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	int i;
+	u32 idx;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage) + class->pages_per_zspage *
+			sizeof(struct page *), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class;
+	INIT_LIST_HEAD(&zspage->list);
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i]) {
+			free_zspage(zspage);
+			return NULL;
+		}
+	}
+
+	/* Thread all slots onto the free list, in order */
+	for (idx = 0; idx < class->objs_per_zspage; idx++) {
+		unsigned long next, *hdr;
+
+		next = idx + 1 < class->objs_per_zspage ? idx + 1 : ZS_OBJ_END;
+		hdr = obj_header_map(zspage, idx, KM_USER0);
+		*hdr = next << 1 | ZS_OBJ_FREE;
+		obj_header_unmap(hdr, KM_USER0);
+	}
+	zspage->first_free = 0;
+
+	return zspage;
+}
+
+/* Take a free slot of zspage for handle h. Called with class lock held. */
+static void obj_alloc(struct size_class *class, struct zspage *zspage,
+			struct zs_handle *h)
+{
+	unsigned long *hdr;
+	u16 idx = zspage->first_free;
+
+	hdr = obj_header_map(zspage, idx, KM_USER0);
+	zspage->first_free = *hdr >> 1;
+	*hdr = (unsigned long)h;
+	obj_header_unmap(hdr, KM_USER0);
+
+	h->zspage = zspage;
+	h->idx = idx;
+
+	zspage->inuse++;
+	class->objs_inuse++;
+	class->used_bytes += h->size;
+
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+}
+
+/*
+ * Release the slot of handle h. Called with class lock held; the caller
+ * frees the zspage if it becomes empty.
+ */
+static void obj_free(struct size_class *class, struct zs_handle *h)
+{
+	unsigned long *hdr;
+	struct zspage *zspage = h->zspage;
+
+	hdr = obj_header_map(zspage, h->idx, KM_USER0);
+	*hdr = (unsigned long)zspage->first_free << 1 | ZS_OBJ_FREE;
+	obj_header_unmap(hdr, KM_USER0);
+
+	zspage->first_free = h->idx;
+
+	if (zspage->inuse-- == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+	class->objs_inuse--;
+	class->used_bytes -= h->size;
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ *
+ * Returns NULL if the pool could not be set up.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++)
+		init_size_class(&pool->classes[i],
+				ZS_MIN_CLASS_SIZE + i * ZS_CLASS_DELTA);
+
+	/* Slab cache names must be unique */
+	snprintf(pool->name, sizeof(pool->name), "zs_handle_%p", pool);
+	pool->handle_cache = kmem_cache_create(pool->name,
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!pool->handle_cache)
+		goto fail;
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+
+/**
+ * zs_destroy_pool - Destroys a pool.
+ * @pool: pool to destroy
+ *
+ * All objects must have been freed already.
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, cpu;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct zspage *zspage, *tmp;
+		struct size_class *class = &pool->classes[i];
+
+		WARN_ON(class->objs_inuse);
+		list_for_each_entry_safe(zspage, tmp, &class->partial, list)
+			free_zspage(zspage);
+		list_for_each_entry_safe(zspage, tmp, &class->full, list)
+			free_zspage(zspage);
+	}
+
+	if (pool->map_area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+		free_percpu(pool->map_area);
+	}
+
+	if (pool->handle_cache)
+		kmem_cache_destroy(pool->handle_cache);
+
+	kfree(pool);
+}
+
+/**
+ * zs_malloc - Allocate object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @flags: for the backing pages; may include __GFP_HIGHMEM
+ *
+ * Returns a handle for the object, or 0 on failure. Allocation
+ * requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct zs_handle *h;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	h = kmem_cache_alloc(pool->handle_cache, flags & ~__GFP_HIGHMEM);
+	if (!h)
+		return 0;
+
+	h->pin = 0;
+	h->size = size;
+	class = handle_class(pool, h);
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(class, flags);
+		if (!zspage) {
+			kmem_cache_free(pool->handle_cache, h);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+		class->zspages++;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	obj_alloc(class, zspage, h);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)h;
+}
+
+/**
+ * zs_free - Free object allocated with zs_malloc().
+ * @pool: pool the object belongs to
+ * @handle: as returned by zs_malloc()
+ *
+ * The object must not be mapped.
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct zspage *zspage;
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct size_class *class = handle_class(pool, h);
+
+	spin_lock(&class->lock);
+	zspage = h->zspage;
+	obj_free(class, h);
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		class->zspages--;
+	} else {
+		zspage = NULL;
+	}
+	spin_unlock(&class->lock);
+
+	if (zspage)
+		free_zspage(zspage);
+
+	kmem_cache_free(pool->handle_cache, h);
+}
+
+/**
+ * zs_map_object - Get a pointer to the contents of an object.
+ * @pool: pool the object belongs to
+ * @handle: as returned by zs_malloc()
+ * @mm: how the mapping is going to be used
+ *
+ * The object stays pinned, and preemption disabled, until the matching
+ * zs_unmap_object(). Only one object can be mapped at a time on a CPU.
+ * This uses the KM_USER1 atomic kmap slot.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	unsigned long off;
+	struct zs_map_area *area;
+	struct zs_handle *h = (struct zs_handle *)handle;
+
+	/* Compaction does not move pinned objects */
+	bit_spin_lock(ZS_HANDLE_PIN, &h->pin);
+
+	off = obj_offset(h->zspage->class, h->idx) + ZS_OBJ_HEADER_SIZE;
+	area = this_cpu_ptr(pool->map_area);
+	area->mm = mm;
+
+	if ((off & ~PAGE_MASK) + h->size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(h->zspage->pages[off >> PAGE_SHIFT],
+					KM_USER1);
+		return area->vaddr + (off & ~PAGE_MASK);
+	}
+
+	/* Object spans two pages */
+	area->vaddr = NULL;
+	if (mm != ZS_MM_WO)
+		zspage_copy(h->zspage, off, area->buf, h->size, 0, KM_USER1);
+
+	return area->buf;
+}
+
+/**
+ * zs_unmap_object - Release a mapping done by zs_map_object().
+ * @pool: pool the object belongs to
+ * @handle: as returned by zs_malloc()
+ */
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned long off;
+	struct zs_map_area *area;
+	struct zs_handle *h = (struct zs_handle *)handle;
+
+	area = this_cpu_ptr(pool->map_area);
+
+	if (area->vaddr) {
+		kunmap_atomic(area->vaddr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		off = obj_offset(h->zspage->class, h->idx) +
+				ZS_OBJ_HEADER_SIZE;
+		zspage_copy(h->zspage, off, area->buf, h->size, 1, KM_USER1);
+	}
+
+	bit_spin_unlock(ZS_HANDLE_PIN, &h->pin);
+}
+
+size_t zs_get_object_size(struct zs_pool *pool, unsigned long handle)
+{
+	return ((struct zs_handle *)handle)->size;
+}
+
+/*
+ * Returns total memory used by allocator (pages backing zspages; handles
+ * and zspage descriptors are not counted).
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	int i;
+	u64 pages = 0;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++)
+		pages += pool->classes[i].zspages *
+				pool->classes[i].pages_per_zspage;
+
+	return pages << PAGE_SHIFT;
+}
+
+/* Returns sum of the sizes of all objects currently allocated */
+u64 zs_get_used_size_bytes(struct zs_pool *pool)
+{
+	int i;
+	u64 used = 0;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++)
+		used += pool->classes[i].used_bytes;
+
+	return used;
+}
+
+/*
+ * Move the object in slot 'idx' of src to another zspage of the class.
+ * Called with class lock held and src off the class lists. Returns 0
+ * if the object is mapped and cannot be moved now.
+ */
+static int migrate_obj(struct size_class *class, struct zspage *src,
+			u32 idx, char *buf)
+{
+	unsigned long val, *hdr;
+	struct zspage *dst;
+	struct zs_handle *h;
+
+	hdr = obj_header_map(src, idx, KM_USER0);
+	val = *hdr;
+	obj_header_unmap(hdr, KM_USER0);
+
+	if (val & ZS_OBJ_FREE)
+		return 1;
+
+	h = (struct zs_handle *)val;
+	if (!bit_spin_trylock(ZS_HANDLE_PIN, &h->pin))
+		return 0;
+
+	zspage_copy(src, obj_offset(class, idx) + ZS_OBJ_HEADER_SIZE,
+			buf, h->size, 0, KM_USER1);
+	obj_free(class, h);
+
+	dst = list_first_entry(&class->partial, struct zspage, list);
+	obj_alloc(class, dst, h);
+	zspage_copy(dst, obj_offset(class, h->idx) + ZS_OBJ_HEADER_SIZE,
+			buf, h->size, 1, KM_USER1);
+
+	bit_spin_unlock(ZS_HANDLE_PIN, &h->pin);
+	return 1;
+}
+
+/*
+ * Repeatedly empty the least used partial zspage into the others, as
+ * long as they have room for all of its objects.
+ */
+static unsigned long compact_class(struct size_class *class, char *buf)
+{
+	u32 idx;
+	unsigned long free_objs, freed = 0;
+	struct zspage *src, *zspage;
+
+	spin_lock(&class->lock);
+	for (;;) {
+		src = NULL;
+		list_for_each_entry(zspage, &class->partial, list) {
+			if (!src || zspage->inuse < src->inuse)
+				src = zspage;
+		}
+		if (!src)
+			break;
+
+		/* Free slots outside src; full zspages have none */
+		free_objs = class->zspages * class->objs_per_zspage -
+				class->objs_inuse -
+				(class->objs_per_zspage - src->inuse);
+		if (free_objs < src->inuse)
+			break;
+
+		/* Neither zs_malloc() nor migrate_obj() may pick src now */
+		list_del_init(&src->list);
+
+		for (idx = 0; src->inuse && idx < class->objs_per_zspage;
+				idx++) {
+			if (!migrate_obj(class, src, idx, buf))
+				break;
+		}
+
+		if (src->inuse) {
+			list_add(&src->list, &class->partial);
+			break;
+		}
+
+		class->zspages--;
+		spin_unlock(&class->lock);
+
+		free_zspage(src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Return sparsely used zspages to the system.
+ * @pool: pool to compact
+ *
+ * Moves objects so that partially used zspages of each class are
+ * merged. Objects mapped at the time are left alone. May sleep.
+ *
+ * Returns the no. of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	char *buf;
+	unsigned long freed = 0;
+
+	buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+	if (!buf)
+		return 0;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++)
+		freed += compact_class(&pool->classes[i], buf);
+
+	kfree(buf);
+	return freed;
+}
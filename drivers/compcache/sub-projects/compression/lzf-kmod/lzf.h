@@ -0,0 +1,34 @@
+#ifndef __LZF_H__
+#define __LZF_H__
+/*
+ *  LZF-style fast compressor for zram
+ *
+ *  A single-pass LZ77 coder with a small hash table and no entropy
+ *  stage. It trades compression ratio for speed compared to LZO1X-1.
+ *  The stream format is that of liblzf by Marc Lehmann:
+ *
+ *    000LLLLL <L+1 literal bytes>
+ *    LLLooooo oooooooo               match, length L+2 (L = 1..6)
+ *    111ooooo LLLLLLLL oooooooo      match, length L+9
+ *
+ *  Offsets are stored minus one and reach back at most 8K.
+ */
+
+#define LZF_HLOG		12
+#define LZF_MEM_COMPRESS	((1 << LZF_HLOG) * sizeof(u16))
+
+#define lzf_worst_compress(x)	((x) + ((x) / 32) + 1)
+
+/*
+ * This requires 'wrkmem' of size LZF_MEM_COMPRESS. On entry *dst_len
+ * holds the size of dst; -E2BIG is returned if the output does not fit.
+ * Input must be smaller than 64K.
+ */
+int lzf_compress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/* safe decompression with overrun testing */
+int lzf_decompress_safe(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ *  LZF-style fast compressor for zram
+ *
+ *  Stream format compatible with liblzf,
+ *  Copyright (C) 2000-2008 Marc Alexander Lehmann <schmorp@schmorp.de>
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/hash.h>
+
+#include "lzf.h"
+
+#define LZF_MAX_LIT	(1 << 5)
+#define LZF_MAX_OFF	(1 << 13)
+#define LZF_MAX_REF	((1 << 8) + (1 << 3))
+
+static inline u32 lzf_hash(const unsigned char *p)
+{
+	return hash_32((p[0] << 16) | (p[1] << 8) | p[2], LZF_HLOG);
+}
+
+int lzf_compress(const unsigned char *in, size_t in_len,
+			unsigned char *out, size_t *out_len, void *wrkmem)
+{
+	const unsigned char * const in_end = in + in_len;
+	unsigned char * const out_end = out + *out_len;
+	const unsigned char *ip = in;
+	unsigned char *op = out;
+	u16 *htab = wrkmem;
+	int lit = 0;
+
+	if (unlikely(in_len >= 0x10000))
+		return -EINVAL;
+
+	/*
+	 * The hash table is not cleared between calls: a stale entry only
+	 * costs a failed match since every candidate is verified below.
+	 */
+
+	/* Reserve the control byte of the first literal run */
+	op++;
+
+	while (ip + 2 < in_end) {
+		u32 h = lzf_hash(ip);
+		const unsigned char *ref = in + htab[h];
+		size_t off = ip - ref - 1;
+
+		htab[h] = ip - in;
+
+		if (ref < ip && off < LZF_MAX_OFF &&
+				ref[0] == ip[0] && ref[1] == ip[1] &&
+				ref[2] == ip[2]) {
+			size_t len = 3;
+			size_t maxlen = min_t(size_t, in_end - ip,
+						LZF_MAX_REF);
+
+			while (len < maxlen && ref[len] == ip[len])
+				len++;
+
+			/* Close the pending literal run, or drop its byte */
+			if (lit)
+				op[-lit - 1] = lit - 1;
+			else
+				op--;
+
+			if (op + 3 > out_end)
+				return -E2BIG;
+
+			len -= 2;
+			if (len < 7) {
+				*op++ = (off >> 8) + (len << 5);
+			} else {
+				*op++ = (off >> 8) + (7 << 5);
+				*op++ = len - 7;
+			}
+			*op++ = off;
+
+			lit = 0;
+			op++;
+			ip += len + 2;
+			continue;
+		}
+
+		if (op >= out_end)
+			return -E2BIG;
+
+		*op++ = *ip++;
+		if (++lit == LZF_MAX_LIT) {
+			op[-lit - 1] = lit - 1;
+			lit = 0;
+			op++;
+		}
+	}
+
+	while (ip < in_end) {
+		if (op >= out_end)
+			return -E2BIG;
+
+		*op++ = *ip++;
+		if (++lit == LZF_MAX_LIT) {
+			op[-lit - 1] = lit - 1;
+			lit = 0;
+			op++;
+		}
+	}
+
+	if (lit)
+		op[-lit - 1] = lit - 1;
+	else
+		op--;
+
+	*out_len = op - out;
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ *  LZF-style decompressor for zram
+ *
+ *  Stream format compatible with liblzf,
+ *  Copyright (C) 2000-2008 Marc Alexander Lehmann <schmorp@schmorp.de>
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+
+#include "lzf.h"
+
+int lzf_decompress_safe(const unsigned char *in, size_t in_len,
+			unsigned char *out, size_t *out_len)
+{
+	const unsigned char * const ip_end = in + in_len;
+	unsigned char * const op_end = out + *out_len;
+	const unsigned char *ip = in;
+	unsigned char *op = out;
+
+	*out_len = 0;
+
+	while (ip < ip_end) {
+		unsigned int ctrl = *ip++;
+		size_t len, off;
+
+		if (ctrl < (1 << 5)) {
+			/* Literal run */
+			len = ctrl + 1;
+			if (unlikely((size_t)(ip_end - ip) < len))
+				return -EINVAL;
+			if (unlikely((size_t)(op_end - op) < len))
+				return -E2BIG;
+
+			memcpy(op, ip, len);
+			op += len;
+			ip += len;
+			continue;
+		}
+
+		/* Back reference */
+		len = ctrl >> 5;
+		if (len == 7) {
+			if (unlikely(ip >= ip_end))
+				return -EINVAL;
+			len += *ip++;
+		}
+		len += 2;
+
+		if (unlikely(ip >= ip_end))
+			return -EINVAL;
+		off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+
+		if (unlikely(off > (size_t)(op - out)))
+			return -EINVAL;
+		if (unlikely((size_t)(op_end - op) < len))
+			return -E2BIG;
+
+		/* Source and destination may overlap: copy bytewise */
+		do {
+			*op = op[-off];
+			op++;
+		} while (--len);
+	}
+
+	*out_len = op - out;
+	return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/lzo.h>
+#include <linux/zlib.h>
+
+#include "sub-projects/compression/lzf-kmod/lzf.h"
+#include "zram_comp.h"
+
+#if (defined(CONFIG_ZLIB_DEFLATE) || defined(CONFIG_ZLIB_DEFLATE_MODULE)) && \
+	(defined(CONFIG_ZLIB_INFLATE) || defined(CONFIG_ZLIB_INFLATE_MODULE))
+#define ZRAM_HAVE_DEFLATE
+#endif
+
+/* lzo: the original zram compressor, good balance of speed and ratio */
+
+static void *zram_lzo_create(void)
+{
+	return kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+}
+
+static void zram_lzo_destroy(void *private)
+{
+	kfree(private);
+}
+
+static int zram_lzo_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private)
+{
+	return lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, private);
+}
+
+static int zram_lzo_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *private)
+{
+	return lzo1x_decompress_safe(src, src_len, dst, dst_len);
+}
+
+static const struct zram_backend zram_lzo = {
+	.name		= "lzo",
+	.create		= zram_lzo_create,
+	.destroy	= zram_lzo_destroy,
+	.compress	= zram_lzo_compress,
+	.decompress	= zram_lzo_decompress,
+};
+
+/* lzf: faster than lzo, somewhat worse ratio */
+
+static void *zram_lzf_create(void)
+{
+	return kzalloc(LZF_MEM_COMPRESS, GFP_KERNEL);
+}
+
+static int zram_lzf_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private)
+{
+	return lzf_compress(src, PAGE_SIZE, dst, dst_len, private);
+}
+
+static int zram_lzf_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *private)
+{
+	return lzf_decompress_safe(src, src_len, dst, dst_len);
+}
+
+static const struct zram_backend zram_lzf = {
+	.name		= "lzf",
+	.create		= zram_lzf_create,
+	.destroy	= zram_lzo_destroy,
+	.compress	= zram_lzf_compress,
+	.decompress	= zram_lzf_decompress,
+};
+
+#ifdef ZRAM_HAVE_DEFLATE
+/*
+ * deflate: best ratio, several times slower than lzo. Raw deflate
+ * (no zlib header) with a 4K window, which covers a whole page.
+ */
+#define ZRAM_DEFLATE_LEVEL	Z_BEST_COMPRESSION
+#define ZRAM_DEFLATE_WINBITS	12
+
+struct zram_deflate {
+	struct z_stream_s def;
+	struct z_stream_s inf;
+};
+
+static void zram_deflate_destroy(void *private)
+{
+	struct zram_deflate *zd = private;
+
+	if (!zd)
+		return;
+
+	if (zd->def.workspace) {
+		zlib_deflateEnd(&zd->def);
+		vfree(zd->def.workspace);
+	}
+	if (zd->inf.workspace) {
+		zlib_inflateEnd(&zd->inf);
+		vfree(zd->inf.workspace);
+	}
+	kfree(zd);
+}
+
+static void *zram_deflate_create(void)
+{
+	struct zram_deflate *zd;
+
+	zd = kzalloc(sizeof(*zd), GFP_KERNEL);
+	if (!zd)
+		return NULL;
+
+	zd->def.workspace = vmalloc(zlib_deflate_workspacesize());
+	if (!zd->def.workspace)
+		goto fail;
+	if (zlib_deflateInit2(&zd->def, ZRAM_DEFLATE_LEVEL, Z_DEFLATED,
+			-ZRAM_DEFLATE_WINBITS, MAX_MEM_LEVEL,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		vfree(zd->def.workspace);
+		zd->def.workspace = NULL;
+		goto fail;
+	}
+
+	zd->inf.workspace = vmalloc(zlib_inflate_workspacesize());
+	if (!zd->inf.workspace)
+		goto fail;
+	if (zlib_inflateInit2(&zd->inf, -ZRAM_DEFLATE_WINBITS) != Z_OK) {
+		vfree(zd->inf.workspace);
+		zd->inf.workspace = NULL;
+		goto fail;
+	}
+
+	return zd;
+
+fail:
+	zram_deflate_destroy(zd);
+	return NULL;
+}
+
+static int zram_deflate_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private)
+{
+	struct z_stream_s *strm = &((struct zram_deflate *)private)->def;
+	int ret;
+
+	ret = zlib_deflateReset(strm);
+	if (ret != Z_OK)
+		return -EINVAL;
+
+	strm->next_in = src;
+	strm->avail_in = PAGE_SIZE;
+	strm->next_out = dst;
+	strm->avail_out = *dst_len;
+
+	ret = zlib_deflate(strm, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		return -EINVAL;
+
+	*dst_len = strm->total_out;
+	return 0;
+}
+
+static int zram_deflate_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *private)
+{
+	struct z_stream_s *strm = &((struct zram_deflate *)private)->inf;
+	int ret;
+
+	ret = zlib_inflateReset(strm);
+	if (ret != Z_OK)
+		return -EINVAL;
+
+	strm->next_in = src;
+	strm->avail_in = src_len;
+	strm->next_out = dst;
+	strm->avail_out = *dst_len;
+
+	ret = zlib_inflate(strm, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		return -EINVAL;
+
+	*dst_len = strm->total_out;
+	return 0;
+}
+
+static const struct zram_backend zram_deflate = {
+	.name		= "deflate",
+	.create		= zram_deflate_create,
+	.destroy	= zram_deflate_destroy,
+	.compress	= zram_deflate_compress,
+	.decompress	= zram_deflate_decompress,
+	.needs_private_decompress = 1,
+};
+#endif
+
+static const struct zram_backend *zram_backends[] = {
+	&zram_lzo,
+	&zram_lzf,
+#ifdef ZRAM_HAVE_DEFLATE
+	&zram_deflate,
+#endif
+	NULL
+};
+
+const struct zram_backend *zram_backend_find(const char *name)
+{
+	int i;
+
+	for (i = 0; zram_backends[i]; i++) {
+		if (sysfs_streq(name, zram_backends[i]->name))
+			return zram_backends[i];
+	}
+
+	return NULL;
+}
+
+/* List backends, current one in brackets: "lzo [lzf] deflate" */
+ssize_t zram_backend_show(const struct zram_backend *cur, char *buf)
+{
+	int i;
+	ssize_t len = 0;
+
+	for (i = 0; zram_backends[i]; i++) {
+		const char *fmt = zram_backends[i] == cur ? "[%s] " : "%s ";
+
+		len += sprintf(buf + len, fmt, zram_backends[i]->name);
+	}
+
+	/* Replace the trailing space */
+	buf[len - 1] = '\n';
+
+	return len;
+}
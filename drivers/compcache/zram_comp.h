@@ -0,0 +1,46 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_COMP_H_
+#define _ZRAM_COMP_H_
+
+#include <linux/types.h>
+
+/*
+ * Compression backend. Each compression stream owns one private state
+ * object, returned by create(), which is passed to compress() and, when
+ * needs_private_decompress is set, to decompress(). Backends without
+ * that flag are called on the read path with a NULL state and must be
+ * safe to run concurrently.
+ *
+ * compress() always gets a PAGE_SIZE input; on entry *dst_len holds the
+ * room available in dst. Both calls return 0 on success.
+ */
+struct zram_backend {
+	const char *name;
+	void *(*create)(void);
+	void (*destroy)(void *private);
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *private);
+	int needs_private_decompress;
+};
+
+#define ZRAM_DEFAULT_BACKEND	"lzo"
+
+const struct zram_backend *zram_backend_find(const char *name);
+ssize_t zram_backend_show(const struct zram_backend *cur, char *buf);
+
+#endif
@@ -19,15 +19,20 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -38,14 +43,22 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+/*
+ * Writes to different pages now run in parallel, so the 32-bit counters
+ * need the same protection as the 64-bit ones.
+ */
+static void zram_stat_inc(struct zram *zram, u32 *v)
 {
+	spin_lock(&zram->stat64_lock);
 	*v = *v + 1;
+	spin_unlock(&zram->stat64_lock);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(struct zram *zram, u32 *v)
 {
+	spin_lock(&zram->stat64_lock);
 	*v = *v - 1;
+	spin_unlock(&zram->stat64_lock);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -85,6 +98,16 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
+static void zram_lock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_lock(index, zram->slot_locks);
+}
+
+static void zram_unlock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(index, zram->slot_locks);
+}
+
 static int page_zero_filled(void *ptr)
 {
 	unsigned int pos;
@@ -129,48 +152,245 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+static u32 zram_page_checksum(void *mem)
+{
+	return jhash2(mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_table[checksum & zram->dedup_mask];
+}
+
+static void zram_obj_info(struct zram *zram, unsigned long handle,
+			size_t *clen, u32 *checksum)
+{
+	struct zobj_header *zheader;
+
+	zheader = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	*checksum = zheader->checksum;
+	zs_unmap_object(zram->mem_pool, handle);
+
+	*clen = zs_get_object_size(zram->mem_pool, handle) - sizeof(*zheader);
+}
+
+/*
+ * Index a newly stored object. If we cannot allocate the node the object
+ * simply stays private to its table entry.
+ */
+static void zram_dedup_insert(struct zram *zram, u32 checksum,
+			unsigned long handle, size_t clen)
+{
+	struct zram_dedup *zd;
+
+	zd = kmalloc(sizeof(*zd), GFP_NOIO);
+	if (!zd)
+		return;
+
+	zd->handle = handle;
+	zd->checksum = checksum;
+	zd->clen = clen;
+	zd->refcount = 1;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_add_head(&zd->node, zram_dedup_bucket(zram, checksum));
+	spin_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Find a stored object with the given checksum and take a reference so
+ * that it stays around while the caller compares contents.
+ */
+static struct zram_dedup *zram_dedup_get(struct zram *zram, u32 checksum)
+{
+	struct zram_dedup *zd;
+	struct hlist_node *pos;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(zd, pos, zram_dedup_bucket(zram, checksum), node) {
+		if (zd->checksum == checksum) {
+			zd->refcount++;
+			spin_unlock(&zram->dedup_lock);
+			return zd;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return NULL;
+}
+
+/*
+ * Drop a reference to the object. Returns 1 if it was the last one and
+ * the caller must free the object.
+ */
+static int zram_dedup_put(struct zram *zram, u32 checksum,
+			unsigned long handle)
+{
+	int last = 1;
+	struct zram_dedup *zd;
+	struct hlist_node *pos;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(zd, pos, zram_dedup_bucket(zram, checksum), node) {
+		if (zd->handle == handle) {
+			last = !--zd->refcount;
+			if (last) {
+				hlist_del(&zd->node);
+				kfree(zd);
+			}
+			break;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return last;
+}
+
+static void zram_free_obj(struct zram *zram, unsigned long handle,
+			size_t clen)
+{
+	zs_free(zram->mem_pool, handle);
+	if (clen <= PAGE_SIZE / 2)
+		zram_stat_dec(zram, &zram->stats.good_compress);
+	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+}
+
+/* Slot 0 is never handed out, so a written back entry is never empty */
+static unsigned long zram_bd_alloc_block(struct zram *zram)
+{
+	unsigned long block = 1;
+
+	do {
+		block = find_next_zero_bit(zram->bd_bitmap, zram->bd_pages,
+					block);
+		if (block >= zram->bd_pages)
+			return 0;
+	} while (test_and_set_bit(block, zram->bd_bitmap));
+
+	return block;
+}
+
+static void zram_bd_free_block(struct zram *zram, unsigned long block)
+{
+	clear_bit(block, zram->bd_bitmap);
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_bd_rw(struct zram *zram, int rw, unsigned long block,
+			struct page *page)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bd_read {
+	struct work_struct work;
+	struct zram *zram;
+	unsigned long block;
+	struct page *page;
+	int ret;
+};
+
+static void zram_bd_read_work(struct work_struct *work)
+{
+	struct zram_bd_read *rd = container_of(work, struct zram_bd_read,
+						work);
+
+	rd->ret = zram_bd_rw(rd->zram, READ_SYNC, rd->block, rd->page);
+}
+
+/*
+ * zram_read() runs from our make_request function, where bios we submit
+ * are only dispatched once it returns (current->bio_list). Waiting for
+ * one there would deadlock, so a worker does the synchronous read.
+ */
+static int zram_bd_read(struct zram *zram, unsigned long block,
+			struct page *page)
+{
+	struct zram_bd_read rd = {
+		.zram	= zram,
+		.block	= block,
+		.page	= page,
+	};
+
+	INIT_WORK_ON_STACK(&rd.work, zram_bd_read_work);
+	schedule_work(&rd.work);
+	flush_work(&rd.work);
+	destroy_work_on_stack(&rd.work);
+
+	return rd.ret;
+}
+
+/* Called with the slot locked */
 static void zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
+	size_t clen;
+	u32 checksum;
 
 	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	unsigned long handle = zram->table[index].handle;
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_bd_free_block(zram, zram->table[index].bd_block);
+		zram_stat_dec(zram, &zram->stats.pages_wb);
+		goto clear;
+	}
 
 	if (unlikely(!page)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
 		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
-		return;
+		if (zram_test_flag(zram, index, ZRAM_ZERO))
+			zram_stat_dec(zram, &zram->stats.pages_zero);
+		goto clear;
 	}
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
 		__free_page(page);
-		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat_dec(zram, &zram->stats.pages_expand);
+		zram_stat64_sub(zram, &zram->stats.compr_size, PAGE_SIZE);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+	zram_obj_info(zram, handle, &clen, &checksum);
+	if (zram_dedup_put(zram, checksum, handle))
+		zram_free_obj(zram, handle, clen);
+	else
+		zram_stat64_sub(zram, &zram->stats.dedup_saved, clen);
 
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
-	zram_stat_dec(&zram->stats.pages_stored);
+	zram_stat_dec(zram, &zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+clear:
+	zram->table[index].handle = 0;
+	zram->table[index].flags = 0;
 }
 
 static void zram_discard(struct zram *zram, struct bio *bio)
@@ -183,8 +403,11 @@ static void zram_discard(struct zram *zram, struct bio *bio)
 	npages = bio->bi_size / PAGE_SIZE;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	for (i = 0; i < npages; i++)
-		zram_free_page(zram, index++);
+	for (i = 0; i < npages; i++, index++) {
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
+		zram_unlock_slot(zram, index);
+	}
 
 out:
 	zram_stat64_inc(zram, &zram->stats.discard);
@@ -208,8 +431,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -218,6 +440,135 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
+static void zram_free_streams(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_stream *zstrm = per_cpu_ptr(zram->streams, cpu);
+
+		if (zstrm->private)
+			zram->backend->destroy(zstrm->private);
+		free_pages((unsigned long)zstrm->buffer, 1);
+	}
+
+	free_percpu(zram->streams);
+	zram->streams = NULL;
+}
+
+static int zram_alloc_streams(struct zram *zram)
+{
+	int cpu;
+
+	zram->streams = alloc_percpu(struct zram_stream);
+	if (!zram->streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_stream *zstrm = per_cpu_ptr(zram->streams, cpu);
+
+		mutex_init(&zstrm->lock);
+		zstrm->private = zram->backend->create();
+		zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL |
+							__GFP_ZERO, 1);
+		if (!zstrm->private || !zstrm->buffer) {
+			zram_free_streams(zram);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Grab the compression stream of the current CPU. We may be migrated
+ * while using it, in which case another writer on this CPU waits for us;
+ * that is counted as contention.
+ */
+static struct zram_stream *zram_get_stream(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	zstrm = per_cpu_ptr(zram->streams, raw_smp_processor_id());
+	if (!mutex_trylock(&zstrm->lock)) {
+		this_cpu_add(zram->pcpu_stats->stream_contended, 1);
+		mutex_lock(&zstrm->lock);
+	}
+
+	return zstrm;
+}
+
+static void zram_put_stream(struct zram_stream *zstrm)
+{
+	mutex_unlock(&zstrm->lock);
+}
+
+static void zram_reset_pcpu_stats(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->pcpu_stats)
+		return;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(zram->pcpu_stats, cpu), 0,
+			sizeof(struct zram_pcpu_stats));
+}
+
+/*
+ * Look for an identical page that is already stored and, on a hit, make
+ * the table entry share its object. Called with the stream held; no
+ * atomic kmaps may be held since we may end up in zs_free().
+ */
+static int zram_dedup_match(struct zram *zram, struct zram_stream *zstrm,
+			struct page *user_page, u32 checksum, u32 index)
+{
+	int ret;
+	size_t clen, dlen = PAGE_SIZE;
+	unsigned long handle;
+	struct zram_dedup *zd;
+	unsigned char *user_mem, *cmem;
+
+	zd = zram_dedup_get(zram, checksum);
+	if (!zd)
+		return 0;
+
+	/* These never change and our reference keeps zd alive */
+	handle = zd->handle;
+	clen = zd->clen;
+
+	/* Checksums can collide: compare the actual contents */
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = zram->backend->decompress(cmem + sizeof(struct zobj_header),
+			clen, zstrm->buffer, &dlen, zstrm->private);
+	zs_unmap_object(zram->mem_pool, handle);
+
+	if (!ret && dlen == PAGE_SIZE) {
+		user_mem = kmap_atomic(user_page, KM_USER0);
+		ret = memcmp(zstrm->buffer, user_mem, PAGE_SIZE);
+		kunmap_atomic(user_mem, KM_USER0);
+	}
+
+	if (ret || dlen != PAGE_SIZE) {
+		if (zram_dedup_put(zram, checksum, handle))
+			zram_free_obj(zram, handle, clen);
+		return 0;
+	}
+
+	zram_lock_slot(zram, index);
+	zram->table[index].handle = handle;
+	zram_unlock_slot(zram, index);
+
+	zram_stat_inc(zram, &zram->stats.pages_stored);
+	zram_stat64_inc(zram, &zram->stats.dedup_hits);
+	zram_stat64_add(zram, &zram->stats.dedup_saved, clen);
+
+	return 1;
+}
+
 static int zram_read(struct zram *zram, struct bio *bio)
 {
 	int i;
@@ -230,56 +581,100 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		return 0;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
+	this_cpu_add(zram->pcpu_stats->num_reads, 1);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
 		size_t clen;
+		ktime_t start;
+		unsigned long block, handle;
 		struct page *page;
 		struct zobj_header *zheader;
+		struct zram_stream *zstrm = NULL;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
 
+		/* Stateful decompressors borrow a stream, others run lockless */
+		if (zram->backend->needs_private_decompress)
+			zstrm = zram_get_stream(zram);
+
+		zram_lock_slot(zram, index);
+		zram_clear_flag(zram, index, ZRAM_IDLE);
+
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+			zram_unlock_slot(zram, index);
 			handle_zero_page(page);
-			index++;
-			continue;
+			goto next;
+		}
+
+		/* Page was written back: fetch it from the backing device */
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			block = zram->table[index].bd_block;
+			zram_unlock_slot(zram, index);
+			if (zstrm) {
+				zram_put_stream(zstrm);
+				zstrm = NULL;
+			}
+
+			ret = zram_bd_read(zram, block, page);
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! err=%d, "
+					"page=%u\n", ret, index);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_reads);
+				goto out;
+			}
+
+			zram_stat64_inc(zram, &zram->stats.bd_reads);
+			flush_dcache_page(page);
+			goto next;
 		}
 
 		/* Requested page is not present in compressed area */
 		if (unlikely(!zram->table[index].page)) {
+			zram_unlock_slot(zram, index);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
-			index++;
-			continue;
+			goto next;
 		}
 
 		/* Page is stored uncompressed since it's incompressible */
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
+			zram_unlock_slot(zram, index);
+			goto next;
 		}
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		clen = PAGE_SIZE;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		handle = zram->table[index].handle;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
-		ret = lzo1x_decompress_safe(
+		start = ktime_get();
+		ret = zram->backend->decompress(
 			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
-
+			zs_get_object_size(zram->mem_pool, handle) -
+				sizeof(*zheader),
+			user_mem, &clen, zstrm ? zstrm->private : NULL);
+		this_cpu_add(zram->pcpu_stats->decompr_time,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+		this_cpu_add(zram->pcpu_stats->pages_decompressed, 1);
+
+		zs_unmap_object(zram->mem_pool, handle);
 		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		zram_unlock_slot(zram, index);
+
+		if (zstrm) {
+			zram_put_stream(zstrm);
+			zstrm = NULL;
+		}
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -287,6 +682,9 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		}
 
 		flush_dcache_page(page);
+next:
+		if (zstrm)
+			zram_put_stream(zstrm);
 		index++;
 	}
 
@@ -315,42 +713,64 @@ static int zram_write(struct zram *zram, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
+		u32 checksum;
 		size_t clen;
+		ktime_t start;
+		unsigned long handle;
 		struct zobj_header *zheader;
 		struct page *page, *page_store;
+		struct zram_stream *zstrm;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
 		/*
 		 * System overwrites unused sectors. Free memory associated
 		 * with this sector now.
 		 */
+		zram_lock_slot(zram, index);
 		if (zram->table[index].page ||
 				zram_test_flag(zram, index, ZRAM_ZERO))
 			zram_free_page(zram, index);
+		zram_unlock_slot(zram, index);
 
-		mutex_lock(&zram->lock);
+		zstrm = zram_get_stream(zram);
+		src = zstrm->buffer;
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
+			zram_put_stream(zstrm);
+			zram_stat_inc(zram, &zram->stats.pages_zero);
+			zram_lock_slot(zram, index);
 			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram_unlock_slot(zram, index);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		checksum = zram_page_checksum(user_mem);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		if (zram_dedup_match(zram, zstrm, page, checksum, index)) {
+			zram_put_stream(zstrm);
+			index++;
+			continue;
+		}
+
+		user_mem = kmap_atomic(page, KM_USER0);
+		clen = 2 * PAGE_SIZE;
+		start = ktime_get();
+		ret = zram->backend->compress(user_mem, src, &clen,
+					zstrm->private);
+		this_cpu_add(zram->pcpu_stats->compr_time,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+		this_cpu_add(zram->pcpu_stats->pages_compressed, 1);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_put_stream(zstrm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
@@ -365,7 +785,7 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
+				zram_put_stream(zstrm);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -373,52 +793,53 @@ static int zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
+			zram_stat_inc(zram, &zram->stats.pages_expand);
+
+			user_mem = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, user_mem, PAGE_SIZE);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(user_mem, KM_USER0);
+
+			zram_lock_slot(zram, index);
 			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_unlock_slot(zram, index);
+			goto update_stats;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader),
+				GFP_NOIO | __GFP_HIGHMEM);
+		if (!handle) {
+			zram_put_stream(zstrm);
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		zheader = (struct zobj_header *)cmem;
+		zheader->checksum = checksum;
+		memcpy(cmem + sizeof(*zheader), src, clen);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
-#endif
+		zs_unmap_object(zram->mem_pool, handle);
 
-		memcpy(cmem, src, clen);
+		/* Index it before it becomes visible, and freeable, in table */
+		zram_dedup_insert(zram, checksum, handle, clen);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		zram_lock_slot(zram, index);
+		zram->table[index].handle = handle;
+		zram_unlock_slot(zram, index);
 
-		/* Update stats */
+update_stats:
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
-		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_inc(zram, &zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+			zram_stat_inc(zram, &zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
+		zram_put_stream(zstrm);
 		index++;
 	}
 
@@ -480,6 +901,22 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+static void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	close_bdev_exclusive(zram->bdev, FMODE_READ | FMODE_WRITE);
+	zram->bdev = NULL;
+
+	vfree(zram->bd_bitmap);
+	zram->bd_bitmap = NULL;
+	zram->bd_pages = 0;
+
+	kfree(zram->bdev_path);
+	zram->bdev_path = NULL;
+}
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
@@ -488,37 +925,50 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_free_streams(zram);
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+	for (index = 0; zram->table &&
+			index < zram->disksize >> PAGE_SHIFT; index++) {
+		unsigned long handle;
+		size_t clen;
+		u32 checksum;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		handle = zram->table[index].handle;
 
-		if (!page)
+		/* Backing device slots go away with the device below */
+		if (!handle || zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+			__free_page(zram->table[index].page);
+			continue;
+		}
+
+		/* Shared objects are freed with their last reference */
+		zram_obj_info(zram, handle, &clen, &checksum);
+		if (zram_dedup_put(zram, checksum, handle))
+			zs_free(zram->mem_pool, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	vfree(zram->slot_locks);
+	zram->slot_locks = NULL;
+
+	vfree(zram->dedup_table);
+	zram->dedup_table = NULL;
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
+	zram_reset_pcpu_stats(zram);
+
+	zram_reset_backing_dev(zram);
 
 	zram->disksize = 0;
 	mutex_unlock(&zram->init_lock);
@@ -538,17 +988,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_alloc_streams(zram);
+	if (ret) {
+		pr_err("Error allocating compression streams\n");
 		goto fail;
 	}
 
@@ -563,12 +1005,31 @@ int zram_init_device(struct zram *zram)
 	}
 	memset(zram->table, 0, num_pages * sizeof(*zram->table));
 
+	zram->slot_locks = vmalloc(BITS_TO_LONGS(num_pages) * sizeof(long));
+	if (!zram->slot_locks) {
+		pr_err("Error allocating zram slot locks\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(zram->slot_locks, 0, BITS_TO_LONGS(num_pages) * sizeof(long));
+
+	/* About four stored pages per dedup bucket when the disk is full */
+	num_pages = roundup_pow_of_two(max_t(size_t, num_pages / 4, 1));
+	zram->dedup_table = vmalloc(num_pages * sizeof(*zram->dedup_table));
+	if (!zram->dedup_table) {
+		pr_err("Error allocating zram dedup table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(zram->dedup_table, 0, num_pages * sizeof(*zram->dedup_table));
+	zram->dedup_mask = num_pages - 1;
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -578,7 +1039,7 @@ int zram_init_device(struct zram *zram)
 	zram->init_done = 1;
 	mutex_unlock(&zram->init_lock);
 
-	pr_debug("Initialization done!\n");
+	pr_debug("Initialization done! (%s)\n", zram->backend->name);
 	return 0;
 
 fail:
@@ -589,13 +1050,247 @@ fail:
 	return ret;
 }
 
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret = 0;
+	char *name;
+	size_t bitmap_size;
+	unsigned long nr_pages;
+	struct block_device *bdev;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+	strim(name);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing device for initialized "
+			"device\n");
+		ret = -EBUSY;
+		goto out;
+	}
+
+	zram_reset_backing_dev(zram);
+
+	bdev = open_bdev_exclusive(name, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	bitmap_size = BITS_TO_LONGS(nr_pages) * sizeof(long);
+	zram->bd_bitmap = nr_pages > 1 ? vmalloc(bitmap_size) : NULL;
+	if (!zram->bd_bitmap) {
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		ret = nr_pages > 1 ? -ENOMEM : -EINVAL;
+		goto out;
+	}
+	memset(zram->bd_bitmap, 0, bitmap_size);
+	set_bit(0, zram->bd_bitmap);
+
+	zram->bdev = bdev;
+	zram->bd_pages = nr_pages;
+	zram->bdev_path = name;
+	name = NULL;
+
+	pr_info("Using %s as backing device (%lu pages)\n",
+		zram->bdev_path, nr_pages);
+
+out:
+	mutex_unlock(&zram->init_lock);
+	kfree(name);
+	return ret;
+}
+
+/*
+ * Mark every page currently held in memory idle. Accessing a page clears
+ * the mark, so a later 'idle' writeback only picks pages untouched since.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	u32 index;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done)
+		goto out;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_slot(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_WB) &&
+				zram->table[index].page)
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_slot(zram, index);
+
+		cond_resched();
+	}
+
+out:
+	mutex_unlock(&zram->init_lock);
+}
+
+/*
+ * Copy one page to the backing device. The slot is not locked during the
+ * I/O; any update meanwhile clears ZRAM_UNDER_WB and the copy is dropped.
+ * Returns an error only if the scan should stop.
+ */
+static int zram_writeback_slot(struct zram *zram, u32 index,
+			enum zram_wb_mode mode, struct page *page)
+{
+	int ret = 0;
+	size_t clen = PAGE_SIZE;
+	unsigned long block, handle;
+	struct zram_stream *zstrm = NULL;
+	unsigned char *mem, *cmem;
+
+	if (zram->backend->needs_private_decompress)
+		zstrm = zram_get_stream(zram);
+
+	zram_lock_slot(zram, index);
+	if (zram_test_flag(zram, index, ZRAM_WB) ||
+			!zram->table[index].page ||
+			(mode == ZRAM_WB_HUGE &&
+			 !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) ||
+			(mode == ZRAM_WB_IDLE &&
+			 !zram_test_flag(zram, index, ZRAM_IDLE))) {
+		zram_unlock_slot(zram, index);
+		goto out_put;
+	}
+
+	mem = kmap_atomic(page, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+	} else {
+		handle = zram->table[index].handle;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+		ret = zram->backend->decompress(
+			cmem + sizeof(struct zobj_header),
+			zs_get_object_size(zram->mem_pool, handle) -
+				sizeof(struct zobj_header),
+			mem, &clen, zstrm ? zstrm->private : NULL);
+		zs_unmap_object(zram->mem_pool, handle);
+	}
+	kunmap_atomic(mem, KM_USER0);
+
+	if (!ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+	zram_unlock_slot(zram, index);
+
+	if (zstrm) {
+		zram_put_stream(zstrm);
+		zstrm = NULL;
+	}
+
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return 0;
+	}
+
+	block = zram_bd_alloc_block(zram);
+	if (!block) {
+		ret = -ENOSPC;
+		goto out_clear;
+	}
+
+	ret = zram_bd_rw(zram, WRITE_SYNC, block, page);
+	if (ret) {
+		zram_bd_free_block(zram, block);
+		goto out_clear;
+	}
+
+	zram_lock_slot(zram, index);
+	if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		/* Rewritten or freed while we were writing it out */
+		zram_unlock_slot(zram, index);
+		zram_bd_free_block(zram, block);
+		return 0;
+	}
+
+	zram_free_page(zram, index);
+	zram->table[index].bd_block = block;
+	zram_set_flag(zram, index, ZRAM_WB);
+	zram_unlock_slot(zram, index);
+
+	zram_stat_inc(zram, &zram->stats.pages_wb);
+	zram_stat64_inc(zram, &zram->stats.bd_writes);
+	return 0;
+
+out_clear:
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_unlock_slot(zram, index);
+out_put:
+	if (zstrm)
+		zram_put_stream(zstrm);
+	return ret;
+}
+
+/*
+ * Move pages to the backing device: ZRAM_WB_HUGE picks pages that did not
+ * compress, ZRAM_WB_IDLE those not accessed since zram_mark_idle().
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0;
+	u32 index;
+	struct page *page;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (index = 0; !ret && index < zram->disksize >> PAGE_SHIFT;
+			index++) {
+		ret = zram_writeback_slot(zram, index, mode, page);
+		cond_resched();
+	}
+
+	__free_page(page);
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
+}
+
+/*
+ * Merge sparsely used zspages of the memory pool, returning whole pages
+ * to the system.
+ */
+void zram_compact(struct zram *zram)
+{
+	unsigned long freed;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done)
+		goto out;
+
+	freed = zs_compact(zram->mem_pool);
+	zram_stat64_add(zram, &zram->stats.pages_compacted, freed);
+
+out:
+	mutex_unlock(&zram->init_lock);
+}
+
 #if defined(CONFIG_SWAP_FREE_NOTIFY)
 static void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 {
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
+	zram_unlock_slot(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 #endif
@@ -611,12 +1306,21 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+	zram->backend = zram_backend_find(ZRAM_DEFAULT_BACKEND);
+
+	zram->pcpu_stats = alloc_percpu(struct zram_pcpu_stats);
+	if (!zram->pcpu_stats) {
+		pr_err("Error allocating stats for device %d\n", device_id);
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
+		free_percpu(zram->pcpu_stats);
 		pr_err("Error allocating disk queue for device %d\n",
 			device_id);
 		ret = -ENOMEM;
@@ -630,6 +1334,7 @@ static int create_device(struct zram *zram, int device_id)
 	zram->disk = alloc_disk(1);
 	if (!zram->disk) {
 		blk_cleanup_queue(zram->queue);
+		free_percpu(zram->pcpu_stats);
 		pr_warning("Error allocating disk structure for device %d\n",
 			device_id);
 		ret = -ENOMEM;
@@ -690,6 +1395,9 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	free_percpu(zram->pcpu_stats);
+	zram->pcpu_stats = NULL;
 }
 
 static int __init zram_init(void)
@@ -752,6 +1460,8 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		else
+			zram_reset_backing_dev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/list.h>
 
-#include "sub-projects/allocators/xvmalloc-kmod/xvmalloc.h"
+#include "sub-projects/allocators/zsmalloc-kmod/zsmalloc.h"
+#include "zram_comp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -29,13 +32,11 @@ static const unsigned max_num_devices = 32;
 /*
  * Stored at beginning of each compressed object.
  *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
+ * No back-reference to the table entry is needed for defragmentation:
+ * entries hold zsmalloc handles, which stay valid when objects move.
  */
 struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
+	u32 checksum;		/* of the uncompressed page, for dedup */
 };
 
 /*-- Configurable parameters */
@@ -51,8 +52,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -70,42 +71,109 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Not accessed since the last idle marking */
+	ZRAM_IDLE,
+
+	/* Page lives on the backing device, see table.bd_block */
+	ZRAM_WB,
+
+	/* Being copied to the backing device; cleared by any update */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/* Writeback modes, see zram_writeback() */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,		/* pages stored uncompressed */
+	ZRAM_WB_IDLE,		/* pages still marked ZRAM_IDLE */
+};
+
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * Allocated for each disk page. Updates are serialized by the entry's
+ * bit in zram->slot_locks.
+ */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		struct page *page;	/* ZRAM_UNCOMPRESSED */
+		unsigned long handle;	/* compressed object in mem_pool */
+		unsigned long bd_block;	/* ZRAM_WB: page slot on bdev */
+	};
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
 
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
+	u64 num_writes;		/* failed + successful */
 	u64 failed_reads;	/* should NEVER! happen */
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u64 discard;		/* no. of block discard callbacks */
+	u64 dedup_hits;		/* writes that reused a stored object */
+	u64 dedup_saved;	/* compressed bytes currently shared */
+	u64 bd_reads;		/* pages read back from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u64 pages_compacted;	/* pages freed by compaction */
 	u32 pages_zero;		/* no. of zero filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_wb;		/* no. of pages on the backing device */
+};
+
+/*
+ * Every compressed object is indexed by the checksum of its uncompressed
+ * contents so that identical pages written later can share it. Table
+ * entries pointing to a shared object all carry its handle; the number
+ * of such entries is kept here.
+ */
+struct zram_dedup {
+	struct hlist_node node;
+	unsigned long handle;
+	u32 checksum;
+	u16 clen;		/* compressed size, without header */
+	u32 refcount;		/* table entries using this object */
+};
+
+/*
+ * Counters updated on the I/O paths. They are kept per CPU so that reads
+ * do not touch any device-wide lock; sysfs sums them up. On 32-bit a
+ * reader may see a torn value, which is acceptable for statistics.
+ */
+struct zram_pcpu_stats {
+	u64 num_reads;		/* failed + successful */
+	u64 pages_compressed;
+	u64 pages_decompressed;
+	u64 compr_time;		/* ns spent in the compressor */
+	u64 decompr_time;	/* ns spent in the decompressor */
+	u64 stream_contended;	/* writes that waited for a busy stream */
+};
+
+/*
+ * Compression stream: backend state plus the output buffer. There is one
+ * per possible CPU so that writes compress in parallel.
+ */
+struct zram_stream {
+	struct mutex lock;	/* a stream is used by one writer at a time */
+	void *private;		/* from backend->create() */
+	void *buffer;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	const struct zram_backend *backend;
+	struct zram_stream __percpu *streams;
+	struct zram_pcpu_stats __percpu *pcpu_stats;
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	unsigned long *slot_locks;	/* one bit_spin_lock per table entry */
+	struct hlist_head *dedup_table;
+	u32 dedup_mask;
+	spinlock_t dedup_lock;	/* protect dedup_table and refcounts */
+	spinlock_t stat64_lock;	/* protect shared stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -117,6 +185,15 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 
+	/*
+	 * Optional backing block device that cold and incompressible pages
+	 * can be written back to. Set before init, released on reset.
+	 */
+	struct block_device *bdev;
+	char *bdev_path;
+	unsigned long *bd_bitmap;	/* allocated page slots; 0 is unused */
+	unsigned long bd_pages;
+
 	struct zram_stats stats;
 };
 
@@ -128,5 +205,9 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+extern void zram_compact(struct zram *zram);
 
 #endif
@@ -20,6 +20,7 @@
 #include <linux/file.h>
 #include <linux/mm.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/debugfs.h>
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
@@ -42,11 +43,6 @@
 #define PMEM_MAX_ORDER (128)
 #define PMEM_MIN_ALLOC PAGE_SIZE
 
-#define PMEM_INITIAL_NUM_BITMAP_ALLOCATIONS (64)
-
-#define PMEM_32BIT_WORD_ORDER (5)
-#define PMEM_BITS_PER_WORD_MASK (BITS_PER_LONG - 1)
-
 #ifdef CONFIG_ANDROID_PMEM_DEBUG
 #define PMEM_DEBUG 1
 #else
@@ -105,6 +101,17 @@ struct pmem_bits {
 	unsigned order:7;		/* size of the region in pmem space */
 };
 
+/* a run of quanta in a bitmap allocator region, free or allocated */
+struct pmem_extent {
+	/* in free_by_start while free, in allocs while allocated */
+	struct rb_node start_node;
+	/* in free_by_size while free */
+	struct rb_node size_node;
+	unsigned int start;		/* first quantum */
+	unsigned int quanta;
+};
+#define PMEM_EXTENT_END(ext) ((ext)->start + (ext)->quanta)
+
 struct pmem_region_node {
 	struct pmem_region region;
 	struct list_head list;
@@ -175,6 +182,10 @@ struct pmem_info {
 			const unsigned long,
 			const unsigned int);
 	int (*free)(int, int);
+	/* the allocator's own allocate for movable regions */
+	int (*movable_allocate)(const int,
+			const unsigned long,
+			const unsigned int);
 	int (*free_space)(int, struct pmem_freespace *);
 	unsigned long (*len)(int, struct pmem_data *);
 	unsigned long (*start_addr)(int, struct pmem_data *);
@@ -188,6 +199,16 @@ struct pmem_info {
 	 * O_SYNC to get an uncached region */
 	unsigned cached;
 	unsigned buffered;
+	/* unstable region whose memory belongs to the page allocator
+	 * unless reclaimed is set, see pmem_movable_get */
+	unsigned movable;
+	int reclaimed;
+	/* open files holding a movable region, protected by movable_mutex */
+	int movable_users;
+	struct mutex movable_mutex;
+	unsigned long movable_reclaims;
+	unsigned long movable_failures;
+	unsigned int movable_last_ms;
 	union {
 		struct {
 			/* in all_or_nothing allocator mode the first mapper
@@ -205,13 +226,15 @@ struct pmem_info {
 		} buddy_bestfit;
 
 		struct {
-			unsigned int bitmap_free; /* # of zero bits/quanta */
-			uint32_t *bitmap;
-			int32_t bitmap_allocs;
-			struct {
-				short bit;
-				unsigned short quanta;
-			} *bitm_alloc;
+			/* no longer a bitmap, but an extent allocator over
+			 * the same quanta: best fit on free_by_size,
+			 * coalescing through free_by_start */
+			unsigned int bitmap_free; /* # of free quanta */
+			struct rb_root free_by_start;
+			struct rb_root free_by_size;
+			unsigned int free_extents;
+			/* allocated extents, by start quantum */
+			struct rb_root allocs;
 		} bitmap;
 
 		struct {
@@ -291,6 +314,13 @@ static struct kset *pmem_kset;
 static int pmem_release(struct inode *, struct file *);
 static int pmem_mmap(struct file *, struct vm_area_struct *);
 static int pmem_open(struct inode *, struct file *);
+#ifdef CONFIG_MEMORY_HOTPLUG
+static int pmem_movable_get(int id);
+static void pmem_movable_put(int id);
+#else
+static inline int pmem_movable_get(int id) { return 0; }
+static inline void pmem_movable_put(int id) { }
+#endif
 static long pmem_ioctl(struct file *, unsigned int, unsigned long);
 
 struct file_operations pmem_fops = {
@@ -413,11 +443,26 @@ static ssize_t show_pmem_mapped_regions(int id, char *buf)
 }
 RO_PMEM_ATTR(mapped_regions);
 
+static ssize_t show_pmem_movable(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "movable %u reclaimed %d reclaims %lu "
+		"failures %lu last_reclaim_ms %u\n", pmem[id].movable,
+		pmem[id].reclaimed, pmem[id].movable_reclaims,
+		pmem[id].movable_failures, pmem[id].movable_last_ms);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(movable);
+
 #define PMEM_COMMON_SYSFS_ATTRS \
 	&pmem_attr_base.attr, \
 	&pmem_attr_size.attr, \
 	&pmem_attr_allocator_type.attr, \
-	&pmem_attr_mapped_regions.attr
+	&pmem_attr_mapped_regions.attr, \
+	&pmem_attr_movable.attr
 
 
 static ssize_t show_pmem_allocated(int id, char *buf)
@@ -512,27 +557,64 @@ RO_PMEM_ATTR(free_quanta);
 static ssize_t show_pmem_bits_allocated(int id, char *buf)
 {
 	ssize_t ret;
-	unsigned int i;
+	unsigned int i = 0;
+	struct rb_node *n;
 
 	mutex_lock(&pmem[id].arena_mutex);
 
 	ret = scnprintf(buf, PAGE_SIZE,
 		"id: %d\nbitnum\tindex\tquanta allocated\n", id);
 
-	for (i = 0; i < pmem[id].allocator.bitmap.bitmap_allocs; i++)
-		if (pmem[id].allocator.bitmap.bitm_alloc[i].bit != -1)
-			ret += scnprintf(buf + ret, PAGE_SIZE - ret,
-				"%u\t%u\t%u\n",
-				i,
-				pmem[id].allocator.bitmap.bitm_alloc[i].bit,
-				pmem[id].allocator.bitmap.bitm_alloc[i].quanta
-				);
+	for (n = rb_first(&pmem[id].allocator.bitmap.allocs);
+	     n && ret < PAGE_SIZE; n = rb_next(n), i++) {
+		struct pmem_extent *ext =
+			rb_entry(n, struct pmem_extent, start_node);
+
+		ret += scnprintf(buf + ret, PAGE_SIZE - ret, "%u\t%u\t%u\n",
+			i, ext->start, ext->quanta);
+	}
 
 	mutex_unlock(&pmem[id].arena_mutex);
 	return ret;
 }
 RO_PMEM_ATTR(bits_allocated);
 
+static ssize_t show_pmem_fragmentation(int id, char *buf)
+{
+	ssize_t ret;
+	unsigned int free, largest = 0;
+	struct rb_node *n;
+
+	mutex_lock(&pmem[id].arena_mutex);
+
+	free = pmem[id].allocator.bitmap.bitmap_free;
+	n = rb_last(&pmem[id].allocator.bitmap.free_by_size);
+	if (n)
+		largest = rb_entry(n, struct pmem_extent, size_node)->quanta;
+
+	/* how much of the free space is not in the largest extent */
+	ret = scnprintf(buf, PAGE_SIZE,
+		"free quanta %u in %u extents, largest %u, "
+		"fragmentation %u%%\nstart\tquanta\tlength\n", free,
+		pmem[id].allocator.bitmap.free_extents, largest,
+		free ? 100 - (unsigned int)div_u64((u64)largest * 100, free)
+		     : 0);
+
+	for (n = rb_first(&pmem[id].allocator.bitmap.free_by_start);
+	     n && ret < PAGE_SIZE; n = rb_next(n)) {
+		struct pmem_extent *ext =
+			rb_entry(n, struct pmem_extent, start_node);
+
+		ret += scnprintf(buf + ret, PAGE_SIZE - ret, "%u\t%u\t%lu\n",
+			ext->start, ext->quanta,
+			(unsigned long)ext->quanta * pmem[id].quantum);
+	}
+
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(fragmentation);
+
 static struct attribute *pmem_bitmap_attrs[] = {
 	PMEM_COMMON_SYSFS_ATTRS,
 
@@ -540,6 +622,7 @@ static struct attribute *pmem_bitmap_attrs[] = {
 
 	&pmem_attr_free_quanta.attr,
 	&pmem_attr_bits_allocated.attr,
+	&pmem_attr_fragmentation.attr,
 
 	NULL
 };
@@ -687,77 +770,163 @@ static int pmem_free_space_buddy_bestfit(int id,
 }
 
 
-static inline uint32_t start_mask(int bit_start)
+static void pmem_extent_insert_start(struct rb_root *root,
+		struct pmem_extent *ext)
 {
-	return (uint32_t)(~0) << (bit_start & PMEM_BITS_PER_WORD_MASK);
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+
+	while (*p) {
+		struct pmem_extent *e;
+
+		parent = *p;
+		e = rb_entry(parent, struct pmem_extent, start_node);
+		if (ext->start < e->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&ext->start_node, parent, p);
+	rb_insert_color(&ext->start_node, root);
 }
 
-static inline uint32_t end_mask(int bit_end)
+/* ordered by size, then by start so that equal sizes are still unique */
+static void pmem_extent_insert_size(struct rb_root *root,
+		struct pmem_extent *ext)
 {
-	return (uint32_t)(~0) >>
-		((BITS_PER_LONG - bit_end) & PMEM_BITS_PER_WORD_MASK);
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+
+	while (*p) {
+		struct pmem_extent *e;
+
+		parent = *p;
+		e = rb_entry(parent, struct pmem_extent, size_node);
+		if (ext->quanta < e->quanta ||
+		    (ext->quanta == e->quanta && ext->start < e->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&ext->size_node, parent, p);
+	rb_insert_color(&ext->size_node, root);
 }
 
-static inline int compute_total_words(int bit_end, int word_index)
+static void pmem_extent_add_free(int id, struct pmem_extent *ext)
 {
-	return ((bit_end + BITS_PER_LONG - 1) >>
-			PMEM_32BIT_WORD_ORDER) - word_index;
+	pmem_extent_insert_start(&pmem[id].allocator.bitmap.free_by_start,
+		ext);
+	pmem_extent_insert_size(&pmem[id].allocator.bitmap.free_by_size, ext);
+	pmem[id].allocator.bitmap.free_extents++;
 }
 
-static void bitmap_bits_clear_all(uint32_t *bitp, int bit_start, int bit_end)
+static void pmem_extent_del_free(int id, struct pmem_extent *ext)
 {
-	int word_index = bit_start >> PMEM_32BIT_WORD_ORDER, total_words;
+	rb_erase(&ext->start_node, &pmem[id].allocator.bitmap.free_by_start);
+	rb_erase(&ext->size_node, &pmem[id].allocator.bitmap.free_by_size);
+	pmem[id].allocator.bitmap.free_extents--;
+}
 
-	total_words = compute_total_words(bit_end, word_index);
-	if (total_words > 0) {
-		if (total_words == 1) {
-			bitp[word_index] &=
-				~(start_mask(bit_start) & end_mask(bit_end));
+/* the extent starting at start or, if floor is set, the last one before */
+static struct pmem_extent *pmem_extent_lookup(struct rb_root *root,
+		unsigned int start, int floor)
+{
+	struct rb_node *n = root->rb_node;
+	struct pmem_extent *best = NULL;
+
+	while (n) {
+		struct pmem_extent *e =
+			rb_entry(n, struct pmem_extent, start_node);
+
+		if (start < e->start) {
+			n = n->rb_left;
+		} else if (start > e->start) {
+			best = e;
+			n = n->rb_right;
 		} else {
-			bitp[word_index++] &= ~start_mask(bit_start);
-			if (total_words > 2) {
-				int total_bytes;
+			return e;
+		}
+	}
+	return floor ? best : NULL;
+}
 
-				total_words -= 2;
-				total_bytes = total_words << 2;
+/* the smallest free extent of at least quanta */
+static struct rb_node *pmem_extent_first_fit(struct rb_root *root,
+		unsigned int quanta)
+{
+	struct rb_node *n = root->rb_node, *best = NULL;
 
-				memset(&bitp[word_index], 0, total_bytes);
-				word_index += total_words;
-			}
-			bitp[word_index] &= ~end_mask(bit_end);
+	while (n) {
+		struct pmem_extent *e =
+			rb_entry(n, struct pmem_extent, size_node);
+
+		if (e->quanta >= quanta) {
+			best = n;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return best;
+}
+
+static void pmem_extent_destroy_all(int id)
+{
+	struct rb_root *roots[] = {
+		&pmem[id].allocator.bitmap.free_by_start,
+		&pmem[id].allocator.bitmap.allocs,
+	};
+	struct rb_node *n;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(roots); i++) {
+		while ((n = rb_first(roots[i]))) {
+			rb_erase(n, roots[i]);
+			kfree(rb_entry(n, struct pmem_extent, start_node));
 		}
 	}
+	pmem[id].allocator.bitmap.free_by_size = RB_ROOT;
+	pmem[id].allocator.bitmap.free_extents = 0;
 }
 
 static int pmem_free_bitmap(int id, int bitnum)
 {
 	/* caller should hold the lock on arena_mutex! */
-	int i;
+	struct rb_root *free_root = &pmem[id].allocator.bitmap.free_by_start;
+	struct pmem_extent *ext, *prev, *next = NULL;
+	struct rb_node *n;
 	char currtask_name[FIELD_SIZEOF(struct task_struct, comm) + 1];
 
 	DLOG("bitnum %d\n", bitnum);
 
-	for (i = 0; i < pmem[id].allocator.bitmap.bitmap_allocs; i++) {
-		const int curr_bit =
-			pmem[id].allocator.bitmap.bitm_alloc[i].bit;
+	ext = pmem_extent_lookup(&pmem[id].allocator.bitmap.allocs, bitnum, 0);
+	if (!ext) {
+		printk(KERN_ALERT "pmem: %s: Attempt to free unallocated "
+			"index %d, id %d, pid %d(%s)\n", __func__, bitnum, id,
+			current->pid, get_task_comm(currtask_name, current));
+		return -1;
+	}
+	rb_erase(&ext->start_node, &pmem[id].allocator.bitmap.allocs);
+	pmem[id].allocator.bitmap.bitmap_free += ext->quanta;
 
-		if (curr_bit == bitnum) {
-			const int curr_quanta =
-				pmem[id].allocator.bitmap.bitm_alloc[i].quanta;
+	/* merge with the free extents on either side */
+	prev = pmem_extent_lookup(free_root, ext->start, 1);
+	n = prev ? rb_next(&prev->start_node) : rb_first(free_root);
+	if (n)
+		next = rb_entry(n, struct pmem_extent, start_node);
 
-			bitmap_bits_clear_all(pmem[id].allocator.bitmap.bitmap,
-				curr_bit, curr_bit + curr_quanta);
-			pmem[id].allocator.bitmap.bitmap_free += curr_quanta;
-			pmem[id].allocator.bitmap.bitm_alloc[i].bit = -1;
-			pmem[id].allocator.bitmap.bitm_alloc[i].quanta = 0;
-			return 0;
-		}
+	if (prev && PMEM_EXTENT_END(prev) == ext->start) {
+		pmem_extent_del_free(id, prev);
+		prev->quanta += ext->quanta;
+		kfree(ext);
+		ext = prev;
 	}
-	printk(KERN_ALERT "pmem: %s: Attempt to free unallocated index %d, id"
-		" %d, pid %d(%s)\n", __func__, bitnum, id,  current->pid,
-		get_task_comm(currtask_name, current));
+	if (next && next->start == PMEM_EXTENT_END(ext)) {
+		pmem_extent_del_free(id, next);
+		ext->quanta += next->quanta;
+		kfree(next);
+	}
+	pmem_extent_add_free(id, ext);
 
-	return -1;
+	return 0;
 }
 
 static int pmem_free_system(int id, int index)
@@ -783,48 +952,13 @@ static int pmem_free_system(int id, int index)
 
 static int pmem_free_space_bitmap(int id, struct pmem_freespace *fs)
 {
-	int i, j;
-	int max_allocs = pmem[id].allocator.bitmap.bitmap_allocs;
-	int alloc_start = 0;
-	int next_alloc;
-	unsigned long size = 0;
-
-	fs->total = 0;
-	fs->largest = 0;
-
-	for (i = 0; i < max_allocs; i++) {
-
-		int alloc_quanta = 0;
-		int alloc_idx = 0;
-		next_alloc = pmem[id].num_entries;
-
-		/* Look for the lowest bit where next allocation starts */
-		for (j = 0; j < max_allocs; j++) {
-			const int curr_alloc = pmem[id].allocator.
-						bitmap.bitm_alloc[j].bit;
-			if (curr_alloc != -1) {
-				if (alloc_start == curr_alloc)
-					alloc_idx = j;
-				if (alloc_start >= curr_alloc)
-					continue;
-				if (curr_alloc < next_alloc)
-					next_alloc = curr_alloc;
-			}
-		}
-		alloc_quanta = pmem[id].allocator.bitmap.
-				bitm_alloc[alloc_idx].quanta;
-		size = (next_alloc - (alloc_start + alloc_quanta)) *
-				pmem[id].quantum;
-
-		if (size > fs->largest)
-			fs->largest = size;
-		fs->total += size;
+	/* caller should hold the lock on arena_mutex! */
+	struct rb_node *n = rb_last(&pmem[id].allocator.bitmap.free_by_size);
 
-		if (next_alloc == pmem[id].num_entries)
-			break;
-		else
-			alloc_start = next_alloc;
-	}
+	fs->total = (unsigned long)pmem[id].allocator.bitmap.bitmap_free *
+		pmem[id].quantum;
+	fs->largest = n ? (unsigned long)rb_entry(n, struct pmem_extent,
+			size_node)->quanta * pmem[id].quantum : 0;
 
 	return 0;
 }
@@ -901,6 +1035,7 @@ static int pmem_release(struct inode *inode, struct file *file)
 
 	up_write(&data->sem);
 	kfree(data);
+	pmem_movable_put(id);
 	if (pmem[id].release)
 		ret = pmem[id].release(inode, file);
 
@@ -921,10 +1056,13 @@ static int pmem_open(struct inode *inode, struct file *file)
 	DLOG("pid %u(%s) file %p(%ld) dev %s(id: %d)\n",
 		current->pid, get_task_comm(currtask_name, current),
 		file, file_count(file), get_name(file), id);
+	if (pmem_movable_get(id))
+		return -ENOMEM;
 	data = kmalloc(sizeof(struct pmem_data), GFP_KERNEL);
 	if (!data) {
 		printk(KERN_ALERT "pmem: %s: unable to allocate memory for "
 				"pmem metadata.", __func__);
+		pmem_movable_put(id);
 		return -1;
 	}
 	data->flags = 0;
@@ -1047,158 +1185,24 @@ static inline unsigned long bit_from_paddr(const int id,
 	return (paddr - pmem[id].base) / pmem[id].quantum;
 }
 
-static void bitmap_bits_set_all(uint32_t *bitp, int bit_start, int bit_end)
-{
-	int word_index = bit_start >> PMEM_32BIT_WORD_ORDER, total_words;
-
-	total_words = compute_total_words(bit_end, word_index);
-	if (total_words > 0) {
-		if (total_words == 1) {
-			bitp[word_index] |=
-				(start_mask(bit_start) & end_mask(bit_end));
-		} else {
-			bitp[word_index++] |= start_mask(bit_start);
-			if (total_words > 2) {
-				int total_bytes;
-
-				total_words -= 2;
-				total_bytes = total_words << 2;
-
-				memset(&bitp[word_index], ~0, total_bytes);
-				word_index += total_words;
-			}
-			bitp[word_index] |= end_mask(bit_end);
-		}
-	}
-}
-
-static int
-bitmap_allocate_contiguous(uint32_t *bitp, int num_bits_to_alloc,
-		int total_bits, int spacing, int start_bit)
-{
-	int bit_start, last_bit, word_index;
-
-	if (num_bits_to_alloc <= 0)
-		return -1;
-
-	for (bit_start = start_bit; ;
-		bit_start = ((last_bit +
-			(word_index << PMEM_32BIT_WORD_ORDER) + spacing - 1)
-			& ~(spacing - 1)) + start_bit) {
-		int bit_end = bit_start + num_bits_to_alloc, total_words;
-
-		if (bit_end > total_bits)
-			return -1; /* out of contiguous memory */
-
-		word_index = bit_start >> PMEM_32BIT_WORD_ORDER;
-		total_words = compute_total_words(bit_end, word_index);
-
-		if (total_words <= 0)
-			return -1;
-
-		if (total_words == 1) {
-			last_bit = fls(bitp[word_index] &
-					(start_mask(bit_start) &
-						end_mask(bit_end)));
-			if (last_bit)
-				continue;
-		} else {
-			int end_word = word_index + (total_words - 1);
-			last_bit =
-				fls(bitp[word_index] & start_mask(bit_start));
-			if (last_bit)
-				continue;
-
-			for (word_index++;
-					word_index < end_word;
-					word_index++) {
-				last_bit = fls(bitp[word_index]);
-				if (last_bit)
-					break;
-			}
-			if (last_bit)
-				continue;
-
-			last_bit = fls(bitp[word_index] & end_mask(bit_end));
-			if (last_bit)
-				continue;
-		}
-		bitmap_bits_set_all(bitp, bit_start, bit_end);
-		return bit_start;
-	}
-	return -1;
-}
-
-static int reserve_quanta(const unsigned int quanta_needed,
-		const int id,
-		unsigned int align)
-{
-	/* alignment should be a valid power of 2 */
-	int ret = -1, start_bit = 0, spacing = 1;
-
-	/* Sanity check */
-	if (quanta_needed > pmem[id].allocator.bitmap.bitmap_free) {
-#if PMEM_DEBUG
-		printk(KERN_ALERT "pmem: %s: request (%d) too big for"
-			" available free (%d)\n", __func__, quanta_needed,
-			pmem[id].allocator.bitmap.bitmap_free);
-#endif
-		return -1;
-	}
-
-	start_bit = bit_from_paddr(id,
-		(pmem[id].base + align - 1) & ~(align - 1));
-	if (start_bit <= -1) {
-#if PMEM_DEBUG
-		printk(KERN_ALERT
-			"pmem: %s: bit_from_paddr fails for"
-			" %u alignment.\n", __func__, align);
-#endif
-		return -1;
-	}
-	spacing = align / pmem[id].quantum;
-	spacing = spacing > 1 ? spacing : 1;
-
-	ret = bitmap_allocate_contiguous(pmem[id].allocator.bitmap.bitmap,
-		quanta_needed,
-		(pmem[id].size + pmem[id].quantum - 1) / pmem[id].quantum,
-		spacing,
-		start_bit);
-
-#if PMEM_DEBUG
-	if (ret < 0)
-		printk(KERN_ALERT "pmem: %s: not enough contiguous bits free "
-			"in bitmap! Region memory is either too fragmented or"
-			" request is too large for available memory.\n",
-			__func__);
-#endif
-
-	return ret;
-}
-
 static int pmem_allocator_bitmap(const int id,
 		const unsigned long len,
 		const unsigned int align)
 {
 	/* caller should hold the lock on arena_mutex! */
-	int bitnum, i;
-	unsigned int quanta_needed;
+	struct pmem_extent *ext = NULL, *head = NULL, *tail = NULL;
+	struct rb_node *n;
+	unsigned int quanta_needed, start_bit, spacing, bitnum = 0;
 
 	DLOG("bitmap id %d, len %ld, align %u\n", id, len, align);
-	if (!pmem[id].allocator.bitmap.bitm_alloc) {
-#if PMEM_DEBUG
-		printk(KERN_ALERT "pmem: bitm_alloc not present! id: %d\n",
-			id);
-#endif
-		return -1;
-	}
 
 	quanta_needed = (len + pmem[id].quantum - 1) / pmem[id].quantum;
 	DLOG("quantum size %u quanta needed %u free %u id %d\n",
 		pmem[id].quantum, quanta_needed,
 		pmem[id].allocator.bitmap.bitmap_free, id);
 
-	if (pmem[id].allocator.bitmap.bitmap_free < quanta_needed) {
+	if (!quanta_needed ||
+	    pmem[id].allocator.bitmap.bitmap_free < quanta_needed) {
 #if PMEM_DEBUG
 		printk(KERN_ALERT "pmem: memory allocation failure. "
 			"PMEM memory region exhausted, id %d."
@@ -1207,71 +1211,70 @@ static int pmem_allocator_bitmap(const int id,
 		return -1;
 	}
 
-	bitnum = reserve_quanta(quanta_needed, id, align);
-	if (bitnum == -1)
-		goto leave;
-
-	for (i = 0;
-		i < pmem[id].allocator.bitmap.bitmap_allocs &&
-			pmem[id].allocator.bitmap.bitm_alloc[i].bit != -1;
-		i++)
-		;
-
-	if (i >= pmem[id].allocator.bitmap.bitmap_allocs) {
-		void *temp;
-		int32_t new_bitmap_allocs =
-			pmem[id].allocator.bitmap.bitmap_allocs << 1;
-		int j;
+	/* alignment should be a valid power of 2, allocations start on
+	 * start_bit + n * spacing */
+	start_bit = bit_from_paddr(id,
+		(pmem[id].base + align - 1) & ~(align - 1));
+	spacing = max(align / pmem[id].quantum, 1U);
 
-		if (!new_bitmap_allocs) { /* failed sanity check!! */
-#if PMEM_DEBUG
-			pr_alert("pmem: bitmap_allocs number"
-				" wrapped around to zero! Something "
-				"is VERY wrong.\n");
-#endif
-			return -1;
+	/*
+	 * Best fit: try the free extents from the smallest one that is big
+	 * enough upwards. Only extents shorter than quanta_needed + spacing
+	 * can fail the alignment, so for 4K requests this is the first one.
+	 */
+	for (n = pmem_extent_first_fit(&pmem[id].allocator.bitmap.free_by_size,
+			quanta_needed); n; n = rb_next(n)) {
+		struct pmem_extent *e =
+			rb_entry(n, struct pmem_extent, size_node);
+
+		bitnum = e->start > start_bit ?
+			start_bit + roundup(e->start - start_bit, spacing) :
+			start_bit;
+		if (bitnum + quanta_needed <= PMEM_EXTENT_END(e)) {
+			ext = e;
+			break;
 		}
-
-		if (new_bitmap_allocs > pmem[id].num_entries) {
-			/* failed sanity check!! */
+	}
+	if (!ext) {
 #if PMEM_DEBUG
-			pr_alert("pmem: required bitmap_allocs"
-				" number exceeds maximum entries possible"
-				" for current quanta\n");
+		printk(KERN_ALERT "pmem: %s: no free extent large enough! "
+			"Region memory is either too fragmented or request "
+			"is too large for available memory.\n", __func__);
 #endif
-			return -1;
-		}
+		return -1;
+	}
 
-		temp = krealloc(pmem[id].allocator.bitmap.bitm_alloc,
-				new_bitmap_allocs *
-				sizeof(*pmem[id].allocator.bitmap.bitm_alloc),
-				GFP_KERNEL);
-		if (!temp) {
-#if PMEM_DEBUG
-			pr_alert("pmem: can't realloc bitmap_allocs,"
-				"id %d, current num bitmap allocs %d\n",
-				id, pmem[id].allocator.bitmap.bitmap_allocs);
-#endif
+	/* whatever is left on either side stays free */
+	if (bitnum > ext->start) {
+		head = kmalloc(sizeof(*head), GFP_KERNEL);
+		if (!head)
+			return -1;
+		head->start = ext->start;
+		head->quanta = bitnum - ext->start;
+	}
+	if (bitnum + quanta_needed < PMEM_EXTENT_END(ext)) {
+		tail = kmalloc(sizeof(*tail), GFP_KERNEL);
+		if (!tail) {
+			kfree(head);
 			return -1;
 		}
-		pmem[id].allocator.bitmap.bitmap_allocs = new_bitmap_allocs;
-		pmem[id].allocator.bitmap.bitm_alloc = temp;
-
-		for (j = i; j < new_bitmap_allocs; j++) {
-			pmem[id].allocator.bitmap.bitm_alloc[j].bit = -1;
-			pmem[id].allocator.bitmap.bitm_alloc[i].quanta = 0;
-		}
-
-		DLOG("increased # of allocated regions to %d for id %d\n",
-			pmem[id].allocator.bitmap.bitmap_allocs, id);
+		tail->start = bitnum + quanta_needed;
+		tail->quanta = PMEM_EXTENT_END(ext) - tail->start;
 	}
 
-	DLOG("bitnum %d, bitm_alloc index %d\n", bitnum, i);
+	pmem_extent_del_free(id, ext);
+	if (head)
+		pmem_extent_add_free(id, head);
+	if (tail)
+		pmem_extent_add_free(id, tail);
 
+	ext->start = bitnum;
+	ext->quanta = quanta_needed;
+	pmem_extent_insert_start(&pmem[id].allocator.bitmap.allocs, ext);
 	pmem[id].allocator.bitmap.bitmap_free -= quanta_needed;
-	pmem[id].allocator.bitmap.bitm_alloc[i].bit = bitnum;
-	pmem[id].allocator.bitmap.bitm_alloc[i].quanta = quanta_needed;
-leave:
+
+	DLOG("bitnum %d, %u free extents\n", bitnum,
+		pmem[id].allocator.bitmap.free_extents);
 	return bitnum;
 }
 
@@ -1390,24 +1393,21 @@ static unsigned long pmem_len_buddy_bestfit(int id, struct pmem_data *data)
 
 static unsigned long pmem_len_bitmap(int id, struct pmem_data *data)
 {
-	int i;
+	struct pmem_extent *ext;
 	unsigned long ret = 0;
 
 	mutex_lock(&pmem[id].arena_mutex);
 
-	for (i = 0; i < pmem[id].allocator.bitmap.bitmap_allocs; i++)
-		if (pmem[id].allocator.bitmap.bitm_alloc[i].bit ==
-				data->index) {
-			ret = pmem[id].allocator.bitmap.bitm_alloc[i].quanta *
-				pmem[id].quantum;
-			break;
-		}
+	ext = pmem_extent_lookup(&pmem[id].allocator.bitmap.allocs,
+		data->index, 0);
+	if (ext)
+		ret = ext->quanta * pmem[id].quantum;
 
 	mutex_unlock(&pmem[id].arena_mutex);
 #if PMEM_DEBUG
-	if (i >= pmem[id].allocator.bitmap.bitmap_allocs)
+	if (!ext)
 		pr_alert("pmem: %s: can't find bitnum %d in "
-			"alloc'd array!\n", __func__, data->index);
+			"alloc'd tree!\n", __func__, data->index);
 #endif
 	return ret;
 }
@@ -2670,6 +2670,9 @@ static int active_unstable_pmem(void)
 static void reserve_unstable_pmem(unsigned long unstable_pmem_start,
 	unsigned long unstable_pmem_size)
 {
+	/* there may be only movable regions */
+	if (!unstable_pmem_size)
+		return;
 	reserve_hotplug_pages(unstable_pmem_start >> PAGE_SHIFT,
 		unstable_pmem_size >> PAGE_SHIFT);
 }
@@ -2677,6 +2680,8 @@ static void reserve_unstable_pmem(unsigned long unstable_pmem_start,
 static void unreserve_unstable_pmem(unsigned long unstable_pmem_start,
 	unsigned long unstable_pmem_size)
 {
+	if (!unstable_pmem_size)
+		return;
 	unreserve_hotplug_pages(unstable_pmem_start >> PAGE_SHIFT,
 		unstable_pmem_size >> PAGE_SHIFT);
 }
@@ -2691,7 +2696,8 @@ static void pmem_setup_unstable_devices(unsigned long start_pfn,
 	tmp = unstable_pmem_start;
 
 	for (id = 0; id < id_count; id++) {
-		if (pmem[id].memory_state == MEMORY_STABLE)
+		if (pmem[id].memory_state == MEMORY_STABLE ||
+		    pmem[id].movable)
 			continue;
 
 		pmem[id].base = tmp;
@@ -2701,14 +2707,32 @@ static void pmem_setup_unstable_devices(unsigned long start_pfn,
 	}
 	unstable_pmem_size = tmp - unstable_pmem_start;
 
+	/* movable regions come after the reserved part, each on whole
+	 * pageblocks of its own since they are reclaimed separately */
+	for (id = 0; id < id_count; id++) {
+		if (pmem[id].memory_state == MEMORY_STABLE ||
+		    !pmem[id].movable)
+			continue;
+
+		tmp = ALIGN(tmp, pageblock_nr_pages << PAGE_SHIFT);
+		pmem[id].base = tmp;
+		pr_info("lending %lx bytes unstable memory at %lx for %s "
+			"to the page allocator\n", pmem[id].size,
+			pmem[id].base, pmem[id].name);
+		tmp += pmem[id].size;
+	}
+
 	for (id = 0; id < id_count; id++) {
 		if (pmem[id].memory_state ==
 			MEMORY_UNSTABLE_NO_MEMORY_ALLOCATED) {
-			ioremap_pmem(id);
+			/* movable regions are mapped once reclaimed, the page
+			 * allocator uses them cached meanwhile */
+			if (!pmem[id].movable)
+				ioremap_pmem(id);
 			pmem[id].garbage_pfn =
 				page_to_pfn(alloc_page(GFP_KERNEL));
 
-			if (pmem[id].vbase == 0)
+			if (!pmem[id].movable && pmem[id].vbase == 0)
 				continue;
 			pmem[id].memory_state =
 				MEMORY_UNSTABLE_MEMORY_ALLOCATED;
@@ -2716,6 +2740,117 @@ static void pmem_setup_unstable_devices(unsigned long start_pfn,
 	}
 }
 
+#define PMEM_RECLAIM_TIMEOUT	(5 * HZ)
+
+static void pmem_flush_region(int id)
+{
+	/* the page allocator used the memory through the cached linear
+	 * mapping, pmem users may map it uncached */
+	flush_cache_all();
+	outer_flush_range(pmem[id].base, pmem[id].base + pmem[id].size);
+}
+
+static int pmem_region_empty(int id)
+{
+	struct pmem_freespace fs;
+
+	pmem[id].free_space(id, &fs);
+	return fs.total >= pmem[id].size;
+}
+
+/* take the memory of a movable region back from the page allocator, and
+ * only then map it in the kernel: ARMv6 forbids an uncached alias of
+ * memory the page allocator uses cached */
+static int pmem_movable_reclaim(int id)
+{
+	unsigned long start = jiffies;
+	int ret;
+
+	ret = reclaim_hotplug_pages(pmem[id].base >> PAGE_SHIFT,
+		pmem[id].size >> PAGE_SHIFT, PMEM_RECLAIM_TIMEOUT);
+	if (ret) {
+		pmem[id].movable_failures++;
+		pr_warning("pmem: %s: unable to reclaim %lx bytes at %lx for "
+			"%s (%d)\n", __func__, pmem[id].size, pmem[id].base,
+			pmem[id].name, ret);
+		return ret;
+	}
+
+	pmem_flush_region(id);
+	ioremap_pmem(id);
+	if (pmem[id].vbase == 0) {
+		pmem[id].movable_failures++;
+		pr_err("pmem: %s: ioremap failed for device %s\n", __func__,
+			pmem[id].name);
+		unreserve_hotplug_pages(pmem[id].base >> PAGE_SHIFT,
+			pmem[id].size >> PAGE_SHIFT);
+		return -ENOMEM;
+	}
+	pmem[id].reclaimed = 1;
+	pmem[id].movable_reclaims++;
+	pmem[id].movable_last_ms = jiffies_to_msecs(jiffies - start);
+	DLOG("reclaimed %s in %u ms\n", pmem[id].name,
+		pmem[id].movable_last_ms);
+	return 0;
+}
+
+static void pmem_movable_release(int id)
+{
+	iounmap(pmem[id].vbase);
+	pmem[id].vbase = NULL;
+	pmem_flush_region(id);
+	unreserve_hotplug_pages(pmem[id].base >> PAGE_SHIFT,
+		pmem[id].size >> PAGE_SHIFT);
+	pmem[id].reclaimed = 0;
+	DLOG("released %s\n", pmem[id].name);
+}
+
+/*
+ * Reclaiming can take seconds, so it is done when the device is opened,
+ * outside arena_mutex and mmap_sem, rather than on the first allocation.
+ * The region goes back to the page allocator when the last file using it
+ * is released, and with it the last allocation.
+ */
+static int pmem_movable_get(int id)
+{
+	int ret = 0;
+
+	if (!pmem[id].movable)
+		return 0;
+
+	mutex_lock(&pmem[id].movable_mutex);
+	if (!pmem[id].movable_users)
+		ret = pmem_movable_reclaim(id);
+	if (!ret)
+		pmem[id].movable_users++;
+	mutex_unlock(&pmem[id].movable_mutex);
+	return ret;
+}
+
+static void pmem_movable_put(int id)
+{
+	if (!pmem[id].movable)
+		return;
+
+	mutex_lock(&pmem[id].movable_mutex);
+	if (!--pmem[id].movable_users) {
+		WARN_ON(!pmem_region_empty(id));
+		pmem_movable_release(id);
+	}
+	mutex_unlock(&pmem[id].movable_mutex);
+}
+
+static int pmem_allocator_movable(const int id,
+		const unsigned long len,
+		const unsigned int align)
+{
+	/* caller should hold the lock on arena_mutex! */
+	if (!pmem[id].reclaimed)
+		return -1;
+
+	return pmem[id].movable_allocate(id, len, align);
+}
+
 static int pmem_mem_going_offline_callback(void *arg)
 {
 	struct memory_notify *marg = arg;
@@ -2761,10 +2896,13 @@ static int pmem_mem_online_callback(void *arg)
 	for (id = 0; id < id_count; id++) {
 		if (pmem[id].memory_state ==
 			MEMORY_UNSTABLE_NO_MEMORY_ALLOCATED) {
+			if (pmem[id].movable)
+				goto allocated;
 			if (pmem[id].vbase == 0)
 				ioremap_pmem(id);
 			if (pmem[id].vbase == 0)
 				continue;
+allocated:
 			pmem[id].memory_state =
 				MEMORY_UNSTABLE_MEMORY_ALLOCATED;
 		}
@@ -2806,6 +2944,7 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	       int (*release)(struct inode *, struct file *))
 {
 	int i, index = 0, kapi_memtype_idx = -1, id, is_kernel_memtype = 0;
+	struct pmem_extent *ext;
 
 	if (id_count >= PMEM_MAX_DEVICES) {
 		pr_alert("pmem: %s: unable to register driver(%s) - no more "
@@ -2950,40 +3089,27 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 		break;
 
 	case PMEM_ALLOCATORTYPE_BITMAP: /* 0, default if not explicit */
-		pmem[id].allocator.bitmap.bitm_alloc = kmalloc(
-			PMEM_INITIAL_NUM_BITMAP_ALLOCATIONS *
-				sizeof(*pmem[id].allocator.bitmap.bitm_alloc),
-			GFP_KERNEL);
-		if (!pmem[id].allocator.bitmap.bitm_alloc) {
-			pr_alert("pmem: %s: Unable to register pmem "
-					"driver %s - can't allocate "
-					"bitm_alloc!\n",
-					__func__, pdata->name);
-			goto err_reset_pmem_info;
-		}
+		pmem[id].allocator.bitmap.free_by_start = RB_ROOT;
+		pmem[id].allocator.bitmap.free_by_size = RB_ROOT;
+		pmem[id].allocator.bitmap.allocs = RB_ROOT;
+		pmem[id].allocator.bitmap.free_extents = 0;
 
 		if (kobject_init_and_add(&pmem[id].kobj,
 				&pmem_bitmap_ktype, NULL,
 				"%s", pdata->name))
 			goto out_put_kobj;
 
-		for (i = 0; i < PMEM_INITIAL_NUM_BITMAP_ALLOCATIONS; i++) {
-			pmem[id].allocator.bitmap.bitm_alloc[i].bit = -1;
-			pmem[id].allocator.bitmap.bitm_alloc[i].quanta = 0;
-		}
-
-		pmem[id].allocator.bitmap.bitmap_allocs =
-			PMEM_INITIAL_NUM_BITMAP_ALLOCATIONS;
-
-		pmem[id].allocator.bitmap.bitmap =
-			kcalloc((pmem[id].num_entries + 31) / 32,
-				sizeof(unsigned int), GFP_KERNEL);
-		if (!pmem[id].allocator.bitmap.bitmap) {
+		/* the whole region starts out as one free extent */
+		ext = kmalloc(sizeof(*ext), GFP_KERNEL);
+		if (!ext) {
 			pr_alert("pmem: %s: Unable to register pmem "
-				"driver - can't allocate bitmap!\n",
+				"driver - can't allocate free extent!\n",
 				__func__);
 			goto err_cant_register_device;
 		}
+		ext->start = 0;
+		ext->quanta = pmem[id].num_entries;
+		pmem_extent_add_free(id, ext);
 		pmem[id].allocator.bitmap.bitmap_free = pmem[id].num_entries;
 
 		pmem[id].allocate = pmem_allocator_bitmap;
@@ -3056,6 +3182,21 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 		pr_info("pmem: Initializing %s (in-kernel)\n", pdata->name);
 	}
 
+	if (pdata->movable) {
+#ifdef CONFIG_MEMORY_HOTPLUG
+		if (pdata->unstable && !is_kernel_memtype &&
+		    pmem[id].allocator_type != PMEM_ALLOCATORTYPE_SYSTEM) {
+			pmem[id].movable = 1;
+			mutex_init(&pmem[id].movable_mutex);
+			pmem[id].movable_allocate = pmem[id].allocate;
+			pmem[id].allocate = pmem_allocator_movable;
+		} else
+#endif
+			pr_warning("pmem: %s: %s can't be movable, only "
+				"unstable user-space carve-out regions can\n",
+				__func__, pdata->name);
+	}
+
 	/* do not set up unstable pmem now, wait until first memory hotplug */
 	if (pmem[id].memory_state == MEMORY_UNSTABLE_NO_MEMORY_ALLOCATED)
 		return 0;
@@ -3082,10 +3223,8 @@ out_put_kobj:
 	kobject_put(&pmem[id].kobj);
 	if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BUDDYBESTFIT)
 		kfree(pmem[id].allocator.buddy_bestfit.buddy_bitmap);
-	else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BITMAP) {
-		kfree(pmem[id].allocator.bitmap.bitmap);
-		kfree(pmem[id].allocator.bitmap.bitm_alloc);
-	}
+	else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BITMAP)
+		pmem_extent_destroy_all(id);
 err_reset_pmem_info:
 	pmem[id].allocate = 0;
 	pmem[id].dev.minor = -1;
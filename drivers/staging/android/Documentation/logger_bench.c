@@ -0,0 +1,296 @@
+/* logger_bench.c - writer throughput of the Android logger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * Runs 1..N writer threads against one log while a few readers drain it,
+ * and prints the entries per second written and read for each writer
+ * count. Run it on kernels built with and without
+ * CONFIG_ANDROID_LOGGER_PERCPU to compare the two write paths.
+ *
+ * -m picks how the readers drain the log: one entry per read(), as many
+ * entries as fit in 64K per LOGGER_READ_BATCH, or in place through the
+ * read-only mapping. The read/s column then compares the lines per second
+ * each method keeps up with. Mapped readers count the times they were
+ * lapped by the writers in "lapped".
+ *
+ *	gcc -O2 -o logger_bench logger_bench.c -lpthread
+ *	logger_bench [-l /dev/log/main] [-w writers] [-r readers] [-t secs]
+ *		     [-m read|batch|mmap]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "../logger.h"
+
+static const char *log_path = "/dev/log/main";
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	unsigned long entries;
+	unsigned long lapped;
+};
+
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	unsigned char prio = 4;		/* ANDROID_LOG_INFO */
+	char msg[64];
+	struct iovec vec[3];
+
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = "logger_bench";
+	vec[1].iov_len = sizeof("logger_bench");
+	vec[2].iov_base = msg;
+
+	while (!stop) {
+		vec[2].iov_len = snprintf(msg, sizeof(msg),
+					  "entry %lu", w->entries) + 1;
+		if (writev(w->fd, vec, 3) < 0) {
+			perror("writev");
+			break;
+		}
+		w->entries++;
+	}
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	char buf[LOGGER_ENTRY_MAX_LEN + 1];
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+
+	while (!stop) {
+		if (read(w->fd, buf, sizeof(buf)) > 0) {
+			w->entries++;
+			continue;
+		}
+		if (errno != EAGAIN) {
+			perror("read");
+			break;
+		}
+		poll(&pfd, 1, 100);
+	}
+	return NULL;
+}
+
+static void *batch_reader(void *arg)
+{
+	struct worker *w = arg;
+	static __thread char buf[64 * 1024];
+	struct logger_read_batch batch = {
+		.buf = (unsigned long)buf,
+		.len = sizeof(buf),
+	};
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+
+	while (!stop) {
+		if (ioctl(w->fd, LOGGER_READ_BATCH, &batch) > 0) {
+			w->entries += batch.nr;
+			continue;
+		}
+		if (errno != EAGAIN) {
+			perror("LOGGER_READ_BATCH");
+			break;
+		}
+		poll(&pfd, 1, 100);
+	}
+	return NULL;
+}
+
+/* distance from 'from' forward to 'to' in a ring of 'size' bytes */
+static unsigned int ring_dist(unsigned int from, unsigned int to,
+			      unsigned int size)
+{
+	return (to - from + size) % size;
+}
+
+static void ring_copy(void *dst, const char *ring, unsigned int off,
+		      unsigned int len, unsigned int size)
+{
+	unsigned int n = len < size - off ? len : size - off;
+
+	memcpy(dst, ring + off, n);
+	memcpy((char *)dst + n, ring, len - n);
+}
+
+static void *mmap_reader(void *arg)
+{
+	struct worker *w = arg;
+	long page = sysconf(_SC_PAGESIZE);
+	volatile struct logger_mmap_ctl *ctl;
+	char buf[LOGGER_ENTRY_MAX_LEN];
+	unsigned int size, seq, head, w_off, off, o, n;
+	const char *ring;
+	void *map;
+	int ret;
+
+	ret = ioctl(w->fd, LOGGER_GET_LOG_BUF_SIZE);
+	if (ret <= 0) {
+		perror("LOGGER_GET_LOG_BUF_SIZE");
+		return NULL;
+	}
+	size = ret;
+	map = mmap(NULL, page + size, PROT_READ, MAP_SHARED, w->fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	ctl = map;
+	ring = (const char *)map + page;
+	off = ctl->w_off;
+
+	while (!stop) {
+		seq = ctl->seq;
+		__sync_synchronize();
+		w_off = ctl->w_off;
+		head = ctl->head;
+		__sync_synchronize();
+		if ((seq & 1) || ctl->seq != seq)
+			continue;
+		if (ring_dist(head, off, size) > ring_dist(head, w_off, size)) {
+			/* overwritten before we got to it */
+			w->lapped++;
+			off = head;
+		}
+		if (off == w_off) {
+			usleep(1000);
+			continue;
+		}
+
+		for (o = off, n = 0; o != w_off; n++) {
+			struct logger_entry *e = (struct logger_entry *)buf;
+
+			ring_copy(buf, ring, o, sizeof(*e), size);
+			ring_copy(buf, ring, o, sizeof(*e) + e->len, size);
+			o = (o + sizeof(*e) + e->len) % size;
+		}
+
+		/* the copies are only good if the head did not pass 'off' */
+		__sync_synchronize();
+		if (ring_dist(head, ctl->head, size) > ring_dist(head, off, size)) {
+			w->lapped++;
+			off = ctl->head;
+			continue;
+		}
+		off = o;
+		w->entries += n;
+	}
+	munmap(map, page + size);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int start(struct worker *w, int flags, void *(*fn)(void *))
+{
+	w->entries = 0;
+	w->lapped = 0;
+	w->fd = open(log_path, flags);
+	if (w->fd < 0) {
+		perror(log_path);
+		return -1;
+	}
+	return pthread_create(&w->thread, NULL, fn, w);
+}
+
+static void finish(struct worker *w)
+{
+	pthread_join(w->thread, NULL);
+	close(w->fd);
+}
+
+int main(int argc, char **argv)
+{
+	int max_writers = 4, nr_readers = 2, secs = 5;
+	void *(*drain)(void *) = reader;
+	struct worker *writers, *readers;
+	int opt, n, i;
+
+	while ((opt = getopt(argc, argv, "l:w:r:t:m:")) != -1) {
+		switch (opt) {
+		case 'l':
+			log_path = optarg;
+			break;
+		case 'w':
+			max_writers = atoi(optarg);
+			break;
+		case 'r':
+			nr_readers = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "batch"))
+				drain = batch_reader;
+			else if (!strcmp(optarg, "mmap"))
+				drain = mmap_reader;
+			else if (strcmp(optarg, "read"))
+				goto usage;
+			break;
+		default:
+usage:
+			fprintf(stderr, "usage: %s [-l log] [-w writers] "
+				"[-r readers] [-t secs] [-m read|batch|mmap]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	writers = calloc(max_writers, sizeof(*writers));
+	readers = calloc(nr_readers, sizeof(*readers));
+	if (!writers || !readers)
+		return 1;
+
+	printf("writers  written/s  read/s per reader  lapped\n");
+	for (n = 1; n <= max_writers; n++) {
+		unsigned long written = 0, read = 0, lapped = 0;
+		double t;
+
+		stop = 0;
+		for (i = 0; i < nr_readers; i++)
+			if (start(&readers[i], O_RDONLY | O_NONBLOCK, drain))
+				return 1;
+		t = now();
+		for (i = 0; i < n; i++)
+			if (start(&writers[i], O_WRONLY, writer))
+				return 1;
+		sleep(secs);
+		stop = 1;
+		for (i = 0; i < n; i++) {
+			finish(&writers[i]);
+			written += writers[i].entries;
+		}
+		t = now() - t;
+		for (i = 0; i < nr_readers; i++) {
+			finish(&readers[i]);
+			read += readers[i].entries;
+			lapped += readers[i].lapped;
+		}
+		printf("%7d  %9.0f  %17.0f  %6lu\n", n, written / t,
+		       nr_readers ? read / t / nr_readers : 0.0, lapped);
+	}
+	return 0;
+}
@@ -20,6 +20,7 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -29,6 +30,7 @@
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -37,18 +39,42 @@
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking:
+ *
+ * binder_main_lock is held for reading by every operation on a binder_proc,
+ * and for writing by the rare operations that free threads or procs, or
+ * that need to see all of them (thread exit, release, debugfs). As long as
+ * it is held for reading, no proc or thread goes away and node->proc does
+ * not change.
+ *
+ * proc->lock protects everything reachable from the proc: its threads and
+ * their transaction stacks, its todo lists, refs, buffers and the nodes it
+ * owns. An operation that touches several procs locks all of them through a
+ * struct binder_lockset, so unrelated procs never contend.
+ *
+ * binder_global_lock protects binder_procs, the context manager and
+ * binder_dead_nodes together with the nodes on it. It nests inside any
+ * proc->lock.
+ */
+static DECLARE_RWSEM(binder_main_lock);
+static DEFINE_MUTEX(binder_global_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
+static DEFINE_SPINLOCK(binder_transaction_log_lock);
+static DEFINE_SPINLOCK(binder_lru_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
+static LIST_HEAD(binder_lru);
+static int binder_lru_count;
 
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
+static struct dentry *binder_debugfs_dir_entry_queue;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id = ATOMIC_INIT(0);
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -67,6 +93,8 @@ static const struct file_operations binder_##name##_fops = { \
 
 static int binder_proc_show(struct seq_file *m, void *unused);
 BINDER_DEBUG_ENTRY(proc);
+static int binder_queue_show(struct seq_file *m, void *unused);
+BINDER_DEBUG_ENTRY(queue);
 
 /* This is only defined in include/asm-arm/sizes.h */
 #ifndef SZ_1K
@@ -146,11 +174,22 @@ enum binder_stat_types {
 	BINDER_STAT_COUNT
 };
 
+enum binder_alloc_stat_types {
+	BINDER_ALLOC_CACHE_HIT,
+	BINDER_ALLOC_CACHE_MISS,
+	BINDER_ALLOC_PAGE_REUSED,
+	BINDER_ALLOC_PAGE_MAPPED,
+	BINDER_ALLOC_PAGE_SHRUNK,
+	BINDER_ALLOC_STAT_COUNT
+};
+
 struct binder_stats {
 	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
 	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
 	int obj_created[BINDER_STAT_COUNT];
 	int obj_deleted[BINDER_STAT_COUNT];
+	int alloc[BINDER_ALLOC_STAT_COUNT];
+	unsigned long transaction_bytes;
 };
 
 static struct binder_stats binder_stats;
@@ -189,6 +228,8 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
+
+	spin_lock(&binder_transaction_log_lock);
 	e = &log->entry[log->next];
 	memset(e, 0, sizeof(*e));
 	log->next++;
@@ -196,6 +237,7 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 		log->next = 0;
 		log->full = 1;
 	}
+	spin_unlock(&binder_transaction_log_lock);
 	return e;
 }
 
@@ -259,8 +301,11 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* free entry by size or allocated */
+					/* entry by address */
+		struct list_head cache_entry; /* cached small buffer */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
@@ -274,13 +319,43 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * Pages backing the buffer area are not unmapped when the buffers using them
+ * are freed. They go on binder_lru instead, where the next allocation can
+ * pick them up without mapping anything, and binder_shrink() releases them
+ * under memory pressure.
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
+/*
+ * Freed buffers of a few small sizes are kept per proc, still carved out
+ * and mapped, so that the common small transaction is an O(1) list pop.
+ * Class i holds buffers of exactly BINDER_BUFFER_CACHE_MIN << i bytes.
+ */
+#define BINDER_BUFFER_CACHE_CLASSES	5
+#define BINDER_BUFFER_CACHE_MIN		128
+#define BINDER_BUFFER_CACHE_DEPTH	8
+
+/*
+ * Time transactions spent queued before a thread picked them up. Bucket 0
+ * counts waits under 1 us, bucket i waits in [2^(i-1), 2^i) us, and the last
+ * one everything longer.
+ */
+#define BINDER_WAIT_HIST_BUCKETS	16
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
 	BINDER_DEFERRED_RELEASE      = 0x04,
+	BINDER_DEFERRED_PUT_MM       = 0x08,
 };
 
 struct binder_proc {
+	struct mutex lock;
 	struct hlist_node proc_node;
 	struct rb_root threads;
 	struct rb_root nodes;
@@ -300,7 +375,11 @@ struct binder_proc {
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct list_head buffer_cache[BINDER_BUFFER_CACHE_CLASSES];
+	int buffer_cache_count[BINDER_BUFFER_CACHE_CLASSES];
+
+	struct binder_lru_page *pages;
+	struct mm_struct *shrink_mm; /* last mm reference, put by the worker */
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -312,7 +391,11 @@ struct binder_proc {
 	int requested_threads_started;
 	int ready_threads;
 	long default_priority;
+	int queued_transactions;
+	int max_queued_transactions;
+	unsigned int wait_hist[BINDER_WAIT_HIST_BUCKETS];
 	struct dentry *debugfs_entry;
+	struct dentry *debugfs_queue_entry;
 };
 
 enum {
@@ -348,6 +431,7 @@ struct binder_transaction {
 	struct binder_thread *to_thread;
 	struct binder_transaction *to_parent;
 	unsigned need_reply:1;
+	unsigned queued:1;	/* counted in to_proc->queued_transactions */
 	/* unsigned is_dead:1; */	/* not used at the moment */
 
 	struct binder_buffer *buffer;
@@ -355,9 +439,137 @@ struct binder_transaction {
 	unsigned int	flags;
 	long	priority;
 	long	saved_priority;
+	int	sched_policy;
+	int	rt_priority;
+	int	saved_policy;
+	int	saved_rt_priority;
+	int	queue_prio;	/* sender's normal_prio, lower runs first */
+	ktime_t	queued_time;
 	uid_t	sender_euid;
 };
 
+/*
+ * struct binder_lockset - the procs an operation holds the lock of
+ *
+ * The locks are always taken in address order. An operation that finds it
+ * needs a proc outside the set drops all of its locks, extends the set and
+ * starts over. If the set overflows, or the operation has to walk objects
+ * of procs it cannot name up front, it runs in exclusive mode instead:
+ * binder_main_lock is held for writing and no proc lock is needed.
+ */
+#define BINDER_MAX_LOCKED_PROCS	4
+
+struct binder_lockset {
+	int nr;
+	int exclusive;
+	struct binder_proc *procs[BINDER_MAX_LOCKED_PROCS];
+};
+
+/*
+ * Best-effort counters for the stats file. contended counts proc locks that
+ * were already held when a lockset went to take them.
+ */
+static struct {
+	unsigned long contended;
+	unsigned long relocks;
+	unsigned long exclusive;
+} binder_lock_stats;
+
+static void binder_lockset_init(struct binder_lockset *set,
+				struct binder_proc *proc)
+{
+	set->nr = 1;
+	set->exclusive = 0;
+	set->procs[0] = proc;
+}
+
+/* The caller must hold binder_main_lock for reading. */
+static void binder_lockset_lock(struct binder_lockset *set)
+{
+	int i;
+
+	if (set->exclusive) {
+		up_read(&binder_main_lock);
+		down_write(&binder_main_lock);
+		return;
+	}
+	for (i = 0; i < set->nr; i++) {
+		if (mutex_trylock(&set->procs[i]->lock))
+			continue;
+		binder_lock_stats.contended++;
+		mutex_lock_nested(&set->procs[i]->lock, i);
+	}
+}
+
+static void binder_lockset_unlock(struct binder_lockset *set)
+{
+	int i;
+
+	if (set->exclusive) {
+		downgrade_write(&binder_main_lock);
+		return;
+	}
+	for (i = set->nr - 1; i >= 0; i--)
+		mutex_unlock(&set->procs[i]->lock);
+}
+
+static int binder_lockset_has(struct binder_lockset *set,
+			      struct binder_proc *proc)
+{
+	int i;
+
+	if (proc == NULL || set->exclusive)
+		return 1;
+	for (i = 0; i < set->nr; i++)
+		if (set->procs[i] == proc)
+			return 1;
+	return 0;
+}
+
+/*
+ * binder_lockset_relock - drops the locks in 'set' and takes them again
+ * together with the lock of 'proc', or switches to exclusive mode if 'proc'
+ * is NULL or the set is full. Anything looked up under the old locks must be
+ * looked up again.
+ */
+static void binder_lockset_relock(struct binder_lockset *set,
+				  struct binder_proc *proc)
+{
+	int i;
+
+	binder_lockset_unlock(set);
+	binder_lock_stats.relocks++;
+	if (proc == NULL || set->nr == BINDER_MAX_LOCKED_PROCS) {
+		binder_lock_stats.exclusive++;
+		set->exclusive = 1;
+	} else {
+		for (i = set->nr; i > 0 && set->procs[i - 1] > proc; i--)
+			set->procs[i] = set->procs[i - 1];
+		set->procs[i] = proc;
+		set->nr++;
+	}
+	binder_lockset_lock(set);
+}
+
+/*
+ * A live node is protected by the lock of the proc owning it, which the
+ * caller holds. Once that proc is gone the node is on binder_dead_nodes and
+ * binder_global_lock protects it instead.
+ */
+static int binder_lock_node(struct binder_node *node)
+{
+	if (node->proc)
+		return 0;
+	mutex_lock(&binder_global_lock);
+	return 1;
+}
+
+static void binder_unlock_node(int dead)
+{
+	if (dead)
+		mutex_unlock(&binder_global_lock);
+}
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
@@ -516,6 +728,95 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static int binder_rt_policy(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static void binder_set_sched(int policy, int rt_priority)
+{
+	struct sched_param param = { .sched_priority = rt_priority };
+
+	if (current->policy == policy && current->rt_priority == rt_priority)
+		return;
+	if (sched_setscheduler_nocheck(current, policy, &param))
+		binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+			     "binder: %d: failed to set policy %d prio %d\n",
+			     current->pid, policy, rt_priority);
+}
+
+/*
+ * binder_inherit_priority - run the thread handling a synchronous call at
+ * the caller's priority, including its real-time class, until it replies.
+ */
+static void binder_inherit_priority(struct binder_transaction *t,
+				    struct binder_node *target_node)
+{
+	t->saved_priority = task_nice(current);
+	t->saved_policy = current->policy;
+	t->saved_rt_priority = current->rt_priority;
+	if (!(t->flags & TF_ONE_WAY) && binder_rt_policy(t->sched_policy)) {
+		if (t->queue_prio < current->normal_prio)
+			binder_set_sched(t->sched_policy, t->rt_priority);
+	} else if (t->priority < target_node->min_priority &&
+		   !(t->flags & TF_ONE_WAY))
+		binder_set_nice(t->priority);
+	else if (!(t->flags & TF_ONE_WAY) ||
+		 t->saved_priority > target_node->min_priority)
+		binder_set_nice(target_node->min_priority);
+}
+
+static void binder_restore_priority(struct binder_transaction *t)
+{
+	binder_set_sched(t->saved_policy, t->saved_rt_priority);
+	binder_set_nice(t->saved_priority);
+}
+
+/*
+ * binder_enqueue_transaction - queues 't' on 'list' ahead of transactions
+ * from lower priority callers. Other work is never overtaken, and equal
+ * priorities stay in FIFO order.
+ */
+static void binder_enqueue_transaction(struct binder_proc *proc,
+				       struct list_head *list,
+				       struct binder_transaction *t)
+{
+	struct list_head *next = list;
+	struct binder_work *w;
+
+	list_for_each_entry_reverse(w, list, entry) {
+		struct binder_transaction *tmp;
+
+		if (w->type != BINDER_WORK_TRANSACTION)
+			break;
+		tmp = container_of(w, struct binder_transaction, work);
+		if (tmp->queue_prio <= t->queue_prio)
+			break;
+		next = &w->entry;
+	}
+	list_add_tail(&t->work.entry, next);
+
+	t->queued_time = ktime_get();
+	t->queued = 1;
+	proc->queued_transactions++;
+	if (proc->queued_transactions > proc->max_queued_transactions)
+		proc->max_queued_transactions = proc->queued_transactions;
+}
+
+static void binder_dequeue_transaction(struct binder_proc *proc,
+				       struct binder_transaction *t)
+{
+	s64 wait_us = ktime_us_delta(ktime_get(), t->queued_time);
+	int bucket = wait_us > 0 ? fls64(wait_us) : 0;
+
+	list_del(&t->work.entry);
+	t->queued = 0;
+	proc->queued_transactions--;
+	if (bucket >= BINDER_WAIT_HIST_BUCKETS)
+		bucket = BINDER_WAIT_HIST_BUCKETS - 1;
+	proc->wait_hist[bucket]++;
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -608,15 +909,45 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+/* Called with proc->lock held. */
+static inline void binder_stats_alloc(struct binder_proc *proc,
+				      enum binder_alloc_stat_types type)
+{
+	binder_stats.alloc[type]++;
+	proc->stats.alloc[type]++;
+}
+
+static void binder_lru_add(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	if (list_empty(&page->lru)) {
+		list_add_tail(&page->lru, &binder_lru);
+		binder_lru_count++;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
+static void binder_lru_del(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	if (!list_empty(&page->lru)) {
+		list_del_init(&page->lru);
+		binder_lru_count--;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
 {
 	void *page_addr;
+	void *failed_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
+	int ret;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -625,34 +956,23 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
-		mm = get_task_mm(proc->tsk);
-
-	if (mm) {
-		down_write(&mm->mmap_sem);
-		vma = proc->vma;
-	}
-
 	if (allocate == 0)
 		goto free_range;
 
-	if (vma == NULL) {
-		binder_debug(BINDER_DEBUG_TOP_ERRORS,
-		       "binder: %d: binder_alloc_buf failed to "
-		       "map pages in userspace, no vma\n", proc->pid);
-		goto err_no_vma;
-	}
-
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
 		struct page **page_array_ptr;
+
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr) {
+			/* still mapped from an earlier buffer */
+			binder_lru_del(page);
+			binder_stats_alloc(proc, BINDER_ALLOC_PAGE_REUSED);
+			continue;
+		}
+
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 			       "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
@@ -660,7 +980,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -669,9 +989,25 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			       proc->pid, page_addr);
 			goto err_map_kernel_failed;
 		}
+
+		if (vma == NULL) {
+			mm = get_task_mm(proc->tsk);
+			if (mm) {
+				down_write(&mm->mmap_sem);
+				vma = proc->vma;
+			}
+			if (vma == NULL) {
+				binder_debug(BINDER_DEBUG_TOP_ERRORS,
+				       "binder: %d: binder_alloc_buf failed to "
+				       "map pages in userspace, no vma\n",
+				       proc->pid);
+				goto err_vm_insert_page_failed;
+			}
+		}
+
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 			       "binder: %d: binder_alloc_buf failed "
@@ -680,6 +1016,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
+		binder_stats_alloc(proc, BINDER_ALLOC_PAGE_MAPPED);
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -691,18 +1028,22 @@ free_range:
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		binder_lru_add(page);
+	}
+	return 0;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
-err_no_vma:
+	failed_addr = page_addr;
+	/* the pages mapped so far stay around for the shrinker */
+	for (page_addr = start; page_addr < failed_addr;
+	     page_addr += PAGE_SIZE)
+		binder_lru_add(&proc->pages[(page_addr - proc->buffer) /
+					    PAGE_SIZE]);
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
@@ -710,6 +1051,126 @@ err_no_vma:
 	return -ENOMEM;
 }
 
+/*
+ * The shrinker runs from reclaim, where it must not drop the last reference
+ * to an mm: that would run exit_mmap() right there. So it leaves procs whose
+ * task is exiting alone, and if the task exits while it holds a reference
+ * anyway, hands that last reference to the deferred worker.
+ *
+ * Called with proc->lock held.
+ */
+static struct mm_struct *binder_shrink_get_mm(struct binder_proc *proc)
+{
+	struct task_struct *tsk = proc->tsk;
+	struct mm_struct *mm = NULL;
+
+	if (proc->shrink_mm)
+		return NULL;
+
+	task_lock(tsk);
+	if (tsk->mm && !(tsk->flags & (PF_EXITING | PF_KTHREAD))) {
+		mm = tsk->mm;
+		atomic_inc(&mm->mm_users);
+	}
+	task_unlock(tsk);
+
+	return mm;
+}
+
+static void binder_shrink_put_mm(struct binder_proc *proc,
+				 struct mm_struct *mm)
+{
+	if (atomic_add_unless(&mm->mm_users, -1, 1))
+		return;
+
+	proc->shrink_mm = mm;
+	binder_defer_work(proc, BINDER_DEFERRED_PUT_MM);
+}
+
+static int binder_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+	struct mm_struct *mm;
+	void *page_addr;
+
+	if (nr_to_scan == 0)
+		return binder_lru_count;
+
+	/* procs cannot be released while this is held */
+	if (!down_read_trylock(&binder_main_lock))
+		return -1;
+
+	while (nr_to_scan--) {
+		spin_lock(&binder_lru_lock);
+		if (list_empty(&binder_lru)) {
+			spin_unlock(&binder_lru_lock);
+			break;
+		}
+		page = list_first_entry(&binder_lru, struct binder_lru_page,
+					lru);
+		proc = page->proc;
+		if (!mutex_trylock(&proc->lock)) {
+			list_move_tail(&page->lru, &binder_lru);
+			spin_unlock(&binder_lru_lock);
+			continue;
+		}
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		spin_unlock(&binder_lru_lock);
+
+		page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+		mm = binder_shrink_get_mm(proc);
+		if (mm == NULL && proc->vma) {
+			/*
+			 * Still mapped in userspace, but we cannot zap it now:
+			 * freeing the page would leave the user pte pointing at
+			 * it. The page goes when the vma does.
+			 */
+			binder_lru_add(page);
+			mutex_unlock(&proc->lock);
+			continue;
+		}
+		if (mm) {
+			if (!down_read_trylock(&mm->mmap_sem)) {
+				binder_shrink_put_mm(proc, mm);
+				binder_lru_add(page);
+				mutex_unlock(&proc->lock);
+				continue;
+			}
+			if (proc->vma)
+				zap_page_range(proc->vma, (uintptr_t)page_addr +
+					proc->user_buffer_offset, PAGE_SIZE,
+					NULL);
+			up_read(&mm->mmap_sem);
+			binder_shrink_put_mm(proc, mm);
+		}
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(page->page_ptr);
+		page->page_ptr = NULL;
+		binder_stats_alloc(proc, BINDER_ALLOC_PAGE_SHRUNK);
+		mutex_unlock(&proc->lock);
+	}
+	up_read(&binder_main_lock);
+
+	return binder_lru_count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int binder_buffer_cache_class(size_t size)
+{
+	int class;
+
+	for (class = 0; class < BINDER_BUFFER_CACHE_CLASSES; class++)
+		if (size <= (BINDER_BUFFER_CACHE_MIN << class))
+			return class;
+	return -1;
+}
+
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 					      size_t data_size,
 					      size_t offsets_size, int is_async)
@@ -720,7 +1181,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	struct rb_node *best_fit = NULL;
 	void *has_page_addr;
 	void *end_page_addr;
-	size_t size;
+	size_t size, alloc_size;
+	int class;
 
 	if (proc->vma == NULL) {
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -746,21 +1208,46 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	alloc_size = size;
+	class = binder_buffer_cache_class(size);
+	if (class >= 0) {
+		if (!list_empty(&proc->buffer_cache[class])) {
+			buffer = list_first_entry(&proc->buffer_cache[class],
+						  struct binder_buffer,
+						  cache_entry);
+			list_del(&buffer->cache_entry);
+			proc->buffer_cache_count[class]--;
+			binder_insert_allocated_buffer(proc, buffer);
+			binder_stats_alloc(proc, BINDER_ALLOC_CACHE_HIT);
+			goto got_buffer;
+		}
+		binder_stats_alloc(proc, BINDER_ALLOC_CACHE_MISS);
+		/* carve a whole class so the buffer can be cached when freed */
+		alloc_size = BINDER_BUFFER_CACHE_MIN << class;
+	}
+
+retry:
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (size < buffer_size) {
+		if (alloc_size < buffer_size) {
 			best_fit = n;
 			n = n->rb_left;
-		} else if (size > buffer_size)
+		} else if (alloc_size > buffer_size)
 			n = n->rb_right;
 		else {
 			best_fit = n;
 			break;
 		}
 	}
+	if (best_fit == NULL && alloc_size != size) {
+		/* no room for the whole class, settle for an exact fit */
+		alloc_size = size;
+		n = proc->free_buffers.rb_node;
+		goto retry;
+	}
 	if (best_fit == NULL) {
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
 		       "binder: %d: binder_alloc_buf size %zd failed, "
@@ -779,10 +1266,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
 	if (n == NULL) {
-		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
-			buffer_size = size; /* no room for other buffers */
+		if (alloc_size + sizeof(struct binder_buffer) + 4 >= buffer_size)
+			buffer_size = alloc_size; /* no room for other buffers */
 		else
-			buffer_size = size + sizeof(struct binder_buffer);
+			buffer_size = alloc_size + sizeof(struct binder_buffer);
 	}
 	end_page_addr =
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
@@ -795,12 +1282,14 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	rb_erase(best_fit, &proc->free_buffers);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
-	if (buffer_size != size) {
-		struct binder_buffer *new_buffer = (void *)buffer->data + size;
+	if (buffer_size != alloc_size) {
+		struct binder_buffer *new_buffer =
+			(void *)buffer->data + alloc_size;
 		list_add(&new_buffer->entry, &buffer->entry);
 		new_buffer->free = 1;
 		binder_insert_free_buffer(proc, new_buffer);
 	}
+got_buffer:
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
 		     "%p\n", proc->pid, size, buffer);
@@ -880,6 +1369,7 @@ static void binder_free_buf(struct binder_proc *proc,
 			    struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
+	int class;
 
 	buffer_size = binder_buffer_size(proc, buffer);
 
@@ -905,6 +1395,17 @@ static void binder_free_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
+	class = binder_buffer_cache_class(buffer_size);
+	if (class >= 0 &&
+	    buffer_size == BINDER_BUFFER_CACHE_MIN << class &&
+	    proc->buffer_cache_count[class] < BINDER_BUFFER_CACHE_DEPTH) {
+		/* keep it carved out; its neighbours never merge with it */
+		rb_erase(&buffer->rb_node, &proc->allocated_buffers);
+		list_add(&buffer->cache_entry, &proc->buffer_cache[class]);
+		proc->buffer_cache_count[class]++;
+		return;
+	}
+
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
@@ -976,7 +1477,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -990,8 +1491,8 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+static int __binder_inc_node(struct binder_node *node, int strong,
+			     int internal, struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -1027,7 +1528,19 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
+{
+	int dead, ret;
+
+	dead = binder_lock_node(node);
+	ret = __binder_inc_node(node, strong, internal, target_list);
+	binder_unlock_node(dead);
+	return ret;
+}
+
+static int __binder_dec_node(struct binder_node *node, int strong,
+			     int internal)
 {
 	if (strong) {
 		if (internal)
@@ -1070,6 +1583,16 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 	return 0;
 }
 
+static int binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	int dead, ret;
+
+	dead = binder_lock_node(node);
+	ret = __binder_dec_node(node, strong, internal);
+	binder_unlock_node(dead);
+	return ret;
+}
+
 
 static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 					 uint32_t desc)
@@ -1113,7 +1636,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1142,7 +1665,10 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
 	if (node) {
+		int dead = binder_lock_node(node);
+
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		binder_unlock_node(dead);
 
 		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 			     "binder: %d new ref %d desc %d for "
@@ -1159,6 +1685,8 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	int dead;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
@@ -1166,10 +1694,12 @@ static void binder_delete_ref(struct binder_ref *ref)
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	dead = binder_lock_node(ref->node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		__binder_dec_node(ref->node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	__binder_dec_node(ref->node, 0, 1);
+	binder_unlock_node(dead);
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
@@ -1396,9 +1926,44 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * binder_buffer_missing_proc - returns a proc that owns a node referenced by
+ * a handle in 'buffer' but is not in 'set', or NULL if the set covers them
+ * all. Malformed objects are skipped here; the caller rejects them later.
+ */
+static struct binder_proc *
+binder_buffer_missing_proc(struct binder_lockset *set,
+			   struct binder_proc *proc,
+			   struct binder_buffer *buffer)
+{
+	size_t *offp, *off_end;
+
+	offp = (size_t *)(buffer->data + ALIGN(buffer->data_size,
+				sizeof(void *)));
+	off_end = offp + buffer->offsets_size / sizeof(size_t);
+	for (; offp < off_end; offp++) {
+		struct flat_binder_object *fp;
+		struct binder_ref *ref;
+
+		if (*offp > buffer->data_size - sizeof(*fp) ||
+		    buffer->data_size < sizeof(*fp) ||
+		    !IS_ALIGNED(*offp, sizeof(void *)))
+			continue;
+		fp = (struct flat_binder_object *)(buffer->data + *offp);
+		if (fp->type != BINDER_TYPE_HANDLE &&
+		    fp->type != BINDER_TYPE_WEAK_HANDLE)
+			continue;
+		ref = binder_get_ref(proc, fp->handle);
+		if (ref && !binder_lockset_has(set, ref->node->proc))
+			return ref->node->proc;
+	}
+	return NULL;
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       struct binder_lockset *set)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
@@ -1410,6 +1975,7 @@ static void binder_transaction(struct binder_proc *proc,
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
+	struct binder_proc *missing_proc;
 	uint32_t return_error;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
@@ -1420,6 +1986,10 @@ static void binder_transaction(struct binder_proc *proc,
 	e->data_size = tr->data_size;
 	e->offsets_size = tr->offsets_size;
 
+retry:
+	target_thread = NULL;
+	target_node = NULL;
+	in_reply_to = NULL;
 	if (reply) {
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
@@ -1429,7 +1999,7 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_restore_priority(in_reply_to);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1443,8 +2013,21 @@ static void binder_transaction(struct binder_proc *proc,
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
-		thread->transaction_stack = in_reply_to->to_parent;
 		target_thread = in_reply_to->from;
+		/*
+		 * Failing a reply to a dead thread walks the transaction stack
+		 * into procs we cannot name here, so that needs exclusive mode.
+		 */
+		if (target_thread == NULL && !set->exclusive) {
+			binder_lockset_relock(set, NULL);
+			goto retry;
+		}
+		if (target_thread &&
+		    !binder_lockset_has(set, target_thread->proc)) {
+			binder_lockset_relock(set, target_thread->proc);
+			goto retry;
+		}
+		thread->transaction_stack = in_reply_to->to_parent;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
@@ -1488,6 +2071,10 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		if (!binder_lockset_has(set, target_proc)) {
+			binder_lockset_relock(set, target_proc);
+			goto retry;
+		}
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
 			tmp = thread->transaction_stack;
@@ -1534,7 +2121,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1564,6 +2151,9 @@ static void binder_transaction(struct binder_proc *proc,
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
+	t->sched_policy = current->policy;
+	t->rt_priority = current->rt_priority;
+	t->queue_prio = current->normal_prio;
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
@@ -1585,6 +2175,9 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
+	binder_stats.transaction_bytes += tr->data_size;
+	proc->stats.transaction_bytes += tr->data_size;
+	thread->stats.transaction_bytes += tr->data_size;
 	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
 			"offsets ptr\n", proc->pid, thread->pid);
@@ -1598,6 +2191,18 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_bad_offset;
 	}
+	missing_proc = binder_buffer_missing_proc(set, proc, t->buffer);
+	if (missing_proc) {
+		binder_transaction_buffer_release(target_proc, t->buffer, offp);
+		t->buffer->transaction = NULL;
+		binder_free_buf(target_proc, t->buffer);
+		kfree(tcomplete);
+		binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+		kfree(t);
+		binder_stats_deleted(BINDER_STAT_TRANSACTION);
+		binder_lockset_relock(set, missing_proc);
+		goto retry;
+	}
 	off_end = (void *)offp + tr->offsets_size;
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
@@ -1776,7 +2381,10 @@ static void binder_transaction(struct binder_proc *proc,
 			target_node->has_async_transaction = 1;
 	}
 	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
+	if (target_node && target_list == &target_node->async_todo)
+		list_add_tail(&t->work.entry, target_list);
+	else
+		binder_enqueue_transaction(target_proc, target_list, t);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
@@ -1832,11 +2440,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 	uint32_t cmd;
 	void __user *ptr = buffer + *consumed;
 	void __user *end = buffer + size;
+	struct binder_lockset set;
+	int ret;
 
 	while (ptr < end && thread->return_error == BR_OK) {
 		if (get_user(cmd, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
+		binder_lockset_init(&set, proc);
+		binder_lockset_lock(&set);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
 			binder_stats.bc[_IOC_NR(cmd)]++;
 			proc->stats.bc[_IOC_NR(cmd)]++;
@@ -1851,13 +2463,22 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			struct binder_ref *ref;
 			const char *debug_string;
 
-			if (get_user(target, (uint32_t __user *)ptr))
-				return -EFAULT;
+			if (get_user(target, (uint32_t __user *)ptr)) {
+				ret = -EFAULT;
+				goto err;
+			}
 			ptr += sizeof(uint32_t);
+retry_ref:
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
-				ref = binder_get_ref_for_node(proc,
-					       binder_context_mgr_node);
+				struct binder_node *node;
+
+				node = binder_context_mgr_node;
+				if (!binder_lockset_has(&set, node->proc)) {
+					binder_lockset_relock(&set, node->proc);
+					goto retry_ref;
+				}
+				ref = binder_get_ref_for_node(proc, node);
 				if (ref->desc != target) {
 					binder_user_error("binder: %d:"
 						"%d tried to acquire "
@@ -1874,6 +2495,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid, target);
 				break;
 			}
+			if (!binder_lockset_has(&set, ref->node->proc)) {
+				binder_lockset_relock(&set, ref->node->proc);
+				goto retry_ref;
+			}
 			switch (cmd) {
 			case BC_INCREFS:
 				debug_string = "IncRefs";
@@ -1907,11 +2532,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			void *cookie;
 			struct binder_node *node;
 
-			if (get_user(node_ptr, (void * __user *)ptr))
-				return -EFAULT;
+			if (get_user(node_ptr, (void * __user *)ptr)) {
+				ret = -EFAULT;
+				goto err;
+			}
 			ptr += sizeof(void *);
-			if (get_user(cookie, (void * __user *)ptr))
-				return -EFAULT;
+			if (get_user(cookie, (void * __user *)ptr)) {
+				ret = -EFAULT;
+				goto err;
+			}
 			ptr += sizeof(void *);
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
@@ -1968,20 +2597,25 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 		case BC_ATTEMPT_ACQUIRE:
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 				"binder: BC_ATTEMPT_ACQUIRE not supported\n");
-			return -EINVAL;
+			ret = -EINVAL;
+			goto err;
 		case BC_ACQUIRE_RESULT:
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 				"binder: BC_ACQUIRE_RESULT not supported\n");
-			return -EINVAL;
+			ret = -EINVAL;
+			goto err;
 
 		case BC_FREE_BUFFER: {
 			void __user *data_ptr;
 			struct binder_buffer *buffer;
+			struct binder_proc *missing_proc;
 
-			if (get_user(data_ptr, (void * __user *)ptr))
-				return -EFAULT;
+			if (get_user(data_ptr, (void * __user *)ptr)) {
+				ret = -EFAULT;
+				goto err;
+			}
 			ptr += sizeof(void *);
-
+retry_free:
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
 				binder_user_error("binder: %d:%d "
@@ -1996,6 +2630,12 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			missing_proc = binder_buffer_missing_proc(&set, proc,
+								  buffer);
+			if (missing_proc) {
+				binder_lockset_relock(&set, missing_proc);
+				goto retry_free;
+			}
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found"
 				     " buffer %d for %s transaction\n",
@@ -2011,8 +2651,17 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				BUG_ON(!buffer->target_node->has_async_transaction);
 				if (list_empty(&buffer->target_node->async_todo))
 					buffer->target_node->has_async_transaction = 0;
-				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+				else {
+					struct binder_transaction *async_t;
+
+					async_t = list_first_entry(
+						&buffer->target_node->async_todo,
+						struct binder_transaction,
+						work.entry);
+					list_del(&async_t->work.entry);
+					binder_enqueue_transaction(proc,
+						&thread->todo, async_t);
+				}
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
@@ -2023,10 +2672,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 		case BC_REPLY: {
 			struct binder_transaction_data tr;
 
-			if (copy_from_user(&tr, ptr, sizeof(tr)))
-				return -EFAULT;
+			if (copy_from_user(&tr, ptr, sizeof(tr))) {
+				ret = -EFAULT;
+				goto err;
+			}
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					   &set);
 			break;
 		}
 
@@ -2079,11 +2731,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			struct binder_ref *ref;
 			struct binder_ref_death *death;
 
-			if (get_user(target, (uint32_t __user *)ptr))
-				return -EFAULT;
+			if (get_user(target, (uint32_t __user *)ptr)) {
+				ret = -EFAULT;
+				goto err;
+			}
 			ptr += sizeof(uint32_t);
-			if (get_user(cookie, (void __user * __user *)ptr))
-				return -EFAULT;
+			if (get_user(cookie, (void __user * __user *)ptr)) {
+				ret = -EFAULT;
+				goto err;
+			}
 			ptr += sizeof(void *);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
@@ -2180,8 +2836,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			struct binder_work *w;
 			void __user *cookie;
 			struct binder_ref_death *death = NULL;
-			if (get_user(cookie, (void __user * __user *)ptr))
-				return -EFAULT;
+			if (get_user(cookie, (void __user * __user *)ptr)) {
+				ret = -EFAULT;
+				goto err;
+			}
 
 			ptr += sizeof(void *);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -2217,11 +2875,17 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 			      "binder: %d:%d unknown command %d\n",
 			       proc->pid, thread->pid, cmd);
-			return -EINVAL;
+			ret = -EINVAL;
+			goto err;
 		}
+		binder_lockset_unlock(&set);
 		*consumed = ptr - buffer;
 	}
 	return 0;
+
+err:
+	binder_lockset_unlock(&set);
+	return ret;
 }
 
 void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
@@ -2288,7 +2952,8 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&proc->lock);
+	up_read(&binder_main_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2312,7 +2977,8 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	down_read(&binder_main_lock);
+	mutex_lock(&proc->lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
@@ -2462,13 +3128,7 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			binder_inherit_priority(t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2514,7 +3174,7 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
+		binder_dequeue_transaction(proc, t);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
@@ -2557,6 +3217,11 @@ static void binder_release_work(struct list_head *list)
 			struct binder_transaction *t;
 
 			t = container_of(w, struct binder_transaction, work);
+			/* entries parked on async_todo were never counted */
+			if (t->queued) {
+				t->queued = 0;
+				t->to_proc->queued_transactions--;
+			}
 			if (t->buffer->target_node && !(t->flags & TF_ONE_WAY))
 				binder_send_failed_reply(t, BR_DEAD_REPLY);
 		} break;
@@ -2654,12 +3319,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_main_lock);
+	mutex_lock(&proc->lock);
 	thread = binder_get_thread(proc);
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&proc->lock);
+	up_read(&binder_main_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2677,6 +3344,40 @@ static unsigned int binder_poll(struct file *filp,
 	return 0;
 }
 
+/* Called with proc->lock and binder_global_lock held. */
+static int binder_set_context_mgr(struct binder_proc *proc)
+{
+	struct binder_node *node;
+
+	if (binder_context_mgr_node != NULL) {
+		binder_debug(BINDER_DEBUG_TOP_ERRORS,
+			"binder: BINDER_SET_CONTEXT_MGR already set\n");
+		return -EBUSY;
+	}
+	if (binder_context_mgr_uid != -1) {
+		if (binder_context_mgr_uid != current->cred->euid) {
+			binder_debug(BINDER_DEBUG_TOP_ERRORS,
+			       "binder: BINDER_SET_"
+			       "CONTEXT_MGR bad uid %d != %d\n",
+			       current->cred->euid,
+			       binder_context_mgr_uid);
+			return -EPERM;
+		}
+	} else
+		binder_context_mgr_uid = current->cred->euid;
+	node = binder_new_node(proc, NULL, NULL);
+	if (node == NULL)
+		return -ENOMEM;
+	node->local_weak_refs++;
+	node->local_strong_refs++;
+	node->has_strong_ref = 1;
+	node->has_weak_ref = 1;
+	/* other procs look the node up without binder_global_lock */
+	smp_wmb();
+	binder_context_mgr_node = node;
+	return 0;
+}
+
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
@@ -2693,8 +3394,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_main_lock);
+	mutex_lock(&proc->lock);
 	thread = binder_get_thread(proc);
+	mutex_unlock(&proc->lock);
 	if (thread == NULL) {
 		ret = -ENOMEM;
 		goto err;
@@ -2726,9 +3429,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		}
 		if (bwr.read_size > 0) {
+			mutex_lock(&proc->lock);
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
 			if (!list_empty(&proc->todo))
 				wake_up_interruptible(&proc->wait);
+			mutex_unlock(&proc->lock);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2745,46 +3450,34 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf,
-					sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		mutex_lock(&proc->lock);
+		proc->max_threads = max_threads;
+		mutex_unlock(&proc->lock);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
-		if (binder_context_mgr_node != NULL) {
-			binder_debug(BINDER_DEBUG_TOP_ERRORS,
-				"binder: BINDER_SET_CONTEXT_MGR already set\n");
-			ret = -EBUSY;
+		mutex_lock(&proc->lock);
+		mutex_lock(&binder_global_lock);
+		ret = binder_set_context_mgr(proc);
+		mutex_unlock(&binder_global_lock);
+		mutex_unlock(&proc->lock);
+		if (ret)
 			goto err;
-		}
-		if (binder_context_mgr_uid != -1) {
-			if (binder_context_mgr_uid != current->cred->euid) {
-				binder_debug(BINDER_DEBUG_TOP_ERRORS,
-				       "binder: BINDER_SET_"
-				       "CONTEXT_MGR bad uid %d != %d\n",
-				       current->cred->euid,
-				       binder_context_mgr_uid);
-				ret = -EPERM;
-				goto err;
-			}
-		} else
-			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
-			ret = -ENOMEM;
-			goto err;
-		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
+		up_read(&binder_main_lock);
+		down_write(&binder_main_lock);
 		binder_free_thread(proc, thread);
+		downgrade_write(&binder_main_lock);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2803,9 +3496,12 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		mutex_lock(&proc->lock);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		mutex_unlock(&proc->lock);
+	}
+	up_read(&binder_main_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -2849,6 +3545,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2898,6 +3595,12 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
+	for (i = 0; i < BINDER_BUFFER_CACHE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->buffer_cache[i]);
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2952,13 +3655,16 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_init(&proc->lock);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
+	down_read(&binder_main_lock);
+	mutex_lock(&binder_global_lock);
+	binder_stats_created(BINDER_STAT_PROC);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_global_lock);
+	up_read(&binder_main_lock);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2966,6 +3672,13 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		proc->debugfs_entry = debugfs_create_file(strbuf, S_IRUGO,
 			binder_debugfs_dir_entry_proc, proc, &binder_proc_fops);
 	}
+	if (binder_debugfs_dir_entry_queue) {
+		char strbuf[11];
+		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
+		proc->debugfs_queue_entry = debugfs_create_file(strbuf,
+			S_IRUGO, binder_debugfs_dir_entry_queue, proc,
+			&binder_queue_fops);
+	}
 
 	return 0;
 }
@@ -3002,6 +3715,7 @@ static int binder_release(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc = filp->private_data;
 	debugfs_remove(proc->debugfs_entry);
+	debugfs_remove(proc->debugfs_queue_entry);
 	binder_defer_work(proc, BINDER_DEFERRED_RELEASE);
 
 	return 0;
@@ -3016,6 +3730,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
+	BUG_ON(proc->shrink_mm);
 
 	hlist_del(&proc->proc_node);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
@@ -3103,7 +3818,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 	if (proc->pages) {
 		int i;
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			if (proc->pages[i].page_ptr) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
@@ -3112,7 +3827,8 @@ static void binder_deferred_release(struct binder_proc *proc)
 					     page_addr);
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				binder_lru_del(&proc->pages[i]);
+				__free_page(proc->pages[i].page_ptr);
 				page_count++;
 			}
 		}
@@ -3136,10 +3852,10 @@ static void binder_deferred_func(struct work_struct *work)
 {
 	struct binder_proc *proc;
 	struct files_struct *files;
+	struct mm_struct *mm;
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3154,19 +3870,36 @@ static void binder_deferred_func(struct work_struct *work)
 		mutex_unlock(&binder_deferred_lock);
 
 		files = NULL;
-		if (defer & BINDER_DEFERRED_PUT_FILES) {
-			files = proc->files;
-			if (files)
-				proc->files = NULL;
-		}
+		mm = NULL;
+		if (defer & (BINDER_DEFERRED_PUT_FILES |
+			     BINDER_DEFERRED_FLUSH |
+			     BINDER_DEFERRED_PUT_MM)) {
+			down_read(&binder_main_lock);
+			mutex_lock(&proc->lock);
+			if (defer & BINDER_DEFERRED_PUT_FILES) {
+				files = proc->files;
+				if (files)
+					proc->files = NULL;
+			}
+			if (defer & BINDER_DEFERRED_PUT_MM) {
+				mm = proc->shrink_mm;
+				proc->shrink_mm = NULL;
+			}
 
-		if (defer & BINDER_DEFERRED_FLUSH)
-			binder_deferred_flush(proc);
+			if (defer & BINDER_DEFERRED_FLUSH)
+				binder_deferred_flush(proc);
+			mutex_unlock(&proc->lock);
+			up_read(&binder_main_lock);
+		}
 
-		if (defer & BINDER_DEFERRED_RELEASE)
+		if (defer & BINDER_DEFERRED_RELEASE) {
+			down_write(&binder_main_lock);
 			binder_deferred_release(proc); /* frees proc */
+			up_write(&binder_main_lock);
+		}
 
-		mutex_unlock(&binder_lock);
+		if (mm)
+			mmput(mm);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3401,6 +4134,14 @@ static const char *binder_command_strings[] = {
 	"BC_DEAD_BINDER_DONE"
 };
 
+static const char *binder_allocstat_strings[] = {
+	"buffer cache hit",
+	"buffer cache miss",
+	"page reused",
+	"page mapped",
+	"page shrunk"
+};
+
 static const char *binder_objstat_strings[] = {
 	"proc",
 	"thread",
@@ -3443,6 +4184,18 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 				stats->obj_created[i] - stats->obj_deleted[i],
 				stats->obj_created[i]);
 	}
+
+	BUILD_BUG_ON(ARRAY_SIZE(stats->alloc) !=
+		     ARRAY_SIZE(binder_allocstat_strings));
+	for (i = 0; i < ARRAY_SIZE(stats->alloc); i++) {
+		if (stats->alloc[i])
+			seq_printf(m, "%s%s: %d\n", prefix,
+				   binder_allocstat_strings[i], stats->alloc[i]);
+	}
+
+	if (stats->transaction_bytes)
+		seq_printf(m, "%stransaction bytes: %lu\n", prefix,
+			   stats->transaction_bytes);
 }
 
 static void print_binder_proc_stats(struct seq_file *m,
@@ -3507,7 +4260,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 
 	seq_puts(m, "binder state:\n");
 
@@ -3519,7 +4272,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3530,16 +4283,19 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	seq_printf(m, "lockset: contended %lu relocks %lu exclusive %lu\n",
+		   binder_lock_stats.contended, binder_lock_stats.relocks,
+		   binder_lock_stats.exclusive);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3550,13 +4306,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3566,11 +4322,32 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
+	return 0;
+}
+
+static int binder_queue_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc = m->private;
+	int do_lock = !binder_debug_no_lock;
+	int i;
+
+	if (do_lock)
+		down_write(&binder_main_lock);
+	seq_printf(m, "binder proc %d queue:\n", proc->pid);
+	seq_printf(m, "  queued transactions: %d max %d\n",
+		   proc->queued_transactions, proc->max_queued_transactions);
+	seq_puts(m, "  wait time:\n");
+	for (i = 0; i < BINDER_WAIT_HIST_BUCKETS - 1; i++)
+		seq_printf(m, "    [%u, %u) us: %u\n", i ? 1U << (i - 1) : 0,
+			   1U << i, proc->wait_hist[i]);
+	seq_printf(m, "    >= %u us: %u\n", 1U << (i - 1), proc->wait_hist[i]);
+	if (do_lock)
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3632,7 +4409,11 @@ static int __init binder_init(void)
 	if (binder_debugfs_dir_entry_root)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
+	if (binder_debugfs_dir_entry_root)
+		binder_debugfs_dir_entry_queue = debugfs_create_dir("queue",
+						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
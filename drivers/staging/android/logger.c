@@ -24,7 +24,9 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
 #include <linux/time.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -149,6 +151,11 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_ctl	*ctl;	/* head/tail page shared with mmap */
+	atomic_t		mmaps;	/* number of live mappings */
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+	struct logger_seg	*segs;	/* per-CPU staging segments */
+#endif
 };
 
 /*
@@ -163,9 +170,53 @@ struct logger_reader {
 	size_t			r_off;	/* current read head offset */
 };
 
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+/*
+ * struct logger_seg - a per-CPU staging segment of a log
+ *
+ * Writers append whole entries to the segment of the CPU they are running on
+ * and never touch log->mutex, so writers on different CPUs do not contend.
+ * Staged entries are moved into the ring buffer, oldest first, by
+ * merge_segs() before the log is read. The structure is protected by 'lock';
+ * merge_segs() takes the locks of all segments at once.
+ */
+struct logger_seg {
+	spinlock_t		lock;	/* lock protecting buffer */
+	unsigned char		*buffer; /* staged entries, back to back */
+	size_t			len;	/* bytes staged */
+	size_t			r_pos;	/* merge cursor */
+};
+
+#define LOGGER_SEG_SIZE		(16*1024)
+#endif
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/*
+ * ctl_begin/ctl_end - bracket a change of the ring buffer, so that readers
+ * of the mmap'ed control page can tell that they raced with a writer.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static inline void ctl_begin(struct logger_log *log)
+{
+	if (log->ctl) {
+		log->ctl->seq++;
+		smp_wmb();
+	}
+}
+
+static inline void ctl_end(struct logger_log *log)
+{
+	if (log->ctl) {
+		log->ctl->w_off = log->w_off;
+		log->ctl->head = log->head;
+		smp_wmb();
+		log->ctl->seq++;
+	}
+}
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -246,31 +297,27 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	return count;
 }
 
+static void merge_segs(struct logger_log *);
+
 /*
- * logger_read - our log's read() method
- *
- * Behavior:
+ * wait_for_entry - sleeps until the log holds an entry that 'reader' has not
+ * read yet.
  *
- * 	- O_NONBLOCK works
- * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
- *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Returns zero once there is something to read, -EAGAIN if the file is
+ * non-blocking and -EINTR if a signal arrived. Note that the caller must
+ * recheck under log->mutex, as another reader may still lap us.
  */
-static ssize_t logger_read(struct file *file, char __user *buf,
-			   size_t count, loff_t *pos)
+static int wait_for_entry(struct file *file, struct logger_reader *reader)
 {
-	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
-	ssize_t ret;
+	int ret;
 	DEFINE_WAIT(wait);
 
-start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
+		merge_segs(log);
 		ret = (log->w_off == reader->r_off);
 		mutex_unlock(&log->mutex);
 		if (!ret)
@@ -290,6 +337,31 @@ start:
 	}
 
 	finish_wait(&log->wq, &wait);
+
+	return ret;
+}
+
+/*
+ * logger_read - our log's read() method
+ *
+ * Behavior:
+ *
+ * 	- O_NONBLOCK works
+ * 	- If there are no log entries to read, blocks until log is written to
+ * 	- Atomically reads exactly one log entry
+ *
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
+ * buffer is insufficient to hold next entry.
+ */
+static ssize_t logger_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *pos)
+{
+	struct logger_reader *reader = file->private_data;
+	struct logger_log *log = reader->log;
+	ssize_t ret;
+
+start:
+	ret = wait_for_entry(file, reader);
 	if (ret)
 		return ret;
 
@@ -317,6 +389,70 @@ out:
 	return ret;
 }
 
+/*
+ * logger_read_batch - the LOGGER_READ_BATCH ioctl
+ *
+ * Like logger_read(), but reads as many whole entries as fit in the caller's
+ * buffer, with at most two copies, and stores how many it read in 'nr'.
+ * Returns the number of bytes read.
+ */
+static long logger_read_batch(struct file *file,
+			      struct logger_read_batch __user *argp)
+{
+	struct logger_reader *reader = file->private_data;
+	struct logger_log *log = reader->log;
+	struct logger_read_batch batch;
+	size_t off, len, count;
+	__u32 nr;
+	long ret;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+
+start:
+	ret = wait_for_entry(file, reader);
+	if (ret)
+		return ret;
+
+	mutex_lock(&log->mutex);
+
+	/* is there still something to read or did we race? */
+	if (unlikely(log->w_off == reader->r_off)) {
+		mutex_unlock(&log->mutex);
+		goto start;
+	}
+
+	/* find the longest run of whole entries that fits the buffer */
+	off = reader->r_off;
+	count = 0;
+	nr = 0;
+	while (off != log->w_off) {
+		len = get_entry_len(log, off);
+		if (batch.len - count < len)
+			break;
+		off = logger_offset(off + len);
+		count += len;
+		nr++;
+	}
+
+	if (!nr) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = do_read_log_to_user(log, reader,
+				  (char __user *)(unsigned long) batch.buf,
+				  count);
+
+out:
+	mutex_unlock(&log->mutex);
+
+	if (ret >= 0 && put_user(nr, &argp->nr))
+		ret = -EFAULT;
+
+	return ret;
+}
+
 /*
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
@@ -394,6 +530,216 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 
 }
 
+/*
+ * stamp_entry - sets the timestamp of 'header' to now
+ */
+static inline void stamp_entry(struct logger_entry *header)
+{
+	struct timespec now = current_kernel_time();
+
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
+}
+
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+/*
+ * entry_before - is the timestamp of entry 'a' older than that of entry 'b'?
+ */
+static inline int entry_before(const struct logger_entry *a,
+			       const struct logger_entry *b)
+{
+	if (a->sec != b->sec)
+		return a->sec < b->sec;
+	return a->nsec < b->nsec;
+}
+
+/*
+ * seg_entry - returns the staged entry at the merge cursor of 'seg'
+ */
+static inline struct logger_entry *seg_entry(struct logger_seg *seg)
+{
+	return (struct logger_entry *) (seg->buffer + seg->r_pos);
+}
+
+/*
+ * merge_segs_stamp - moves every staged entry into the ring buffer. Each
+ * segment is already in timestamp order, so we repeatedly pick the oldest
+ * head entry among all segments, which hands readers a single ordered stream.
+ *
+ * All segments are locked for the duration, so no entry stamped before the
+ * merge can show up after it. If 'header' is not NULL it is stamped before
+ * the segments are unlocked, so that an entry the caller writes straight to
+ * the ring buffer is newer than everything merged and older than anything
+ * staged afterwards. The caller needs to hold log->mutex.
+ */
+static void merge_segs_stamp(struct logger_log *log,
+			     struct logger_entry *header)
+{
+	struct logger_seg *seg, *oldest;
+	struct logger_entry *entry;
+	int merged = 0;
+	size_t len;
+	int cpu;
+
+	if (!log->segs) {
+		if (header)
+			stamp_entry(header);
+		return;
+	}
+
+	for_each_possible_cpu(cpu) {
+		seg = per_cpu_ptr(log->segs, cpu);
+		spin_lock_nest_lock(&seg->lock, &log->mutex);
+		seg->r_pos = 0;
+	}
+
+	while (1) {
+		oldest = NULL;
+		for_each_possible_cpu(cpu) {
+			seg = per_cpu_ptr(log->segs, cpu);
+			if (seg->r_pos == seg->len)
+				continue;
+			if (!oldest ||
+			    entry_before(seg_entry(seg), seg_entry(oldest)))
+				oldest = seg;
+		}
+		if (!oldest)
+			break;
+
+		if (!merged++)
+			ctl_begin(log);
+
+		entry = seg_entry(oldest);
+		len = sizeof(struct logger_entry) + entry->len;
+		fix_up_readers(log, len);
+		do_write_log(log, entry, len);
+		oldest->r_pos += ALIGN(len, sizeof(u32));
+	}
+
+	if (merged)
+		ctl_end(log);
+
+	if (header)
+		stamp_entry(header);
+
+	for_each_possible_cpu(cpu) {
+		seg = per_cpu_ptr(log->segs, cpu);
+		seg->len = 0;
+		spin_unlock(&seg->lock);
+	}
+}
+
+static void merge_segs(struct logger_log *log)
+{
+	merge_segs_stamp(log, NULL);
+}
+
+/*
+ * stage_write - appends one entry to the staging segment of the current CPU,
+ * without taking log->mutex.
+ *
+ * Returns the number of payload bytes written, or -EAGAIN if the log is
+ * mmap'ed (mapped readers only see the ring buffer, so entries must land
+ * there right away), the entry does not fit in the segment, the payload cannot be copied without faulting, or
+ * it is a platform message for the kernel log (those go through klog_buf,
+ * which needs log->mutex). In that case nothing was staged and the caller
+ * must fall back to writing the ring buffer directly.
+ */
+static ssize_t stage_write(struct logger_log *log, struct logger_entry *header,
+			   const struct iovec *iov, unsigned long nr_segs)
+{
+	struct logger_seg *seg;
+	size_t orig;
+	ssize_t ret = 0;
+
+	if (unlikely(!log->segs))
+		return -EAGAIN;
+
+	seg = per_cpu_ptr(log->segs, raw_smp_processor_id());
+	spin_lock(&seg->lock);
+
+	/*
+	 * Checked under the segment lock: logger_mmap() bumps 'mmaps' before
+	 * it merges, so we either see it or get merged by it.
+	 */
+	if (atomic_read(&log->mmaps)) {
+		spin_unlock(&seg->lock);
+		return -EAGAIN;
+	}
+
+	orig = seg->len;
+	if (LOGGER_SEG_SIZE - orig < sizeof(struct logger_entry) + header->len) {
+		spin_unlock(&seg->lock);
+		return -EAGAIN;
+	}
+
+	/* stamp under the lock, so that each segment stays in time order */
+	stamp_entry(header);
+	memcpy(seg->buffer + seg->len, header, sizeof(struct logger_entry));
+	seg->len += sizeof(struct logger_entry);
+
+	/*
+	 * The iovecs were verified by the VFS, but we hold a spinlock and so
+	 * must not sleep on a page fault. If the payload is not resident, we
+	 * give up and let the caller take the slow path.
+	 */
+	pagefault_disable();
+	while (nr_segs-- > 0) {
+		size_t len;
+
+		len = min_t(size_t, iov->iov_len, header->len - ret);
+		if (__copy_from_user_inatomic(seg->buffer + seg->len,
+					      iov->iov_base, len)) {
+			pagefault_enable();
+			seg->len = orig;
+			spin_unlock(&seg->lock);
+			return -EAGAIN;
+		}
+
+		//{{ pass platform log (!@hello) to kernel - staged
+		/* klog_buf is only touched under log->mutex */
+		if (len >= 2 &&
+		    strncmp(seg->buffer + seg->len, "!@", 2) == 0) {
+			pagefault_enable();
+			seg->len = orig;
+			spin_unlock(&seg->lock);
+			return -EAGAIN;
+		}
+		//}} pass platform log (!@hello) to kernel - staged
+
+		seg->len += len;
+		iov++;
+		ret += len;
+	}
+	pagefault_enable();
+
+	/* keep the next staged header naturally aligned */
+	seg->len = ALIGN(seg->len, sizeof(u32));
+
+	spin_unlock(&seg->lock);
+
+	return ret;
+}
+#else
+static inline void merge_segs_stamp(struct logger_log *log,
+				    struct logger_entry *header)
+{
+	stamp_entry(header);
+}
+
+static inline void merge_segs(struct logger_log *log)
+{
+}
+
+static inline ssize_t stage_write(struct logger_log *log,
+				  struct logger_entry *header,
+				  const struct iovec *iov,
+				  unsigned long nr_segs)
+{
+	return -EAGAIN;
+}
+#endif
+
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
  * the log 'log'
@@ -442,31 +788,40 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	size_t orig;
 	struct logger_entry header;
-	struct timespec now;
 	ssize_t ret = 0;
 
-	now = current_kernel_time();
-
 	header.pid = current->tgid;
 	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
+	/* try the per-CPU staging segment first */
+	ret = stage_write(log, &header, iov, nr_segs);
+	if (ret != -EAGAIN)
+		goto out;
+	ret = 0;
+
 	mutex_lock(&log->mutex);
 
+	/*
+	 * Flush anything staged so far, so that this entry lands after all
+	 * older ones, and take the timestamp before staging can resume.
+	 */
+	merge_segs_stamp(log, &header);
+	orig = log->w_off;
+
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
 	 * entry after (what will be) the new write offset. We do this now
 	 * because if we partially fail, we can end up with clobbered log
 	 * entries that encroach on readable buffer.
 	 */
+	ctl_begin(log);
 	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
 
 	do_write_log(log, &header, sizeof(struct logger_entry));
@@ -482,6 +837,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		nr = do_write_log_from_user(log, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
 			log->w_off = orig;
+			ctl_end(log);
 			mutex_unlock(&log->mutex);
 			return nr;
 		}
@@ -490,10 +846,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	ctl_end(log);
 
 	//{{ pass platform log (!@hello) to kernel - 3/3
 	if( strncmp(klog_buf, "!@", 2) == 0 )
@@ -502,6 +855,12 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	}
 	//}} pass platform log (!@hello) to kernel - 3/3
 
+	mutex_unlock(&log->mutex);
+
+out:
+	/* wake up any blocked readers */
+	wake_up_interruptible(&log->wq);
+
 	return ret;
 }
 
@@ -590,6 +949,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
+	merge_segs(log);
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
@@ -603,7 +963,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
+	if (cmd == LOGGER_READ_BATCH) {
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		return logger_read_batch(file, (void __user *) arg);
+	}
+
 	mutex_lock(&log->mutex);
+	merge_segs(log);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -636,9 +1003,11 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
+		ctl_begin(log);
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
+		ctl_end(log);
 		ret = 0;
 		break;
 	}
@@ -648,11 +1017,92 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+/*
+ * The mapping goes by the physical address of the log's static buffer, which
+ * is only linear-mapped memory when the driver is built in: module data lives
+ * in vmalloc space. Modular builds do without mmap.
+ */
+#ifndef MODULE
+static void logger_vm_open(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_inc(&log->mmaps);
+}
+
+static void logger_vm_close(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_dec(&log->mmaps);
+}
+
+static const struct vm_operations_struct logger_vm_ops = {
+	.open = logger_vm_open,
+	.close = logger_vm_close,
+};
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the control page, followed by the ring buffer, read-only into a
+ * reader's address space, so that collectors can drain the log without a
+ * copy per entry. See struct logger_mmap_ctl for the protocol.
+ *
+ * While the log is mapped, writers bypass the per-CPU staging segments, and
+ * whatever was staged before is merged here, so that mapped readers see every
+ * entry without having to read() or poll() first.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	if (unlikely(!log->ctl))
+		return -ENODEV;
+
+	if (vma->vm_pgoff || size > PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->ctl) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (!ret && size > PAGE_SIZE)
+		ret = remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+				      virt_to_phys(log->buffer) >> PAGE_SHIFT,
+				      size - PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	vma->vm_private_data = log;
+	vma->vm_ops = &logger_vm_ops;
+	logger_vm_open(vma);
+
+	/* stop staging first, then flush what is already staged */
+	mutex_lock(&log->mutex);
+	merge_segs(log);
+	mutex_unlock(&log->mutex);
+
+	return 0;
+}
+#endif /* !MODULE */
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+#ifndef MODULE
+	.mmap = logger_mmap,
+#endif
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -662,10 +1112,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The buffer is page aligned so that it
+ * can be mmap'ed (built-in only, see logger_mmap()).
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -677,6 +1128,7 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.mmaps = ATOMIC_INIT(0), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
@@ -700,10 +1152,56 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+#ifdef CONFIG_ANDROID_LOGGER_PERCPU
+static int __init init_log_segs(struct logger_log *log)
+{
+	int cpu;
+
+	log->segs = alloc_percpu(struct logger_seg);
+	if (!log->segs)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_seg *seg = per_cpu_ptr(log->segs, cpu);
+
+		spin_lock_init(&seg->lock);
+		seg->buffer = kmalloc(LOGGER_SEG_SIZE, GFP_KERNEL);
+		if (!seg->buffer)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(log->segs, cpu)->buffer);
+	free_percpu(log->segs);
+	log->segs = NULL;
+	return -ENOMEM;
+}
+#else
+static inline int init_log_segs(struct logger_log *log)
+{
+	return 0;
+}
+#endif
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	/* without staging segments, writers simply use the locked path */
+	if (unlikely(init_log_segs(log)))
+		printk(KERN_WARNING "logger: no per-CPU segments for log "
+		       "'%s', writes will be serialized\n", log->misc.name);
+
+#ifndef MODULE
+	/* likewise, the log just cannot be mmap'ed without a control page */
+	log->ctl = (struct logger_mmap_ctl *) get_zeroed_page(GFP_KERNEL);
+	if (likely(log->ctl))
+		log->ctl->size = log->size;
+#endif
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -30,6 +30,36 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_read_batch - argument of LOGGER_READ_BATCH
+ *
+ * The ioctl fills 'buf' with as many whole entries as fit in 'len' bytes,
+ * returns the number of bytes read and sets 'nr' to the number of entries.
+ * 'buf' is 64 bits wide so that the layout is the same for 32-bit callers on
+ * a 64-bit kernel.
+ */
+struct logger_read_batch {
+	__u64		buf;	/* user pointer to the entries' buffer */
+	__u32		len;	/* size of 'buf' */
+	__u32		nr;	/* number of entries read */
+};
+
+/*
+ * struct logger_mmap_ctl - first page of a log's read-only mapping
+ *
+ * The ring buffer follows at offset PAGE_SIZE. 'seq' is odd while the log is
+ * being updated. A reader copies the entries from its own offset up to
+ * 'w_off' and then rereads 'seq': if it changed, the reader may have been
+ * lapped and must restart from 'head'. Only a built-in logger can be mapped;
+ * with a modular one, mmap() fails with ENODEV.
+ */
+struct logger_mmap_ctl {
+	__u32		seq;	/* update sequence, odd while writing */
+	__u32		w_off;	/* current write head offset */
+	__u32		head;	/* offset of the oldest readable entry */
+	__u32		size;	/* size of the ring buffer */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +75,7 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_READ_BATCH		_IOWR(__LOGGERIO, 5, \
+					      struct logger_read_batch)
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,16 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * /dev/lowmem_pressure lets user-space see the same thresholds before a kill
+ * is needed. It polls readable whenever free and file pages cross one of the
+ * minfree levels, in either direction. A read returns a single line:
+ *
+ *   level <n> min_adj <adj> free <pages> file <pages> reclaim <n> scan <n>
+ *
+ * where level is the number of minfree levels crossed (0 when none), min_adj
+ * is the oom_adj the killer would start at, and reclaim and scan are the
+ * pages per second vmscan has recently been reclaiming and scanning.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +45,17 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/ktime.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/vmstat.h>
+#include <linux/workqueue.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,12 +76,62 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static DEFINE_SPINLOCK(lowmem_deathpending_lock);
 
+/*
+ * Running totals of victim selection, for when tracing is not enabled.
+ * Unlocked, and reset by writing 0 to the module parameters.
+ */
+static uint32_t lowmem_selections;
+static uint32_t lowmem_select_max_us;
+static uint32_t lowmem_scanned_max;
+
+/*
+ * Thread group leaders, bucketed by signal->oom_adj, so that picking a
+ * victim only has to look at the highest populated bucket instead of
+ * walking every process under tasklist_lock. Kept up to date from
+ * fork, exec, release_task and /proc/<pid>/oom_adj writes.
+ *
+ * The lock is only taken in process context and never nests inside
+ * tasklist_lock; task_lock nests inside it.
+ */
+#define LOWMEM_NR_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct list_head lowmem_buckets[LOWMEM_NR_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_buckets_lock);
+static int lowmem_buckets_ready;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
+/* Current pressure level, bumps lowmem_pressure_seq when it changes */
+static int lowmem_pressure_level;
+static int lowmem_pressure_seq;
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static atomic_t lowmem_pressure_users = ATOMIC_INIT(0);
+
+/*
+ * Reclaim does not call the shrinker once pressure goes away, so while
+ * anyone is listening and a level is crossed, recheck at this interval.
+ */
+#define LOWMEM_PRESSURE_RECHECK	(HZ / 2)
+
+static void lowmem_pressure_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_pressure_work, lowmem_pressure_fn);
+
+#ifdef CONFIG_VM_EVENT_COUNTERS
+/* vmscan rates, sampled on read at most every LOWMEM_RATE_INTERVAL */
+#define LOWMEM_RATE_INTERVAL	(HZ / 10)
+
+static DEFINE_MUTEX(lowmem_rate_mutex);
+static unsigned long lowmem_events[NR_VM_EVENT_ITEMS];
+static unsigned long lowmem_rate_stamp;
+static unsigned long lowmem_last_steal, lowmem_last_scan;
+static unsigned long lowmem_steal_rate, lowmem_scan_rate;
+#endif
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -91,6 +162,238 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+static int lowmem_array_size(void)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+/* Index of the lowest minfree level crossed, or -1 if none is */
+static int lowmem_minfree_index(int array_size, int other_free,
+				int other_file)
+{
+	int i;
+
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i])
+			return i;
+	}
+	return -1;
+}
+
+static void lowmem_pressure_update(int other_free, int other_file)
+{
+	int array_size = lowmem_array_size();
+	int i = lowmem_minfree_index(array_size, other_free, other_file);
+	int level = i < 0 ? 0 : array_size - i;
+	int changed = 0;
+
+	spin_lock(&lowmem_pressure_lock);
+	if (level != lowmem_pressure_level) {
+		lowmem_pressure_level = level;
+		lowmem_pressure_seq++;
+		changed = 1;
+	}
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (changed) {
+		lowmem_print(3, "lowmem_pressure level %d, ofree %d %d\n",
+			     level, other_free, other_file);
+		wake_up_interruptible(&lowmem_pressure_wait);
+	}
+	if (level && atomic_read(&lowmem_pressure_users))
+		schedule_delayed_work(&lowmem_pressure_work,
+				      LOWMEM_PRESSURE_RECHECK);
+}
+
+static void lowmem_pressure_fn(struct work_struct *work)
+{
+	lowmem_pressure_update(global_page_state(NR_FREE_PAGES),
+			       global_page_state(NR_FILE_PAGES));
+}
+
+#ifdef CONFIG_VM_EVENT_COUNTERS
+static void lowmem_rate_sample(unsigned long *steal_rate,
+			       unsigned long *scan_rate)
+{
+	unsigned long now = jiffies;
+	unsigned long steal = 0, scan = 0;
+	int i;
+
+	mutex_lock(&lowmem_rate_mutex);
+	if (!lowmem_rate_stamp ||
+	    time_after_eq(now, lowmem_rate_stamp + LOWMEM_RATE_INTERVAL)) {
+		all_vm_events(lowmem_events);
+		for (i = PGREFILL_MOVABLE + 1; i <= PGSTEAL_MOVABLE; i++)
+			steal += lowmem_events[i];
+		for (i = PGSTEAL_MOVABLE + 1; i <= PGSCAN_DIRECT_MOVABLE; i++)
+			scan += lowmem_events[i];
+		if (lowmem_rate_stamp) {
+			unsigned long elapsed = now - lowmem_rate_stamp;
+
+			lowmem_steal_rate = (steal - lowmem_last_steal) *
+					    HZ / elapsed;
+			lowmem_scan_rate = (scan - lowmem_last_scan) *
+					   HZ / elapsed;
+		}
+		lowmem_last_steal = steal;
+		lowmem_last_scan = scan;
+		lowmem_rate_stamp = now ? now : 1;
+	}
+	*steal_rate = lowmem_steal_rate;
+	*scan_rate = lowmem_scan_rate;
+	mutex_unlock(&lowmem_rate_mutex);
+}
+#else
+/* No vm event counters to sample */
+static void lowmem_rate_sample(unsigned long *steal_rate,
+			       unsigned long *scan_rate)
+{
+	*steal_rate = 0;
+	*scan_rate = 0;
+}
+#endif
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	atomic_inc(&lowmem_pressure_users);
+	lowmem_pressure_fn(NULL);
+	/* Only changes after open make the file readable in poll() */
+	file->private_data = (void *)(unsigned long)lowmem_pressure_seq;
+	return nonseekable_open(inode, file);
+}
+
+static int lowmem_pressure_release(struct inode *inode, struct file *file)
+{
+	atomic_dec(&lowmem_pressure_users);
+	return 0;
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	char line[128];
+	int array_size = lowmem_array_size();
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES);
+	int i = lowmem_minfree_index(array_size, other_free, other_file);
+	unsigned long steal_rate, scan_rate;
+	int seq, level, len;
+
+	lowmem_rate_sample(&steal_rate, &scan_rate);
+
+	/*
+	 * Report the level of this sample, not the cached one, so that it
+	 * matches min_adj. Bring the cached level up to date first so the
+	 * sequence number read back covers it.
+	 */
+	level = i < 0 ? 0 : array_size - i;
+	lowmem_pressure_update(other_free, other_file);
+
+	spin_lock(&lowmem_pressure_lock);
+	seq = lowmem_pressure_seq;
+	spin_unlock(&lowmem_pressure_lock);
+
+	len = scnprintf(line, sizeof(line),
+			"level %d min_adj %d free %d file %d "
+			"reclaim %lu scan %lu\n",
+			level, i < 0 ? OOM_ADJUST_MAX + 1 : lowmem_adj[i],
+			other_free, other_file, steal_rate, scan_rate);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, line, len))
+		return -EFAULT;
+
+	file->private_data = (void *)(unsigned long)seq;
+	return len;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	if ((unsigned long)file->private_data !=
+	    (unsigned long)lowmem_pressure_seq)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lowmem_pressure_open,
+	.release	= lowmem_pressure_release,
+	.read		= lowmem_pressure_read,
+	.poll		= lowmem_pressure_poll,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_miscdev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= "lowmem_pressure",
+	.fops	= &lowmem_pressure_fops,
+};
+
+static struct list_head *lowmem_bucket(int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	return &lowmem_buckets[oom_adj - OOM_DISABLE];
+}
+
+/* Called from copy_process() for a new thread group leader */
+void lowmem_task_add(struct task_struct *p)
+{
+	spin_lock(&lowmem_buckets_lock);
+	if (lowmem_buckets_ready && list_empty(&p->lowmem_node))
+		list_add_tail(&p->lowmem_node,
+			      lowmem_bucket(p->signal->oom_adj));
+	spin_unlock(&lowmem_buckets_lock);
+}
+
+/* Called from release_task(), for every thread */
+void lowmem_task_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_buckets_lock);
+	if (!list_empty(&p->lowmem_node))
+		list_del_init(&p->lowmem_node);
+	spin_unlock(&lowmem_buckets_lock);
+}
+
+/* Called from de_thread() when an exec'ing thread takes over as leader */
+void lowmem_task_replace(struct task_struct *old, struct task_struct *new)
+{
+	spin_lock(&lowmem_buckets_lock);
+	if (!list_empty(&old->lowmem_node)) {
+		list_del_init(&old->lowmem_node);
+		if (list_empty(&new->lowmem_node))
+			list_add_tail(&new->lowmem_node,
+				      lowmem_bucket(new->signal->oom_adj));
+	}
+	spin_unlock(&lowmem_buckets_lock);
+}
+
+/* Called after p->signal->oom_adj has been written */
+void lowmem_oom_adj_update(struct task_struct *p)
+{
+	struct task_struct *leader;
+
+	rcu_read_lock();
+	leader = p->group_leader;
+	spin_lock(&lowmem_buckets_lock);
+	if (!list_empty(&leader->lowmem_node))
+		list_move_tail(&leader->lowmem_node,
+			       lowmem_bucket(p->signal->oom_adj));
+	spin_unlock(&lowmem_buckets_lock);
+	rcu_read_unlock();
+}
+
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
@@ -98,14 +401,20 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	int rem = 0;
 	int tasksize;
 	int i;
+	int adj;
 	int min_adj = OOM_ADJUST_MAX + 1;
+	int minfree = 0;
+	int scanned = 0;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+	int selected_oom_adj = 0;
+	int array_size = lowmem_array_size();
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
+	ktime_t start, elapsed;
 	unsigned long flags;
 
+	lowmem_pressure_update(other_free, other_file);
+
 	/*
 	 * If we already have a death outstanding, then
 	 * bail out right away; indicating to vmscan
@@ -116,16 +425,10 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	if (lowmem_deathpending)
 		return 0;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
-		}
+	i = lowmem_minfree_index(array_size, other_free, other_file);
+	if (i >= 0) {
+		min_adj = lowmem_adj[i];
+		minfree = lowmem_minfree[i];
 	}
 
 	if (min_adj == OOM_ADJUST_MAX + 1)
@@ -144,64 +447,75 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+	start = ktime_get();
+
+	/*
+	 * A higher oom_adj always wins over a bigger task, so the first
+	 * bucket with a live candidate holds the victim.
+	 */
+	spin_lock(&lowmem_buckets_lock);
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		list_for_each_entry(p, lowmem_bucket(adj), lowmem_node) {
+			struct mm_struct *mm;
+
+			scanned++;
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
+	if (selected)
+		get_task_struct(selected);
+	spin_unlock(&lowmem_buckets_lock);
+
+	elapsed = ktime_sub(ktime_get(), start);
+	trace_lowmem_select(min_adj, scanned, selected ? selected->pid : 0,
+			    ktime_to_ns(elapsed));
+	lowmem_selections++;
+	if (ktime_to_us(elapsed) > lowmem_select_max_us)
+		lowmem_select_max_us = ktime_to_us(elapsed);
+	if (scanned > lowmem_scanned_max)
+		lowmem_scanned_max = scanned;
 
 	if (selected) {
+		/* Keeps selected from being released under force_sig() */
+		read_lock(&tasklist_lock);
 		spin_lock_irqsave(&lowmem_deathpending_lock, flags);
-		if (!lowmem_deathpending) {
+		if (!lowmem_deathpending && pid_alive(selected)) {
 			lowmem_print(1,
 				"send sigkill to %d (%s), adj %d, size %d\n",
 				selected->pid, selected->comm,
 				selected_oom_adj, selected_tasksize);
+			trace_lowmem_kill(selected, selected_oom_adj,
+					  selected_tasksize, min_adj, minfree,
+					  other_free, other_file);
 			lowmem_deathpending = selected;
 			task_free_register(&task_nb);
 			force_sig(SIGKILL, selected);
 			rem -= selected_tasksize;
 		}
 		spin_unlock_irqrestore(&lowmem_deathpending_lock, flags);
+		read_unlock(&tasklist_lock);
+		put_task_struct(selected);
 	}
 	else
 		rem = -1;
 
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -212,12 +526,41 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	spin_lock(&lowmem_buckets_lock);
+	for (i = 0; i < LOWMEM_NR_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+	lowmem_buckets_ready = 1;
+	spin_unlock(&lowmem_buckets_lock);
+
+	/*
+	 * From here on fork and exit keep the buckets current; pick up
+	 * whatever is already running. pid_alive() under the bucket lock
+	 * filters out tasks that release_task() has already been past.
+	 */
+	rcu_read_lock();
+	for_each_process(p) {
+		spin_lock(&lowmem_buckets_lock);
+		if (pid_alive(p) && list_empty(&p->lowmem_node))
+			list_add_tail(&p->lowmem_node,
+				      lowmem_bucket(p->signal->oom_adj));
+		spin_unlock(&lowmem_buckets_lock);
+	}
+	rcu_read_unlock();
+
 	register_shrinker(&lowmem_shrinker);
+	if (misc_register(&lowmem_pressure_miscdev))
+		pr_err("lowmemorykiller: failed to register %s\n",
+		       lowmem_pressure_miscdev.name);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	misc_deregister(&lowmem_pressure_miscdev);
+	cancel_delayed_work_sync(&lowmem_pressure_work);
 	unregister_shrinker(&lowmem_shrinker);
 }
 
@@ -227,6 +570,10 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(selections, lowmem_selections, uint, S_IRUGO | S_IWUSR);
+module_param_named(select_max_us, lowmem_select_max_us, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(scanned_max, lowmem_scanned_max, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -24,6 +24,7 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/lzo.h>
+#include <linux/math64.h>
 #include <linux/string.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
@@ -260,11 +261,12 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 #if defined(CONFIG_RAMZSWAP_STATS)
 	{
 	struct ramzswap_stats *rs = &rzs->stats;
-	size_t succ_writes, mem_used;
+	size_t succ_writes, mem_used, pool_size, pool_used;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
 
-	mem_used = xv_get_total_size_bytes(rzs->mem_pool)
-			+ (rs->pages_expand << PAGE_SHIFT);
+	pool_size = zs_get_total_size_bytes(rzs->mem_pool);
+	pool_used = zs_get_used_size_bytes(rzs->mem_pool);
+	mem_used = pool_size + (rs->pages_expand << PAGE_SHIFT);
 	succ_writes = stat64_read(rzs, &rs->num_writes) -
 			stat64_read(rzs, &rs->failed_writes);
 
@@ -291,6 +293,8 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	s->orig_data_size = rs->pages_stored << PAGE_SHIFT;
 	s->compr_data_size = rs->compr_size;
 	s->mem_used_total = mem_used;
+	s->mem_frag_pct = pool_size ?
+		div_u64((u64)(pool_size - pool_used) * 100, pool_size) : 0;
 
 	s->bdev_num_reads = stat64_read(rzs, &rs->bdev_num_reads);
 	s->bdev_num_writes = stat64_read(rzs, &rs->bdev_num_writes);
@@ -618,10 +622,9 @@ static u32 map_backing_swap_page(struct ramzswap *rzs, u32 pagenum)
 static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
 	u32 clen;
-	void *obj;
 
 	struct page *page = rzs->table[index].page;
-	u32 offset = rzs->table[index].offset;
+	unsigned long handle = rzs->table[index].handle;
 
 	if (unlikely(!page)) {
 		/*
@@ -643,11 +646,10 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	clen = zs_get_object_size(rzs->mem_pool, handle) -
+			sizeof(struct zobj_header);
 
-	xv_free(rzs->mem_pool, page, offset);
+	zs_free(rzs->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		stat_dec(&rzs->stats.good_compress);
 
@@ -655,8 +657,7 @@ out:
 	rzs->stats.compr_size -= clen;
 	stat_dec(&rzs->stats.pages_stored);
 
-	rzs->table[index].page = NULL;
-	rzs->table[index].offset = 0;
+	rzs->table[index].handle = 0;
 }
 
 static int handle_zero_page(struct bio *bio)
@@ -685,8 +686,7 @@ static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = kmap_atomic(rzs->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -750,6 +750,7 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	int ret;
 	u32 index;
 	size_t clen;
+	unsigned long handle;
 	struct page *page;
 	struct zobj_header *zheader;
 	unsigned char *user_mem, *cmem;
@@ -773,16 +774,16 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	user_mem = kmap_atomic(page, KM_USER0);
 	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	handle = rzs->table[index].handle;
+	cmem = zs_map_object(rzs->mem_pool, handle, ZS_MM_RO);
 
 	ret = lzo1x_decompress_safe(
 		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
+		zs_get_object_size(rzs->mem_pool, handle) - sizeof(*zheader),
 		user_mem, &clen);
 
+	zs_unmap_object(rzs->mem_pool, handle);
 	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
 
 	/* should NEVER happen */
 	if (unlikely(ret != LZO_E_OK)) {
@@ -806,8 +807,9 @@ out:
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret, fwd_write_request = 0;
-	u32 offset, index;
+	u32 index;
 	size_t clen;
+	unsigned long handle;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
 	unsigned char *user_mem, *cmem, *src;
@@ -886,17 +888,21 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 			goto out;
 		}
 
-		offset = 0;
 		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
 		stat_inc(&rzs->stats.pages_expand);
 		rzs->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+
+		user_mem = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, user_mem, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+		goto update_stats;
 	}
 
-	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
-			&rzs->table[index].page, &offset,
-			GFP_NOIO | __GFP_HIGHMEM)) {
+	handle = zs_malloc(rzs->mem_pool, clen + sizeof(*zheader),
+			GFP_NOIO | __GFP_HIGHMEM);
+	if (!handle) {
 		mutex_unlock(&rzs->lock);
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
@@ -906,28 +912,22 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		goto out;
 	}
 
-memstore:
-	rzs->table[index].offset = offset;
+	rzs->table[index].handle = handle;
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = zs_map_object(rzs->mem_pool, handle, ZS_MM_WO);
 
 #if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
+	zheader = (struct zobj_header *)cmem;
+	zheader->table_idx = index;
+	cmem += sizeof(*zheader);
 #endif
 
 	memcpy(cmem, src, clen);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	zs_unmap_object(rzs->mem_pool, handle);
 
-	/* Update stats */
+update_stats:
 	rzs->stats.compr_size += clen;
 	stat_inc(&rzs->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
@@ -1047,19 +1047,17 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 
 	/* Free all pages that are still in this ramzswap device */
 	for (index = 0; index < num_pages; index++) {
-		struct page *page;
-		u16 offset;
+		unsigned long handle;
 
-		page = rzs->table[index].page;
-		offset = rzs->table[index].offset;
+		handle = rzs->table[index].handle;
 
-		if (!page)
+		if (!handle)
 			continue;
 
 		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page(rzs->table[index].page);
 		else
-			xv_free(rzs->mem_pool, page, offset);
+			zs_free(rzs->mem_pool, handle);
 	}
 
 	entries_per_page = PAGE_SIZE / sizeof(*rzs->table);
@@ -1078,7 +1076,8 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 	vfree(rzs->table);
 	rzs->table = NULL;
 
-	xv_destroy_pool(rzs->mem_pool);
+	if (rzs->mem_pool)
+		zs_destroy_pool(rzs->mem_pool);
 	rzs->mem_pool = NULL;
 
 	/* Free all swap extent pages */
@@ -1187,7 +1186,7 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 			blk_queue_nonrot(rzs->backing_swap->bd_disk->queue))
 		queue_flag_set_unlocked(QUEUE_FLAG_NONROT, rzs->disk->queue);
 
-	rzs->mem_pool = xv_create_pool();
+	rzs->mem_pool = zs_create_pool();
 	if (!rzs->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
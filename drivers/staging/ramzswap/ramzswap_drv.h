@@ -19,7 +19,7 @@
 #include <linux/mutex.h>
 
 #include "ramzswap_ioctl.h"
-#include "sub-projects/allocators/xvmalloc-kmod/xvmalloc.h"
+#include "sub-projects/allocators/zsmalloc-kmod/zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -63,8 +63,8 @@ static const unsigned max_zpage_size_nobdev = PAGE_SIZE / 4 * 3;
 /*
  * NOTE: max_zpage_size_{bdev,nobdev} sizes must be
  * less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * since otherwise xv_malloc would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * since otherwise zs_malloc would always return failure.
  */
 
 /*-- End of configurable params */
@@ -92,8 +92,10 @@ enum rzs_pageflags {
  * These table entries must fit exactly in a page.
  */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		struct page *page;	/* RZS_UNCOMPRESSED */
+		unsigned long handle;	/* compressed object in mem_pool */
+	};
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
@@ -129,7 +131,7 @@ struct ramzswap_stats {
 };
 
 struct ramzswap {
-	struct xv_pool *mem_pool;
+	struct zs_pool *mem_pool;
 	void *compress_workmem;
 	void *compress_buffer;
 	struct table *table;
@@ -38,6 +38,7 @@ struct ramzswap_ioctl_stats {
 	u64 mem_used_total;
 	u64 bdev_num_reads;	/* no. of reads on backing dev */
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
+	u32 mem_frag_pct;	/* % of pool memory not holding data */
 } __attribute__ ((packed, aligned(4)));
 
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
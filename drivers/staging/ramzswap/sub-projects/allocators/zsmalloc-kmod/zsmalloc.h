@@ -0,0 +1,47 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+struct zs_pool;
+
+/*
+ * How a mapped object is going to be used. Objects that straddle a page
+ * boundary are mapped through a bounce buffer, which is filled unless the
+ * mapping is write-only and copied back unless it is read-only.
+ */
+enum zs_mapmode {
+	ZS_MM_RO,
+	ZS_MM_WO,
+	ZS_MM_RW,
+};
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
+
+size_t zs_get_object_size(struct zs_pool *pool, unsigned long handle);
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+u64 zs_get_used_size_bytes(struct zs_pool *pool);
+
+unsigned long zs_compact(struct zs_pool *pool);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many pages, not necessarily
+ * contiguous, that is carved into objects of one size class.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* Size classes are separated by ZS_CLASS_DELTA bytes */
+#define ZS_CLASS_DELTA_SHIFT	4
+#define ZS_CLASS_DELTA		(1 << ZS_CLASS_DELTA_SHIFT)
+
+/*
+ * Every object starts with a word that points back to its handle, or
+ * links it into the free list of its zspage. This must be a multiple
+ * of ZS_CLASS_DELTA so that the word never straddles a page.
+ */
+#define ZS_MIN_CLASS_SIZE	32
+#define ZS_MAX_CLASS_SIZE	PAGE_SIZE
+
+/* End of user params */
+
+#define ZS_OBJ_HEADER_SIZE	sizeof(unsigned long)
+
+#define ZS_MAX_ALLOC_SIZE	(ZS_MAX_CLASS_SIZE - ZS_OBJ_HEADER_SIZE)
+
+#define ZS_NR_CLASSES	((ZS_MAX_CLASS_SIZE - ZS_MIN_CLASS_SIZE) \
+				/ ZS_CLASS_DELTA + 1)
+
+/* Free slots have this bit set in their header word */
+#define ZS_OBJ_FREE		1UL
+/* Terminates a zspage free list */
+#define ZS_OBJ_END		0xffff
+
+/* Bit in handle->pin held while the object is mapped */
+#define ZS_HANDLE_PIN		0
+
+/*
+ * What zs_malloc() hands out is the address of one of these. The object
+ * itself can be moved around by compaction; only the handle stays put.
+ */
+struct zs_handle {
+	unsigned long pin;
+	struct zspage *zspage;
+	u16 idx;		/* object index within zspage */
+	u16 size;		/* as requested by the user */
+};
+
+struct zspage {
+	struct list_head list;	/* in class full or partial list */
+	struct size_class *class;
+	u16 inuse;		/* no. of allocated objects */
+	u16 first_free;		/* index of first free object */
+	struct page *pages[0];
+};
+
+struct size_class {
+	spinlock_t lock;
+	u32 size;		/* object size, header included */
+	u16 objs_per_zspage;
+	u16 pages_per_zspage;
+	struct list_head partial;	/* zspages with free objects */
+	struct list_head full;
+
+	/* Stats, updated under lock */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+	unsigned long used_bytes;	/* sum of requested sizes */
+};
+
+/* Per-CPU state of the object currently mapped on that CPU */
+struct zs_map_area {
+	void *vaddr;		/* kmap address, NULL if bounced */
+	char *buf;		/* bounce buffer, ZS_MAX_ALLOC_SIZE */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class classes[ZS_NR_CLASSES];
+	struct kmem_cache *handle_cache;
+	struct zs_map_area __percpu *map_area;
+	char name[32];		/* of handle_cache */
+};
+
+#endif
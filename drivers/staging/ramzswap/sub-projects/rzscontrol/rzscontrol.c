@@ -93,7 +93,8 @@ void show_stats(struct ramzswap_ioctl_stats *s)
 		"PagesUsed:	%8u\n"
 		"OrigDataSize:	%8" PRIu64 " kB\n"
 		"ComprDataSize:	%8" PRIu64 " kB\n"
-		"MemUsedTotal:	%8" PRIu64 " kB\n",
+		"MemUsedTotal:	%8" PRIu64 " kB\n"
+		"MemFragmentation:	%8u %%\n",
 		s->num_reads,
 		s->num_writes,
 		s->failed_reads,
@@ -107,7 +108,8 @@ void show_stats(struct ramzswap_ioctl_stats *s)
 		s->pages_used,
 		K(s->orig_data_size),
 		K(s->compr_data_size),
-		K(s->mem_used_total)
+		K(s->mem_used_total),
+		s->mem_frag_pct
 	);
 
 	if (backing_swap_present) {
@@ -15,6 +15,10 @@
  * so that reclaiming can be done via the kernel's physical-page-oriented
  * "shrinker" interface.
  *
+ * Booting with "zcache=dense" replaces both with "zd", which packs any
+ * number of compressed pages per page frame using zsmalloc, evicts
+ * ephemeral pages in LRU order and compacts under memory pressure.
+ *
  * [1] For a definition of page-accessible memory (aka PAM), see:
  *   http://marc.info/?l=linux-mm&m=127811271605009
  */
@@ -25,11 +29,14 @@
 #include <linux/lzo.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 #include <asm/atomic.h>
 #include "tmem.h"
 
 #include "../ramzswap/sub-projects/allocators/xvmalloc-kmod/xvmalloc.h" /* if built in drivers/staging */
+#include "../ramzswap/sub-projects/allocators/zsmalloc-kmod/zsmalloc.h"
 
 #if (!defined(CONFIG_CLEANCACHE) && !defined(CONFIG_FRONTSWAP))
 #error "zcache is useless without CONFIG_CLEANCACHE or CONFIG_FRONTSWAP"
@@ -596,6 +603,7 @@ static int zbud_show_cumul_chunk_counts(char *buf)
 #define ZVH_SENTINEL  0x43214321
 
 struct zv_hdr {
+	struct list_head lru;	/* see zcache_pers_lru */
 	uint32_t pool_id;
 	struct tmem_oid oid;
 	uint32_t index;
@@ -619,6 +627,7 @@ static struct zv_hdr *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
 	if (unlikely(ret))
 		goto out;
 	zv = kmap_atomic(page, KM_USER0) + offset;
+	INIT_LIST_HEAD(&zv->lru);
 	zv->index = index;
 	zv->oid = *oid;
 	zv->pool_id = pool_id;
@@ -665,6 +674,226 @@ static void zv_decompress(struct page *page, struct zv_hdr *zv)
 	BUG_ON(clen != PAGE_SIZE);
 }
 
+/**********
+ * The "zd" (dense) PAM implementation stores compressed pages, ephemeral
+ * or persistent, in zsmalloc, which packs as many objects into a page
+ * frame as fit instead of at most two. Since zsmalloc may move objects
+ * around when it compacts, the pampd is a small header kept outside of
+ * the pool, holding the zsmalloc handle and the tmem key of the page.
+ *
+ * Ephemeral zds are also on an LRU list. Under memory pressure the
+ * shrinker flushes the oldest of them and then has the pools compacted,
+ * which is what actually returns page frames to the kernel. A zd that
+ * is being evicted is only taken off the LRU; it is freed, like any
+ * other, through tmem_flush_page() and zcache_pampd_free().
+ */
+
+#define ZDH_SENTINEL  0x5a445a44
+
+struct zd_hdr {
+	struct list_head lru;	/* zd_lru or zcache_pers_lru */
+	unsigned long handle;
+	uint32_t pool_id;
+	struct tmem_oid oid;
+	uint32_t index;
+	uint16_t size;
+	DECL_SENTINEL
+};
+
+static int zcache_dense;
+
+static struct zs_pool *zd_eph_pool;
+static struct zs_pool *zd_pers_pool;
+static struct kmem_cache *zcache_zd_cache;
+
+static LIST_HEAD(zd_lru);
+
+/* protects zd_lru and the zd counters */
+static DEFINE_SPINLOCK(zd_lock);
+
+static unsigned long zcache_zd_lru_count;
+static unsigned long zcache_zd_curr_zpages;
+static unsigned long zcache_zd_curr_zbytes;
+static unsigned long zcache_zd_cumul_zpages;
+static unsigned long zcache_zd_evicted_zpages;
+static unsigned long zcache_zd_compacted_pages;
+
+static struct zd_hdr *zd_create(struct zs_pool *zspool, uint32_t pool_id,
+				struct tmem_oid *oid, uint32_t index,
+				void *cdata, unsigned clen)
+{
+	struct zd_hdr *zd;
+	void *to;
+
+	zd = kmem_cache_alloc(zcache_zd_cache, ZCACHE_GFP_MASK);
+	if (unlikely(zd == NULL))
+		goto out;
+	zd->handle = zs_malloc(zspool, clen, ZCACHE_GFP_MASK);
+	if (unlikely(!zd->handle)) {
+		kmem_cache_free(zcache_zd_cache, zd);
+		zd = NULL;
+		goto out;
+	}
+	to = zs_map_object(zspool, zd->handle, ZS_MM_WO);
+	memcpy(to, cdata, clen);
+	zs_unmap_object(zspool, zd->handle);
+
+	zd->pool_id = pool_id;
+	zd->oid = *oid;
+	zd->index = index;
+	zd->size = clen;
+	SET_SENTINEL(zd, ZDH);
+	INIT_LIST_HEAD(&zd->lru);
+
+	spin_lock(&zd_lock);
+	if (zspool == zd_eph_pool) {
+		list_add_tail(&zd->lru, &zd_lru);
+		zcache_zd_lru_count++;
+	}
+	zcache_zd_curr_zpages++;
+	zcache_zd_curr_zbytes += clen;
+	zcache_zd_cumul_zpages++;
+	spin_unlock(&zd_lock);
+out:
+	return zd;
+}
+
+static void zd_free(struct zs_pool *zspool, struct zd_hdr *zd)
+{
+	ASSERT_SENTINEL(zd, ZDH);
+	spin_lock(&zd_lock);
+	if (!list_empty(&zd->lru)) {
+		list_del_init(&zd->lru);
+		zcache_zd_lru_count--;
+	}
+	zcache_zd_curr_zpages--;
+	zcache_zd_curr_zbytes -= zd->size;
+	spin_unlock(&zd_lock);
+	INVERT_SENTINEL(zd, ZDH);
+	zs_free(zspool, zd->handle);
+	kmem_cache_free(zcache_zd_cache, zd);
+}
+
+static void zd_decompress(struct zs_pool *zspool, struct page *page,
+				struct zd_hdr *zd)
+{
+	size_t clen = PAGE_SIZE;
+	char *from_va, *to_va;
+	int ret;
+
+	ASSERT_SENTINEL(zd, ZDH);
+	from_va = zs_map_object(zspool, zd->handle, ZS_MM_RO);
+	to_va = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_decompress_safe(from_va, zd->size, to_va, &clen);
+	kunmap_atomic(to_va, KM_USER0);
+	zs_unmap_object(zspool, zd->handle);
+	BUG_ON(ret != LZO_E_OK);
+	BUG_ON(clen != PAGE_SIZE);
+}
+
+static void zd_compact_fn(struct work_struct *work)
+{
+	unsigned long freed = 0;
+
+	if (zd_eph_pool != NULL)
+		freed += zs_compact(zd_eph_pool);
+	if (zd_pers_pool != NULL)
+		freed += zs_compact(zd_pers_pool);
+	spin_lock_bh(&zd_lock);
+	zcache_zd_compacted_pages += freed;
+	spin_unlock_bh(&zd_lock);
+}
+static DECLARE_WORK(zd_compact_work, zd_compact_fn);
+
+/*
+ * Flush the least recently put ephemeral zds, about nr page frames worth
+ * of compressed data, then compact (which may sleep) from a workqueue.
+ */
+static void zd_evict_pages(int nr)
+{
+	struct zd_hdr *zd;
+	struct tmem_pool *pool;
+	struct tmem_oid oid;
+	uint32_t pool_id, index;
+	unsigned long target = (unsigned long)nr << PAGE_SHIFT;
+	unsigned long evicted = 0;
+
+	if (nr <= 0)
+		return;
+	while (evicted < target) {
+		spin_lock_bh(&zd_lock);
+		if (list_empty(&zd_lru)) {
+			spin_unlock_bh(&zd_lock);
+			break;
+		}
+		zd = list_first_entry(&zd_lru, struct zd_hdr, lru);
+		list_del_init(&zd->lru);
+		zcache_zd_lru_count--;
+		zcache_zd_evicted_zpages++;
+		pool_id = zd->pool_id;
+		oid = zd->oid;
+		index = zd->index;
+		evicted += zd->size;
+		/* zd may be freed by someone else as soon as this drops */
+		spin_unlock(&zd_lock);
+		pool = zcache_get_pool_by_id(pool_id);
+		if (pool != NULL) {
+			(void)tmem_flush_page(pool, &oid, index);
+			zcache_put_pool(pool);
+		}
+		local_bh_enable();
+	}
+	schedule_work(&zd_compact_work);
+}
+
+/* Page frames the shrinker can hope to get back in dense mode */
+static unsigned long zd_shrinkable_pages(void)
+{
+	unsigned long pages = 0;
+
+	if (zd_eph_pool != NULL)
+		pages += zs_get_total_size_bytes(zd_eph_pool) >> PAGE_SHIFT;
+	if (zd_pers_pool != NULL)
+		pages += (zs_get_total_size_bytes(zd_pers_pool) -
+			  zs_get_used_size_bytes(zd_pers_pool)) >> PAGE_SHIFT;
+	return pages;
+}
+
+#ifdef CONFIG_SYSFS
+static unsigned long zd_raw_pages(void)
+{
+	u64 bytes = 0;
+
+	if (zd_eph_pool != NULL)
+		bytes += zs_get_total_size_bytes(zd_eph_pool);
+	if (zd_pers_pool != NULL)
+		bytes += zs_get_total_size_bytes(zd_pers_pool);
+	return bytes >> PAGE_SHIFT;
+}
+
+static int zd_show_raw_pages(char *buf)
+{
+	return sprintf(buf, "%lu\n", zd_raw_pages());
+}
+
+/* Compressed pages stored per 100 page frames used */
+static int zd_show_density(char *buf)
+{
+	unsigned long raw = zd_raw_pages();
+
+	return sprintf(buf, "%lu\n",
+		raw == 0 ? 0 : zcache_zd_curr_zpages * 100 / raw);
+}
+
+static int zbud_show_density(char *buf)
+{
+	int raw = atomic_read(&zcache_zbud_curr_raw_pages);
+
+	return sprintf(buf, "%d\n", raw == 0 ? 0 :
+		atomic_read(&zcache_zbud_curr_zpages) * 100 / raw);
+}
+#endif
+
 /*
  * zcache core code starts here
  */
@@ -676,6 +905,9 @@ static unsigned long zcache_flobj_total;
 static unsigned long zcache_flobj_found;
 static unsigned long zcache_failed_eph_puts;
 static unsigned long zcache_failed_pers_puts;
+static unsigned long zcache_writeback_pages;
+static unsigned long zcache_writeback_failed;
+static unsigned long zcache_writeback_kbps;
 
 #define MAX_POOLS_PER_CLIENT 16
 
@@ -897,6 +1129,46 @@ static unsigned long zcache_curr_eph_pampd_count_max;
 static atomic_t zcache_curr_pers_pampd_count = ATOMIC_INIT(0);
 static unsigned long zcache_curr_pers_pampd_count_max;
 
+/*
+ * Persistent pages, zv or zd, in put order, so that the oldest can be
+ * written back to the swap device when the persistent pool fills up.
+ */
+static LIST_HEAD(zcache_pers_lru);
+static DEFINE_SPINLOCK(zcache_pers_lru_lock);
+
+/*
+ * FIXME: This is all the "policy" there is for now.
+ * 3/4 totpages should allow ~37% of RAM to be filled with
+ * compressed frontswap pages. Writeback to the swap device starts
+ * at 7/8 of that and goes on until the pool is down to 3/4 of it.
+ */
+static inline unsigned long zcache_pers_limit(void)
+{
+	return 3 * totalram_pages / 4;
+}
+
+static inline unsigned long zcache_pers_wb_start(void)
+{
+	return zcache_pers_limit() - zcache_pers_limit() / 8;
+}
+
+static inline unsigned long zcache_pers_wb_stop(void)
+{
+	return zcache_pers_limit() - zcache_pers_limit() / 4;
+}
+
+static struct list_head *zcache_pers_lru_node(void *pampd)
+{
+	if (zcache_dense)
+		return &((struct zd_hdr *)pampd)->lru;
+	return &((struct zv_hdr *)pampd)->lru;
+}
+
+#ifdef CONFIG_FRONTSWAP
+static void zcache_writeback_fn(struct work_struct *work);
+static DECLARE_WORK(zcache_writeback_work, zcache_writeback_fn);
+#endif
+
 /* forward reference */
 static int zcache_compress(struct page *from, void **out_va, size_t *out_len);
 
@@ -907,32 +1179,40 @@ static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
 	size_t clen;
 	int ret;
 	bool ephemeral = is_ephemeral(pool);
-	unsigned long count;
+	unsigned long count, flags;
 
 	if (ephemeral) {
 		ret = zcache_compress(page, &cdata, &clen);
 		if (ret == 0)
 
 			goto out;
-		if (clen == 0 || clen > zbud_max_buddy_size()) {
-			zcache_compress_poor++;
-			goto out;
-		}
-		pampd = (void *)zbud_create(pool->pool_id, oid, index,
+		if (zcache_dense) {
+			if (clen == 0 || clen > zv_max_page_size) {
+				zcache_compress_poor++;
+				goto out;
+			}
+			pampd = (void *)zd_create(zd_eph_pool, pool->pool_id,
+						oid, index, cdata, clen);
+		} else {
+			if (clen == 0 || clen > zbud_max_buddy_size()) {
+				zcache_compress_poor++;
+				goto out;
+			}
+			pampd = (void *)zbud_create(pool->pool_id, oid, index,
 						page, cdata, clen);
+		}
 		if (pampd != NULL) {
 			count = atomic_inc_return(&zcache_curr_eph_pampd_count);
 			if (count > zcache_curr_eph_pampd_count_max)
 				zcache_curr_eph_pampd_count_max = count;
 		}
 	} else {
-		/*
-		 * FIXME: This is all the "policy" there is for now.
-		 * 3/4 totpages should allow ~37% of RAM to be filled with
-		 * compressed frontswap pages
-		 */
-		if (atomic_read(&zcache_curr_pers_pampd_count) >
-							3 * totalram_pages / 4)
+		count = atomic_read(&zcache_curr_pers_pampd_count);
+#ifdef CONFIG_FRONTSWAP
+		if (count > zcache_pers_wb_start())
+			schedule_work(&zcache_writeback_work);
+#endif
+		if (count > zcache_pers_limit())
 			goto out;
 		ret = zcache_compress(page, &cdata, &clen);
 		if (ret == 0)
@@ -941,10 +1221,18 @@ static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
 			zcache_compress_poor++;
 			goto out;
 		}
-		pampd = (void *)zv_create(zcache_client.xvpool, pool->pool_id,
+		if (zcache_dense)
+			pampd = (void *)zd_create(zd_pers_pool, pool->pool_id,
 						oid, index, cdata, clen);
+		else
+			pampd = (void *)zv_create(zcache_client.xvpool,
+						pool->pool_id, oid, index,
+						cdata, clen);
 		if (pampd == NULL)
 			goto out;
+		spin_lock_irqsave(&zcache_pers_lru_lock, flags);
+		list_add_tail(zcache_pers_lru_node(pampd), &zcache_pers_lru);
+		spin_unlock_irqrestore(&zcache_pers_lru_lock, flags);
 		count = atomic_inc_return(&zcache_curr_pers_pampd_count);
 		if (count > zcache_curr_pers_pampd_count_max)
 			zcache_curr_pers_pampd_count_max = count;
@@ -962,7 +1250,10 @@ static int zcache_pampd_get_data(struct page *page, void *pampd,
 {
 	int ret = 0;
 
-	if (is_ephemeral(pool))
+	if (zcache_dense)
+		zd_decompress(is_ephemeral(pool) ? zd_eph_pool : zd_pers_pool,
+				page, pampd);
+	else if (is_ephemeral(pool))
 		ret = zbud_decompress(page, pampd);
 	else
 		zv_decompress(page, pampd);
@@ -975,12 +1266,23 @@ static int zcache_pampd_get_data(struct page *page, void *pampd,
  */
 static void zcache_pampd_free(void *pampd, struct tmem_pool *pool)
 {
+	unsigned long flags;
+
 	if (is_ephemeral(pool)) {
-		zbud_free_and_delist((struct zbud_hdr *)pampd);
+		if (zcache_dense)
+			zd_free(zd_eph_pool, (struct zd_hdr *)pampd);
+		else
+			zbud_free_and_delist((struct zbud_hdr *)pampd);
 		atomic_dec(&zcache_curr_eph_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_eph_pampd_count) < 0);
 	} else {
-		zv_free(zcache_client.xvpool, (struct zv_hdr *)pampd);
+		spin_lock_irqsave(&zcache_pers_lru_lock, flags);
+		list_del_init(zcache_pers_lru_node(pampd));
+		spin_unlock_irqrestore(&zcache_pers_lru_lock, flags);
+		if (zcache_dense)
+			zd_free(zd_pers_pool, (struct zd_hdr *)pampd);
+		else
+			zv_free(zcache_client.xvpool, (struct zv_hdr *)pampd);
 		atomic_dec(&zcache_curr_pers_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_pers_pampd_count) < 0);
 	}
@@ -1107,6 +1409,9 @@ ZCACHE_SYSFS_RO(flobj_total);
 ZCACHE_SYSFS_RO(flobj_found);
 ZCACHE_SYSFS_RO(failed_eph_puts);
 ZCACHE_SYSFS_RO(failed_pers_puts);
+ZCACHE_SYSFS_RO(writeback_pages);
+ZCACHE_SYSFS_RO(writeback_failed);
+ZCACHE_SYSFS_RO(writeback_kbps);
 ZCACHE_SYSFS_RO(zbud_curr_zbytes);
 ZCACHE_SYSFS_RO(zbud_cumul_zpages);
 ZCACHE_SYSFS_RO(zbud_cumul_zbytes);
@@ -1129,6 +1434,15 @@ ZCACHE_SYSFS_RO_CUSTOM(zbud_unbuddied_list_counts,
 			zbud_show_unbuddied_list_counts);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_cumul_chunk_counts,
 			zbud_show_cumul_chunk_counts);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_density, zbud_show_density);
+ZCACHE_SYSFS_RO(zd_lru_count);
+ZCACHE_SYSFS_RO(zd_curr_zpages);
+ZCACHE_SYSFS_RO(zd_curr_zbytes);
+ZCACHE_SYSFS_RO(zd_cumul_zpages);
+ZCACHE_SYSFS_RO(zd_evicted_zpages);
+ZCACHE_SYSFS_RO(zd_compacted_pages);
+ZCACHE_SYSFS_RO_CUSTOM(zd_curr_raw_pages, zd_show_raw_pages);
+ZCACHE_SYSFS_RO_CUSTOM(zd_density, zd_show_density);
 
 static struct attribute *zcache_attrs[] = {
 	&zcache_curr_obj_count_attr.attr,
@@ -1141,6 +1455,9 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_flobj_found_attr.attr,
 	&zcache_failed_eph_puts_attr.attr,
 	&zcache_failed_pers_puts_attr.attr,
+	&zcache_writeback_pages_attr.attr,
+	&zcache_writeback_failed_attr.attr,
+	&zcache_writeback_kbps_attr.attr,
 	&zcache_compress_poor_attr.attr,
 	&zcache_zbud_curr_raw_pages_attr.attr,
 	&zcache_zbud_curr_zpages_attr.attr,
@@ -1159,6 +1476,15 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_aborted_shrink_attr.attr,
 	&zcache_zbud_unbuddied_list_counts_attr.attr,
 	&zcache_zbud_cumul_chunk_counts_attr.attr,
+	&zcache_zbud_density_attr.attr,
+	&zcache_zd_lru_count_attr.attr,
+	&zcache_zd_curr_zpages_attr.attr,
+	&zcache_zd_curr_zbytes_attr.attr,
+	&zcache_zd_cumul_zpages_attr.attr,
+	&zcache_zd_evicted_zpages_attr.attr,
+	&zcache_zd_compacted_pages_attr.attr,
+	&zcache_zd_curr_raw_pages_attr.attr,
+	&zcache_zd_density_attr.attr,
 	NULL,
 };
 
@@ -1178,7 +1504,8 @@ static struct attribute_group zcache_attr_group = {
 static bool zcache_freeze;
 
 /*
- * zcache shrinker interface (only useful for ephemeral pages, so zbud only)
+ * zcache shrinker interface (only useful for ephemeral pages, so zbud only,
+ * unless in dense mode where persistent pages can still be compacted)
  */
 static int shrink_zcache_memory(struct shrinker *shrink, int nr, gfp_t gfp_mask)
 {
@@ -1189,12 +1516,18 @@ static int shrink_zcache_memory(struct shrinker *shrink, int nr, gfp_t gfp_mask)
 			/* does this case really need to be skipped? */
 			goto out;
 		if (spin_trylock(&zcache_direct_reclaim_lock)) {
-			zbud_evict_pages(nr);
+			if (zcache_dense)
+				zd_evict_pages(nr);
+			else
+				zbud_evict_pages(nr);
 			spin_unlock(&zcache_direct_reclaim_lock);
 		} else
 			zcache_aborted_shrink++;
 	}
-	ret = (int)atomic_read(&zcache_zbud_curr_raw_pages);
+	if (zcache_dense)
+		ret = (int)zd_shrinkable_pages();
+	else
+		ret = (int)atomic_read(&zcache_zbud_curr_raw_pages);
 out:
 	return ret;
 }
@@ -1467,6 +1800,86 @@ static inline struct tmem_oid oswiz(unsigned type, u32 ind)
 	return oid;
 }
 
+/*
+ * Find the swap slot of the oldest persistent page, and rotate it to the
+ * tail so that a page that cannot be written back now is not retried
+ * right away.
+ */
+static bool zcache_pers_lru_oldest(unsigned *type, pgoff_t *offset)
+{
+	struct list_head *node;
+	struct tmem_oid *oid;
+	uint32_t index;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_pers_lru_lock, flags);
+	if (list_empty(&zcache_pers_lru)) {
+		spin_unlock_irqrestore(&zcache_pers_lru_lock, flags);
+		return false;
+	}
+	node = zcache_pers_lru.next;
+	if (zcache_dense) {
+		struct zd_hdr *zd = list_entry(node, struct zd_hdr, lru);
+
+		oid = &zd->oid;
+		index = zd->index;
+	} else {
+		struct zv_hdr *zv = list_entry(node, struct zv_hdr, lru);
+
+		oid = &zv->oid;
+		index = zv->index;
+	}
+	*type = oid->oid[0] >> SWIZ_BITS;
+	*offset = ((pgoff_t)index << SWIZ_BITS) | (oid->oid[0] & SWIZ_MASK);
+	list_move_tail(node, &zcache_pers_lru);
+	spin_unlock_irqrestore(&zcache_pers_lru_lock, flags);
+	return true;
+}
+
+#define ZCACHE_WB_BATCH		32
+
+/*
+ * Write the oldest persistent pages back to the swap device, in batches
+ * of bios started together, until the pool is back under the stop mark.
+ * The I/O is not waited for: the pages are freed from zcache as soon as
+ * their bios are queued, so new puts can succeed while old pages drain.
+ */
+static void zcache_writeback_fn(struct work_struct *work)
+{
+	unsigned long start = jiffies, done = 0, elapsed;
+	DECLARE_BITMAP(types, MAX_SWAPFILES);
+	unsigned type;
+	pgoff_t offset;
+	int i, n;
+
+	while (atomic_read(&zcache_curr_pers_pampd_count) >
+						zcache_pers_wb_stop()) {
+		bitmap_zero(types, MAX_SWAPFILES);
+		for (i = 0, n = 0; i < ZCACHE_WB_BATCH; i++) {
+			if (!zcache_pers_lru_oldest(&type, &offset))
+				break;
+			if (frontswap_writeback_page(type, offset) == 0) {
+				__set_bit(type, types);
+				n++;
+			} else
+				zcache_writeback_failed++;
+		}
+		for_each_set_bit(type, types, MAX_SWAPFILES)
+			frontswap_writeback_flush(type);
+		done += n;
+		if (n == 0)
+			break;
+		cond_resched();
+	}
+
+	if (done) {
+		elapsed = jiffies - start;
+		zcache_writeback_pages += done;
+		zcache_writeback_kbps = done * (PAGE_SIZE >> 10) * HZ /
+					(elapsed ? elapsed : 1);
+	}
+}
+
 static int zcache_frontswap_put_page(unsigned type, pgoff_t offset,
 				   struct page *page)
 {
@@ -1562,6 +1975,8 @@ static int zcache_enabled;
 static int __init enable_zcache(char *s)
 {
 	zcache_enabled = 1;
+	if (!strcmp(s, "=dense"))
+		zcache_dense = 1;
 	return 1;
 }
 __setup("zcache", enable_zcache);
@@ -1620,16 +2035,32 @@ static int __init zcache_init(void)
 				sizeof(struct tmem_objnode), 0, 0, NULL);
 	zcache_obj_cache = kmem_cache_create("zcache_obj",
 				sizeof(struct tmem_obj), 0, 0, NULL);
+	if (zcache_enabled && zcache_dense) {
+		zcache_zd_cache = kmem_cache_create("zcache_zd",
+				sizeof(struct zd_hdr), 0, 0, NULL);
+		if (zcache_zd_cache == NULL) {
+			pr_err("zcache: can't create zd cache\n");
+			goto out;
+		}
+	}
 #endif
 #ifdef CONFIG_CLEANCACHE
 	if (zcache_enabled && use_cleancache) {
 		struct cleancache_ops old_ops;
 
-		zbud_init();
+		if (zcache_dense) {
+			zd_eph_pool = zs_create_pool();
+			if (zd_eph_pool == NULL) {
+				pr_err("zcache: can't create zspool\n");
+				goto out;
+			}
+		} else
+			zbud_init();
 		register_shrinker(&zcache_shrinker);
 		old_ops = zcache_cleancache_register_ops();
 		pr_info("zcache: cleancache enabled using kernel "
-			"transcendent memory and compression buddies\n");
+			"transcendent memory and %s\n", zcache_dense ?
+			"zsmalloc" : "compression buddies");
 		if (old_ops.init_fs != NULL)
 			pr_warning("zcache: cleancache_ops overridden");
 	}
@@ -1638,14 +2069,26 @@ static int __init zcache_init(void)
 	if (zcache_enabled && use_frontswap) {
 		struct frontswap_ops old_ops;
 
-		zcache_client.xvpool = xv_create_pool();
-		if (zcache_client.xvpool == NULL) {
-			pr_err("zcache: can't create xvpool\n");
-			goto out;
+		if (zcache_dense) {
+			zd_pers_pool = zs_create_pool();
+			if (zd_pers_pool == NULL) {
+				pr_err("zcache: can't create zspool\n");
+				goto out;
+			}
+			/* so persistent pages get compacted under pressure */
+			if (zd_eph_pool == NULL)
+				register_shrinker(&zcache_shrinker);
+		} else {
+			zcache_client.xvpool = xv_create_pool();
+			if (zcache_client.xvpool == NULL) {
+				pr_err("zcache: can't create xvpool\n");
+				goto out;
+			}
 		}
 		old_ops = zcache_frontswap_register_ops();
 		pr_info("zcache: frontswap enabled using kernel "
-			"transcendent memory and xvmalloc\n");
+			"transcendent memory and %s\n", zcache_dense ?
+			"zsmalloc" : "xvmalloc");
 		if (old_ops.init != NULL)
 			pr_warning("ktmem: frontswap_ops overridden");
 	}
@@ -860,6 +860,7 @@ static int de_thread(struct task_struct *tsk)
 		leader->exit_state = EXIT_DEAD;
 		write_unlock_irq(&tasklist_lock);
 
+		lowmem_task_replace(leader, tsk);
 		release_task(leader);
 	}
 
@@ -51,6 +51,9 @@ extern const char *yaffs_guts_c_version;
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/ktime.h>
 
 #include "asm/div64.h"
 
@@ -121,16 +124,40 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
+/* With yaffs_auto_checkpoint 1, also checkpoint from write_super at most
+ * this often (seconds, 0 to disable). A crash after a quiet spell then
+ * mounts from the checkpoint instead of a full scan.
+ */
+unsigned int yaffs_checkpoint_interval = 120;
+/* Run garbage collection from a per-device thread instead of stalling
+ * writers with it. Takes effect at mount.
+ */
+unsigned int yaffs_bg_gc = 1;
+/* Size of the per-device read cache (MB, 0 to disable) and how many chunks
+ * to read ahead into it on sequential reads. Take effect at mount. Off by
+ * default: the page cache already holds what ->readpage read, so the cache
+ * only pays off for direct chunk readers on a device with memory to spare.
+ */
+unsigned int yaffs_read_cache_mb;
+unsigned int yaffs_read_ahead = 4;
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_checkpoint_interval, uint, 0644);
+module_param(yaffs_bg_gc, uint, 0644);
+module_param(yaffs_read_cache_mb, uint, 0644);
+module_param(yaffs_read_ahead, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
+MODULE_PARM(yaffs_checkpoint_interval, "i");
+MODULE_PARM(yaffs_bg_gc, "i");
+MODULE_PARM(yaffs_read_cache_mb, "i");
+MODULE_PARM(yaffs_read_ahead, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -372,14 +399,72 @@ static const struct super_operations yaffs_super_ops = {
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs locking %p\n", current));
-	down(&dev->grossLock);
+	if (!down_write_trylock(&dev->grossLock)) {
+		down_write(&dev->grossLock);
+		dev->grossWriteWaits++;
+	}
+	dev->grossWriteLocks++;
 	T(YAFFS_TRACE_OS, ("yaffs locked %p\n", current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs unlocking %p\n", current));
-	up(&dev->grossLock);
+	up_write(&dev->grossLock);
+}
+
+/*
+ * Writes, deletes, truncates and renames all leave garbage behind: get an
+ * idle background collector looking again. Caller holds the gross lock.
+ */
+static void yaffs_WakeBackgroundGC(yaffs_Device *dev)
+{
+	if (dev->bgThread && dev->bgIdle) {
+		dev->bgIdle = 0;
+		wake_up_process(dev->bgThread);
+	}
+}
+
+/*
+ * Adds a write that started at 'start', including its wait for the gross
+ * lock, to the latency histogram. Caller holds the gross lock.
+ */
+static void yaffs_AccountWrite(yaffs_Device *dev, ktime_t start)
+{
+	s64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+	int i = us > 0 ? fls64(us) : 0;
+
+	if (i >= YAFFS_WRITE_HIST_BUCKETS)
+		i = YAFFS_WRITE_HIST_BUCKETS - 1;
+	dev->writeHist[i]++;
+}
+
+/*
+ * Operations that only look at the file system (lookup, readdir, readpage,
+ * readlink, statfs) share the gross lock, so a read of one file doesn't
+ * queue up behind a read of another. The guts state they still update
+ * (chunk cache, lazy loading, NAND access, temp buffers) has its own
+ * locks underneath.
+ */
+static void yaffs_GrossReadLock(yaffs_Device *dev)
+{
+	unsigned long start;
+
+	T(YAFFS_TRACE_OS, ("yaffs read locking %p\n", current));
+	if (!down_read_trylock(&dev->grossLock)) {
+		start = jiffies;
+		down_read(&dev->grossLock);
+		atomic_inc(&dev->grossReadWaits);
+		atomic_add(jiffies - start, &dev->grossReadWaitJiffies);
+	}
+	atomic_inc(&dev->grossReadLocks);
+	T(YAFFS_TRACE_OS, ("yaffs read locked %p\n", current));
+}
+
+static void yaffs_GrossReadUnlock(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_OS, ("yaffs read unlocking %p\n", current));
+	up_read(&dev->grossLock);
 }
 
 
@@ -399,7 +484,8 @@ static void yaffs_GrossUnlock(yaffs_Device *dev)
  *
  * A seach context lives for the duration of a readdir.
  *
- * All these functions must be called while yaffs is locked.
+ * All these functions must be called while yaffs is locked. readdir only
+ * holds it shared, so the context list itself is under searchLock.
  */
 
 struct yaffs_SearchContext {
@@ -429,7 +515,9 @@ static struct yaffs_SearchContext * yaffs_NewSearch(yaffs_Object *dir)
                                 dir->variant.directoryVariant.children.next,
 				yaffs_Object,siblings);
 		YINIT_LIST_HEAD(&sc->others);
+		spin_lock(&dev->searchLock);
 		ylist_add(&sc->others,&dev->searchContexts);
+		spin_unlock(&dev->searchLock);
 	}
 	return sc;
 }
@@ -440,7 +528,9 @@ static struct yaffs_SearchContext * yaffs_NewSearch(yaffs_Object *dir)
 static void yaffs_EndSearch(struct yaffs_SearchContext * sc)
 {
 	if(sc){
+		spin_lock(&sc->dev->searchLock);
 		ylist_del(&sc->others);
+		spin_unlock(&sc->dev->searchLock);
 		YFREE(sc);
 	}
 }
@@ -485,6 +575,7 @@ static void yaffs_RemoveObjectCallback(yaffs_Object *obj)
          * If any are currently on the object being removed, then advance
          * the search context to the next object to prevent a hanging pointer.
          */
+	spin_lock(&obj->myDev->searchLock);
          ylist_for_each(i, search_contexts) {
                 if (i) {
                         sc = ylist_entry(i, struct yaffs_SearchContext,others);
@@ -492,6 +583,7 @@ static void yaffs_RemoveObjectCallback(yaffs_Object *obj)
                                 yaffs_SearchAdvance(sc);
                 }
 	}
+	spin_unlock(&obj->myDev->searchLock);
 
 }
 
@@ -506,11 +598,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user *buffer,
 
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -530,11 +622,11 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	int ret;
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	if (!alias) {
 		ret = -ENOMEM;
@@ -570,7 +662,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_lookup for %d:%s\n",
@@ -582,7 +674,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -660,6 +752,7 @@ static void yaffs_clear_inode(struct inode *inode)
 		 */
 
 		yaffs_HandleDeferedFree(obj);
+		yaffs_WakeBackgroundGC(dev);
 
 		yaffs_GrossUnlock(dev);
 	}
@@ -685,6 +778,7 @@ static void yaffs_delete_inode(struct inode *inode)
 		dev = obj->myDev;
 		yaffs_GrossLock(dev);
 		yaffs_DeleteObject(obj);
+		yaffs_WakeBackgroundGC(dev);
 		yaffs_GrossUnlock(dev);
 	}
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 13))
@@ -744,13 +838,13 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	ret = yaffs_ReadDataFromFile(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -1156,6 +1250,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 	int nWritten, ipos;
 	struct inode *inode;
 	yaffs_Device *dev;
+	ktime_t start = ktime_get();
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
@@ -1199,6 +1294,10 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
+
+	yaffs_WakeBackgroundGC(dev);
+	yaffs_AccountWrite(dev, start);
+
 	yaffs_GrossUnlock(dev);
 	return (nWritten == 0) && (n > 0) ? -ENOSPC : nWritten;
 }
@@ -1219,11 +1318,11 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	nFreeChunks = yaffs_GetNumberOfFreeChunks(dev);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	return (nFreeChunks > 20) ? 1 : 0;
 }
@@ -1238,10 +1337,10 @@ static void yaffs_release_space(struct file *f)
 
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 }
 
 static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
@@ -1259,7 +1358,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_DentryToObject(f->f_dentry);
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	offset = f->f_pos;
 
@@ -1275,10 +1374,10 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			("yaffs_readdir: entry . ino %d \n",
 			(int)inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_GrossReadUnlock(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0)
 			goto out;
-		yaffs_GrossLock(dev);
+		yaffs_GrossReadLock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1286,11 +1385,11 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			("yaffs_readdir: entry .. ino %d \n",
 			(int)f->f_dentry->d_parent->d_inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_GrossReadUnlock(dev);
 		if (filldir(dirent, "..", 2, offset,
 			f->f_dentry->d_parent->d_inode->i_ino, DT_DIR) < 0)
 			goto out;
-		yaffs_GrossLock(dev);
+		yaffs_GrossReadLock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1319,7 +1418,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 			  ("yaffs_readdir: %s inode %d\n", name,
 			   yaffs_GetObjectInode(l)));
 
-                        yaffs_GrossUnlock(dev);
+                        yaffs_GrossReadUnlock(dev);
 
 			if (filldir(dirent,
 					name,
@@ -1329,7 +1428,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 					this_type) < 0)
 				goto out;
 
-                        yaffs_GrossLock(dev);
+                        yaffs_GrossReadLock(dev);
 
 			offset++;
 			f->f_pos++;
@@ -1338,7 +1437,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	}
 
 unlock_out:
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 out:
         yaffs_EndSearch(sc);
 
@@ -1482,6 +1581,7 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 	if (retVal == YAFFS_OK) {
 		dentry->d_inode->i_nlink--;
 		dir->i_version++;
+		yaffs_WakeBackgroundGC(dev);
 		yaffs_GrossUnlock(dev);
 		mark_inode_dirty(dentry->d_inode);
 		update_dir_time(dir);
@@ -1626,6 +1726,8 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 				old_dentry->d_name.name,
 				yaffs_InodeToObject(new_dir),
 				new_dentry->d_name.name);
+		if (retVal == YAFFS_OK)
+			yaffs_WakeBackgroundGC(dev);
 	}
 	yaffs_GrossUnlock(dev);
 
@@ -1661,6 +1763,8 @@ static int yaffs_setattr(struct dentry *dentry, struct iattr *attr)
 		if (yaffs_SetAttributes(yaffs_InodeToObject(inode), attr) ==
 				YAFFS_OK) {
 			error = 0;
+			if (attr->ia_valid & ATTR_SIZE)
+				yaffs_WakeBackgroundGC(dev);
 		} else {
 			error = -EPERM;
 		}
@@ -1688,7 +1792,7 @@ static int yaffs_statfs(struct super_block *sb, struct statfs *buf)
 
 	T(YAFFS_TRACE_OS, ("yaffs_statfs\n"));
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	buf->f_type = YAFFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
@@ -1737,10 +1841,94 @@ static int yaffs_statfs(struct super_block *sb, struct statfs *buf)
 	buf->f_ffree = 0;
 	buf->f_bavail = buf->f_bfree;
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
+	return 0;
+}
+
+
+/*
+ * The background GC thread. It does a step of garbage collection at a time
+ * and sleeps for longer the less urgent the collector says things are.
+ * When there is nothing to collect it sleeps until yaffs_WakeBackgroundGC()
+ * wakes it.
+ */
+static int yaffs_BackgroundThread(void *data)
+{
+	struct super_block *sb = data;
+	yaffs_Device *dev = yaffs_SuperToDevice(sb);
+	int urgency;
+	long timeout;
+
+	T(YAFFS_TRACE_GC, ("yaffs background gc thread started\n"));
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		if (try_to_freeze())
+			continue;
+
+		urgency = 0;
+
+		yaffs_GrossLock(dev);
+		if (!(sb->s_flags & MS_RDONLY))
+			urgency = yaffs_BackgroundGarbageCollect(dev);
+		dev->bgIdle = !urgency;
+		yaffs_GrossUnlock(dev);
+
+		if (urgency >= 2)
+			timeout = HZ / 50;
+		else if (urgency)
+			timeout = HZ / 10;
+		else
+			timeout = MAX_SCHEDULE_TIMEOUT;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop() || (!urgency && !dev->bgIdle)) {
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+		schedule_timeout(timeout ? timeout : 1);
+	}
+
+	T(YAFFS_TRACE_GC, ("yaffs background gc thread stopped\n"));
 	return 0;
 }
 
+static void yaffs_StartBackgroundThread(struct super_block *sb)
+{
+	yaffs_Device *dev = yaffs_SuperToDevice(sb);
+	struct task_struct *tsk;
+
+	if (!yaffs_bg_gc)
+		return;
+
+	tsk = kthread_run(yaffs_BackgroundThread, sb, "yaffs-bg-%s",
+			  dev->name);
+	if (IS_ERR(tsk)) {
+		T(YAFFS_TRACE_ALWAYS,
+		  ("yaffs: could not start background gc, %ld\n",
+		   PTR_ERR(tsk)));
+		return;
+	}
+
+	yaffs_GrossLock(dev);
+	dev->bgThread = tsk;
+	dev->backgroundGC = 1;
+	yaffs_GrossUnlock(dev);
+}
+
+static void yaffs_StopBackgroundThread(yaffs_Device *dev)
+{
+	if (!dev->bgThread)
+		return;
+
+	kthread_stop(dev->bgThread);
+
+	yaffs_GrossLock(dev);
+	dev->bgThread = NULL;
+	dev->backgroundGC = 0;
+	yaffs_GrossUnlock(dev);
+}
 
 static int yaffs_do_sync_fs(struct super_block *sb)
 {
@@ -1754,6 +1942,7 @@ static int yaffs_do_sync_fs(struct super_block *sb)
 		if (dev) {
 			yaffs_FlushEntireDeviceCache(dev);
 			yaffs_CheckpointSave(dev);
+			dev->checkpointTime = jiffies;
 		}
 
 		yaffs_GrossUnlock(dev);
@@ -1771,9 +1960,15 @@ static int yaffs_write_super(struct super_block *sb)
 #endif
 {
 
+	yaffs_Device *dev = yaffs_SuperToDevice(sb);
+
 	T(YAFFS_TRACE_OS, ("yaffs_write_super\n"));
 	if (yaffs_auto_checkpoint >= 2)
 		yaffs_do_sync_fs(sb);
+	else if (yaffs_auto_checkpoint >= 1 && yaffs_checkpoint_interval &&
+		 time_after(jiffies, dev->checkpointTime +
+				yaffs_checkpoint_interval * HZ))
+		yaffs_do_sync_fs(sb);
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 18))
 	return 0;
 #endif
@@ -1892,6 +2087,8 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	yaffs_StopBackgroundThread(dev);
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -2009,6 +2206,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	struct mtd_info *mtd;
 	int err;
 	char *data_str = (char *)data;
+	ktime_t start;
 
 	yaffs_options options;
 
@@ -2209,6 +2407,9 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 		    nandmtd2_ReadChunkWithTagsFromNAND;
 		dev->markNANDBlockBad = nandmtd2_MarkNANDBlockBad;
 		dev->queryNANDBlock = nandmtd2_QueryNANDBlock;
+		if (!dev->inbandTags)
+			dev->readBlockTagsFromNAND =
+			    nandmtd2_ReadBlockTagsFromNAND;
 		dev->spareBuffer = YMALLOC(mtd->oobsize);
 		dev->isYaffs2 = 1;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
@@ -2255,6 +2456,12 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	dev->wideTnodesDisabled = 1;
 #endif
 
+	if (!options.no_cache && yaffs_read_cache_mb > 0) {
+		dev->nReadCaches = (yaffs_read_cache_mb << 20) /
+					dev->totalBytesPerChunk;
+		dev->nReadAhead = yaffs_read_ahead;
+	}
+
 	dev->skipCheckpointRead = options.skip_checkpoint_read;
 	dev->skipCheckpointWrite = options.skip_checkpoint_write;
 
@@ -2265,11 +2472,19 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         YINIT_LIST_HEAD(&dev->searchContexts);
         dev->removeObjectCallback = yaffs_RemoveObjectCallback;
 
-	init_MUTEX(&dev->grossLock);
+	init_rwsem(&dev->grossLock);
+	mutex_init(&dev->readLock);
+	mutex_init(&dev->nandLock);
+	spin_lock_init(&dev->tempLock);
+	spin_lock_init(&dev->searchLock);
+	dev->checkpointTime = jiffies;
 
 	yaffs_GrossLock(dev);
 
+	start = ktime_get();
 	err = yaffs_GutsInitialise(dev);
+	dev->mountMs = ktime_to_ms(ktime_sub(ktime_get(), start));
+	dev->mountScanned = !dev->isCheckpointed;
 
 	T(YAFFS_TRACE_OS,
 	  ("yaffs_read_super: guts initialised %s\n",
@@ -2304,6 +2519,8 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
+	yaffs_StartBackgroundThread(sb);
+
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
 }
@@ -2407,6 +2624,8 @@ static struct proc_dir_entry *my_proc_entry;
 
 static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 {
+	int i;
+
 	buf += sprintf(buf, "startBlock......... %d\n", dev->startBlock);
 	buf += sprintf(buf, "endBlock........... %d\n", dev->endBlock);
 	buf += sprintf(buf, "totalBytesPerChunk. %d\n", dev->totalBytesPerChunk);
@@ -2416,6 +2635,10 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "nErasedBlocks...... %d\n", dev->nErasedBlocks);
 	buf += sprintf(buf, "nReservedBlocks.... %d\n", dev->nReservedBlocks);
 	buf += sprintf(buf, "blocksInCheckpoint. %d\n", dev->blocksInCheckpoint);
+	buf += sprintf(buf, "mountMs............ %u\n", dev->mountMs);
+	buf += sprintf(buf, "mountScanned....... %d\n", dev->mountScanned);
+	buf += sprintf(buf, "scanBlockReads..... %d\n", dev->scanBlockReads);
+	buf += sprintf(buf, "scanChunkReads..... %d\n", dev->scanChunkReads);
 	buf += sprintf(buf, "nTnodesCreated..... %d\n", dev->nTnodesCreated);
 	buf += sprintf(buf, "nFreeTnodes........ %d\n", dev->nFreeTnodes);
 	buf += sprintf(buf, "nObjectsCreated.... %d\n", dev->nObjectsCreated);
@@ -2426,8 +2649,18 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "nBlockErasures..... %d\n", dev->nBlockErasures);
 	buf += sprintf(buf, "nGCCopies.......... %d\n", dev->nGCCopies);
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "grossReadLocks..... %d\n",
+		    atomic_read(&dev->grossReadLocks));
+	buf += sprintf(buf, "grossReadWaits..... %d\n",
+		    atomic_read(&dev->grossReadWaits));
+	buf += sprintf(buf, "grossReadWaitMs.... %u\n",
+		    jiffies_to_msecs(atomic_read(&dev->grossReadWaitJiffies)));
+	buf += sprintf(buf, "grossWriteLocks.... %d\n", dev->grossWriteLocks);
+	buf += sprintf(buf, "grossWriteWaits.... %d\n", dev->grossWriteWaits);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -2436,6 +2669,29 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %d\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %d\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %d\n", dev->cacheHits);
+	buf += sprintf(buf, "nReadCaches........ %d\n", dev->nReadCaches);
+	buf += sprintf(buf, "readCacheHits...... %d\n", dev->rdCacheHits);
+	buf += sprintf(buf, "readCacheMisses.... %d\n", dev->rdCacheMisses);
+	buf += sprintf(buf, "readCacheHitRate... %d%%\n",
+		    (dev->rdCacheHits + dev->rdCacheMisses) ?
+		    (int)div_u64(dev->rdCacheHits * 100ULL,
+			dev->rdCacheHits + dev->rdCacheMisses) : 0);
+	buf += sprintf(buf, "readAheads......... %d\n", dev->rdAheadReads);
+	buf += sprintf(buf, "readAheadHits...... %d\n", dev->rdAheadHits);
+	buf += sprintf(buf, "readAheadWasted.... %d\n", dev->rdAheadWasted);
+	/* A hit on a read ahead chunk still cost a NAND read, just earlier,
+	 * and one read ahead for nothing cost a read that saved none.
+	 */
+	buf += sprintf(buf, "nandReadsSaved..... %d\n",
+		    dev->rdCacheHits - dev->rdAheadHits - dev->rdAheadWasted);
+	for (i = 0; i < YAFFS_WRITE_HIST_BUCKETS - 1; i++)
+		if (dev->writeHist[i])
+			buf += sprintf(buf, "writeLatency [%u, %u) us %u\n",
+				    i ? 1U << (i - 1) : 0, 1U << i,
+				    dev->writeHist[i]);
+	if (dev->writeHist[i])
+		buf += sprintf(buf, "writeLatency >= %u us %u\n",
+			    1U << (i - 1), dev->writeHist[i]);
 	buf += sprintf(buf, "nDeletedFiles...... %d\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %d\n", dev->nUnlinkedFiles);
 	buf +=
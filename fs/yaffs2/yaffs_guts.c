@@ -35,6 +35,11 @@ const char *yaffs_guts_c_version =
 
 #define YAFFS_PASSIVE_GC_CHUNKS 2
 
+/* Background GC turns aggressive this many blocks above the point at
+ * which the foreground would have to.
+ */
+#define YAFFS_GC_BACKGROUND_MARGIN 8
+
 #include "yaffs_ecc.h"
 
 
@@ -101,6 +106,8 @@ static int yaffs_CheckFileSanity(yaffs_Object *in);
 
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in);
 static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId);
+static void yaffs_InvalidateReadCache(yaffs_Object *obj, int chunkId);
+static void yaffs_InvalidateWholeReadCache(yaffs_Object *obj);
 
 static void yaffs_InvalidateCheckpoint(yaffs_Device *dev);
 
@@ -213,6 +220,9 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 {
 	int i, j;
 
+	/* Readers sharing the gross lock can get here concurrently */
+	yaffs_LockTemp(dev);
+
 	dev->tempInUse++;
 	if (dev->tempInUse > dev->maxTemp)
 		dev->maxTemp = dev->tempInUse;
@@ -227,10 +237,14 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 					    dev->tempBuffer[j].line;
 			}
 
+			yaffs_UnlockTemp(dev);
 			return dev->tempBuffer[i].buffer;
 		}
 	}
 
+	dev->unmanagedTempAllocations++;
+	yaffs_UnlockTemp(dev);
+
 	T(YAFFS_TRACE_BUFFERS,
 	  (TSTR("Out of temp buffers at line %d, other held by lines:"),
 	   lineNo));
@@ -244,7 +258,6 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 	 * This is not good.
 	 */
 
-	dev->unmanagedTempAllocations++;
 	return YMALLOC(dev->nDataBytesPerChunk);
 
 }
@@ -254,22 +267,29 @@ void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer,
 {
 	int i;
 
+	yaffs_LockTemp(dev);
+
 	dev->tempInUse--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->tempBuffer[i].buffer == buffer) {
 			dev->tempBuffer[i].line = 0;
+			yaffs_UnlockTemp(dev);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanagedTempDeallocations++;
+
+	yaffs_UnlockTemp(dev);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		T(YAFFS_TRACE_BUFFERS,
 		  (TSTR("Releasing unmanaged temp buffer in line %d" TENDSTR),
 		   lineNo));
 		YFREE(buffer);
-		dev->unmanagedTempDeallocations++;
 	}
 
 }
@@ -2003,6 +2023,9 @@ static void yaffs_FreeObject(yaffs_Object *tn)
 	}
 #endif
 
+	if (tn->variantType == YAFFS_OBJECT_TYPE_FILE)
+		yaffs_InvalidateWholeReadCache(tn);
+
 	yaffs_UnhashObject(tn);
 
 #ifdef VALGRIND_TEST
@@ -2560,6 +2583,12 @@ static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 	if (dev->blockInfo && dev->chunkBits) {
 		memset(dev->blockInfo, 0, nBlocks * sizeof(yaffs_BlockInfo));
 		memset(dev->chunkBits, 0, dev->chunkBitmapStride * nBlocks);
+
+		/* Only used to weight GC victims, so not fatal if missing */
+		dev->eraseCounts = YMALLOC(nBlocks * sizeof(__u16));
+		if (dev->eraseCounts)
+			memset(dev->eraseCounts, 0, nBlocks * sizeof(__u16));
+		dev->eraseCountSum = 0;
 		return YAFFS_OK;
 	}
 
@@ -2583,6 +2612,10 @@ static void yaffs_DeinitialiseBlocks(yaffs_Device *dev)
 		YFREE(dev->chunkBits);
 	dev->chunkBitsAlt = 0;
 	dev->chunkBits = NULL;
+
+	if (dev->eraseCounts)
+		YFREE(dev->eraseCounts);
+	dev->eraseCounts = NULL;
 }
 
 static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
@@ -2622,12 +2655,60 @@ static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
 	return (bi->sequenceNumber <= dev->oldestDirtySequence);
 }
 
-/* FindDiretiestBlock is used to select the dirtiest block (or close enough)
- * for garbage collection.
+/* Cost-benefit score of collecting a block: free space won per live chunk
+ * copied, times the block's age. Old blocks are cold: their live data is
+ * unlikely to be overwritten soon, so collecting them isn't wasted work.
+ * Blocks erased less often than average are favoured to spread wear.
+ * The free/live ratio is kept in fixed point so that young blocks are
+ * still ranked against each other rather than all rounding down to 0.
+ * Only used for passive and background collection: when space is short,
+ * the foreground just wants the block that is quickest to reclaim.
+ */
+#define YAFFS_GC_MAX_AGE	0xffff
+#define YAFFS_GC_SCORE_SHIFT	8
+
+static __u32 yaffs_GCScore(yaffs_Device *dev, yaffs_BlockInfo *bi, int block)
+{
+	int inUse = bi->pagesInUse - bi->softDeletions;
+	__u32 age = dev->sequenceNumber - bi->sequenceNumber;
+	__u32 score;
+	__u32 avg;
+	__u32 wear;
+
+	if (age > YAFFS_GC_MAX_AGE)
+		age = YAFFS_GC_MAX_AGE;
+
+	score = ((dev->nChunksPerBlock - inUse) << YAFFS_GC_SCORE_SHIFT) /
+		(inUse + 1);
+
+	if (dev->eraseCounts) {
+		avg = dev->eraseCountSum /
+			(dev->internalEndBlock - dev->internalStartBlock + 1);
+		wear = dev->eraseCounts[block - dev->internalStartBlock];
+
+		/* Scale by (avg + 16) / (wear + 16), clamped to [1/4, 4] */
+		wear = ((avg + 16) << 4) / (wear + 16);
+		if (wear < 4)
+			wear = 4;
+		if (wear > 64)
+			wear = 64;
+		score = (score * wear) >> 4;
+	}
+
+	/* saturate rather than wrap */
+	if (score > 0xffffffffU / (age + 1))
+		return 0xffffffffU;
+
+	return score * (age + 1);
+}
+
+/* FindBlockForGarbageCollection selects the block with the best cost-benefit
+ * score among those dirty enough for the current mode. Aggressive foreground
+ * collection takes the block with the fewest live chunks instead.
  */
 
 static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
-					int aggressive)
+					int aggressive, int background)
 {
 	int b = dev->currentDirtyChecker;
 
@@ -2638,6 +2719,9 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	int prioritised = 0;
 	yaffs_BlockInfo *bi;
 	int pendingPrioritisedExist = 0;
+	__u32 score;
+	__u32 bestScore = 0;
+	int fewestLive = aggressive && !background;
 
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->hasPendingPrioritisedGCs) {
@@ -2666,18 +2750,27 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	 * search harder.
 	 * else (we're doing a leasurely gc), then we only bother to do this if the
 	 * block has only a few pages in use.
+	 * Background GC has time on its hands, so it always looks at every
+	 * block and will take one that is at least half dirty.
 	 */
 
-	dev->nonAggressiveSkip--;
+	if (!background) {
+		dev->nonAggressiveSkip--;
 
-	if (!aggressive && (dev->nonAggressiveSkip > 0))
-		return -1;
+		if (!aggressive && (dev->nonAggressiveSkip > 0))
+			return -1;
+	}
 
-	if (!prioritised)
-		pagesInUse =
-			(aggressive) ? dev->nChunksPerBlock : YAFFS_PASSIVE_GC_CHUNKS + 1;
+	if (!prioritised) {
+		if (aggressive)
+			pagesInUse = dev->nChunksPerBlock;
+		else if (background)
+			pagesInUse = dev->nChunksPerBlock / 2 + 1;
+		else
+			pagesInUse = YAFFS_PASSIVE_GC_CHUNKS + 1;
+	}
 
-	if (aggressive)
+	if (aggressive || background)
 		iterations =
 		    dev->internalEndBlock - dev->internalStartBlock + 1;
 	else {
@@ -2704,17 +2797,29 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 		if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
 			(bi->pagesInUse - bi->softDeletions) < pagesInUse &&
 				yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
-			dirtiest = b;
-			pagesInUse = (bi->pagesInUse - bi->softDeletions);
+			if (fewestLive) {
+				/* the next one has to beat this one */
+				dirtiest = b;
+				pagesInUse = (bi->pagesInUse - bi->softDeletions);
+				continue;
+			}
+			score = yaffs_GCScore(dev, bi, b);
+			if (dirtiest < 0 || score > bestScore) {
+				dirtiest = b;
+				bestScore = score;
+			}
 		}
 	}
 
 	dev->currentDirtyChecker = b;
 
 	if (dirtiest > 0) {
+		bi = yaffs_GetBlockInfo(dev, dirtiest);
 		T(YAFFS_TRACE_GC,
-		  (TSTR("GC Selected block %d with %d free, prioritised:%d" TENDSTR), dirtiest,
-		   dev->nChunksPerBlock - pagesInUse, prioritised));
+		  (TSTR("GC Selected block %d with %d free, score %u, prioritised:%d" TENDSTR),
+		   dirtiest,
+		   dev->nChunksPerBlock - (bi->pagesInUse - bi->softDeletions),
+		   bestScore, prioritised));
 	}
 
 	dev->oldestDirtySequence = 0;
@@ -2776,6 +2881,12 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		bi->gcPrioritise = 0;
 		yaffs_ClearChunkBits(dev, blockNo);
 
+		if (dev->eraseCounts &&
+		    dev->eraseCounts[blockNo - dev->internalStartBlock] < 0xffff) {
+			dev->eraseCounts[blockNo - dev->internalStartBlock]++;
+			dev->eraseCountSum++;
+		}
+
 		T(YAFFS_TRACE_ERASE,
 		  (TSTR("Erased block %d" TENDSTR), blockNo));
 	} else {
@@ -3222,7 +3333,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
  * The idea is to help clear out space in a more spread-out manner.
  * Dunno if it really does anything useful.
  */
-static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
+static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 {
 	int block;
 	int aggressive;
@@ -3250,13 +3361,26 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 		if (dev->nErasedBlocks < (dev->nReservedBlocks + checkpointBlockAdjust + 2)) {
 			/* We need a block soon...*/
 			aggressive = 1;
+		} else if (background &&
+			   dev->nErasedBlocks < (dev->nReservedBlocks +
+					checkpointBlockAdjust +
+					YAFFS_GC_BACKGROUND_MARGIN)) {
+			/* Get in before the foreground has to */
+			aggressive = 1;
 		} else {
 			/* We're in no hurry */
 			aggressive = 0;
 		}
 
+		/* With a background collector running, leave leisurely
+		 * collection to it rather than stalling the writer.
+		 */
+		if (!background && !aggressive && dev->backgroundGC)
+			return YAFFS_OK;
+
 		if (dev->gcBlock <= 0) {
-			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, aggressive);
+			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev,
+						aggressive, background);
 			dev->gcChunk = 0;
 		}
 
@@ -3266,6 +3390,8 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 			dev->garbageCollections++;
 			if (!aggressive)
 				dev->passiveGarbageCollections++;
+			if (background)
+				dev->backgroundGarbageCollections++;
 
 			T(YAFFS_TRACE_GC,
 			  (TSTR
@@ -3288,6 +3414,46 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/*
+ * yaffs_BackgroundGarbageCollect() does one step of garbage collection for a
+ * background thread and says how soon it wants to be called again:
+ * 0 - nothing worth doing, 1 - leisurely, 2 - urgent.
+ *
+ * Leisurely collection starts once less than half the free space is in
+ * erased blocks, and turns urgent a few blocks before the foreground write
+ * path would have to go aggressive itself.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev)
+{
+	int erasedChunks;
+	int checkpointBlockAdjust;
+	int before;
+
+	erasedChunks = dev->nErasedBlocks * dev->nChunksPerBlock;
+
+	checkpointBlockAdjust = yaffs_CalcCheckpointBlocksRequired(dev) -
+				dev->blocksInCheckpoint;
+	if (checkpointBlockAdjust < 0)
+		checkpointBlockAdjust = 0;
+
+	if (dev->gcBlock <= 0 && erasedChunks >= dev->nFreeChunks / 2 &&
+	    dev->nErasedBlocks >= (dev->nReservedBlocks +
+				   checkpointBlockAdjust +
+				   YAFFS_GC_BACKGROUND_MARGIN))
+		return 0;
+
+	before = dev->backgroundGarbageCollections;
+
+	yaffs_CheckGarbageCollection(dev, 1);
+
+	if (dev->backgroundGarbageCollections == before)
+		return 0;	/* Nothing we could collect */
+
+	return (dev->nErasedBlocks < (dev->nReservedBlocks +
+				      checkpointBlockAdjust +
+				      YAFFS_GC_BACKGROUND_MARGIN)) ? 2 : 1;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3642,7 +3808,10 @@ static int yaffs_WriteChunkDataToObject(yaffs_Object *in, int chunkInInode,
 
 	yaffs_Device *dev = in->myDev;
 
-	yaffs_CheckGarbageCollection(dev);
+	yaffs_CheckGarbageCollection(dev, 0);
+
+	/* Whatever the read cache holds for this chunk is about to go stale */
+	yaffs_InvalidateReadCache(in, chunkInInode);
 
 	/* Get the previous chunk at this location in the file if it exists */
 	prevChunkId = yaffs_FindChunkInFile(in, chunkInInode, &prevTags);
@@ -3709,7 +3878,7 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
 		in == dev->rootDir || /* The rootDir should also be saved */
 		force) {
 
-		yaffs_CheckGarbageCollection(dev);
+		yaffs_CheckGarbageCollection(dev, 0);
 		yaffs_CheckObjectDetailsLoaded(in);
 
 		buffer = yaffs_GetTempBuffer(in->myDev, __LINE__);
@@ -4028,6 +4197,31 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 
 }
 
+/* Grab a cache chunk for a read.
+ * Reads run with the gross lock shared, so they must not write anything
+ * to NAND: only take an empty or a clean chunk, never flush a dirty one.
+ * Returns NULL if every chunk is dirty or in use.
+ */
+static yaffs_ChunkCache *yaffs_GrabChunkCacheForRead(yaffs_Device *dev)
+{
+	yaffs_ChunkCache *cache;
+	int i;
+
+	cache = yaffs_GrabChunkCacheWorker(dev);
+
+	if (!cache) {
+		for (i = 0; i < dev->nShortOpCaches; i++) {
+			if (!dev->srCache[i].dirty &&
+			    !dev->srCache[i].locked &&
+			    (!cache ||
+			     dev->srCache[i].lastUse < cache->lastUse))
+				cache = &dev->srCache[i];
+		}
+	}
+
+	return cache;
+}
+
 /* Find a cached chunk */
 static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
@@ -4083,6 +4277,8 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		if (cache)
 			cache->object = NULL;
 	}
+
+	yaffs_InvalidateReadCache(object, chunkId);
 }
 
 /* Invalidate all the cache pages associated with this object
@@ -4100,6 +4296,326 @@ static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 				dev->srCache[i].object = NULL;
 		}
 	}
+
+	yaffs_InvalidateWholeReadCache(in);
+}
+
+/*-------------------- Read cache -------------------------------
+ *
+ * The short op cache above is small and searched linearly, which is fine
+ * for buffering writes but too small to save NAND reads. The read cache
+ * holds clean chunks only, as many as the OS layer cares to give it. It is
+ * hashed on (object, chunk) and recycled least recently used first.
+ *
+ * Dirty data always lives in the short op cache, which is looked at first,
+ * so the read cache never has to be written back. It is invalidated
+ * whenever a chunk is written and whenever a file is resized or deleted.
+ *
+ * Sequential reads are spotted and the next few chunks read ahead into the
+ * cache.
+ *
+ * Readers run with the gross lock shared, so the read path only touches the
+ * read cache under the read lock. Everything else holds the gross lock
+ * exclusively.
+ */
+
+static void yaffs_InitialiseReadCache(yaffs_Device *dev)
+{
+	int nBuckets;
+	int i;
+
+	nBuckets = 16;
+	while (nBuckets < dev->nReadCaches / 2)
+		nBuckets <<= 1;
+
+	dev->rdCache = YMALLOC(dev->nReadCaches * sizeof(yaffs_ReadCache));
+	dev->rdCacheBuckets = YMALLOC(nBuckets * sizeof(struct ylist_head));
+
+	if (!dev->rdCache || !dev->rdCacheBuckets) {
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs: no memory for a read cache of %d chunks"
+			TENDSTR), dev->nReadCaches));
+		if (dev->rdCache)
+			YFREE(dev->rdCache);
+		if (dev->rdCacheBuckets)
+			YFREE(dev->rdCacheBuckets);
+		dev->rdCache = NULL;
+		dev->rdCacheBuckets = NULL;
+		dev->nReadCaches = 0;
+		return;
+	}
+
+	dev->rdCacheBucketMask = nBuckets - 1;
+	for (i = 0; i < nBuckets; i++)
+		YINIT_LIST_HEAD(&dev->rdCacheBuckets[i]);
+
+	for (i = 0; i < dev->nReadCaches; i++) {
+		yaffs_ReadCache *rc = &dev->rdCache[i];
+
+		rc->data = YMALLOC_DMA(dev->totalBytesPerChunk);
+		if (!rc->data) {
+			/* Make do with what we got */
+			dev->nReadCaches = i;
+			break;
+		}
+		rc->object = NULL;
+		rc->chunkId = 0;
+		rc->readAhead = 0;
+		YINIT_LIST_HEAD(&rc->hashLink);
+		ylist_add_tail(&rc->lruLink, &dev->rdCacheLRU);
+	}
+
+	/* Reading ahead more than a fraction of the cache just thrashes it */
+	if (dev->nReadAhead > dev->nReadCaches / 4)
+		dev->nReadAhead = dev->nReadCaches / 4;
+}
+
+static void yaffs_DeinitialiseReadCache(yaffs_Device *dev)
+{
+	int i;
+
+	if (dev->rdCache) {
+		for (i = 0; i < dev->nReadCaches; i++)
+			YFREE(dev->rdCache[i].data);
+		YFREE(dev->rdCache);
+		dev->rdCache = NULL;
+	}
+
+	if (dev->rdCacheBuckets)
+		YFREE(dev->rdCacheBuckets);
+	dev->rdCacheBuckets = NULL;
+
+	YINIT_LIST_HEAD(&dev->rdCacheLRU);
+}
+
+static Y_INLINE struct ylist_head *yaffs_ReadCacheBucket(yaffs_Device *dev,
+						const yaffs_Object *obj,
+						int chunkId)
+{
+	return &dev->rdCacheBuckets[(obj->objectId * 31 + chunkId) &
+				    dev->rdCacheBucketMask];
+}
+
+static yaffs_ReadCache *yaffs_FindReadCache(const yaffs_Object *obj,
+					    int chunkId)
+{
+	yaffs_Device *dev = obj->myDev;
+	struct ylist_head *bucket;
+	struct ylist_head *i;
+	yaffs_ReadCache *rc;
+
+	if (dev->nReadCaches <= 0)
+		return NULL;
+
+	bucket = yaffs_ReadCacheBucket(dev, obj, chunkId);
+	ylist_for_each(i, bucket) {
+		rc = ylist_entry(i, yaffs_ReadCache, hashLink);
+		if (rc->object == obj && rc->chunkId == chunkId)
+			return rc;
+	}
+
+	return NULL;
+}
+
+/* Move an entry to the most recently used end of the LRU */
+static void yaffs_UseReadCache(yaffs_Device *dev, yaffs_ReadCache *rc)
+{
+	ylist_del(&rc->lruLink);
+	ylist_add(&rc->lruLink, &dev->rdCacheLRU);
+}
+
+/* Free an entry and put it where it will be reused first */
+static void yaffs_DropReadCache(yaffs_Device *dev, yaffs_ReadCache *rc)
+{
+	ylist_del_init(&rc->hashLink);
+	ylist_del(&rc->lruLink);
+	ylist_add_tail(&rc->lruLink, &dev->rdCacheLRU);
+	rc->object = NULL;
+	if (rc->readAhead)
+		dev->rdAheadWasted++;
+	rc->readAhead = 0;
+}
+
+/* Take the least recently used entry off both lists, so that it can be
+ * filled without the read lock. Returns NULL if every entry is being filled.
+ * Called with the read lock held.
+ */
+static yaffs_ReadCache *yaffs_ReserveReadCache(yaffs_Device *dev)
+{
+	yaffs_ReadCache *rc;
+
+	if (ylist_empty(&dev->rdCacheLRU))
+		return NULL;
+
+	rc = ylist_entry(dev->rdCacheLRU.prev, yaffs_ReadCache, lruLink);
+	ylist_del_init(&rc->hashLink);
+	ylist_del_init(&rc->lruLink);
+	rc->object = NULL;
+	if (rc->readAhead)
+		dev->rdAheadWasted++;
+	rc->readAhead = 0;
+
+	return rc;
+}
+
+/* Make a filled entry visible, unless another reader beat us to the same
+ * chunk, in which case ours goes back to be reused first. Called with the
+ * read lock held.
+ */
+static void yaffs_PublishReadCache(yaffs_Object *obj, int chunkId,
+				   yaffs_ReadCache *rc, int readAhead)
+{
+	yaffs_Device *dev = obj->myDev;
+
+	if (yaffs_FindReadCache(obj, chunkId)) {
+		if (readAhead)
+			dev->rdAheadWasted++;
+		ylist_add_tail(&rc->lruLink, &dev->rdCacheLRU);
+		return;
+	}
+
+	rc->object = obj;
+	rc->chunkId = chunkId;
+	rc->readAhead = readAhead;
+	ylist_add(&rc->hashLink, yaffs_ReadCacheBucket(dev, obj, chunkId));
+	ylist_add(&rc->lruLink, &dev->rdCacheLRU);
+}
+
+/* Keep the read ahead window nReadAhead chunks past chunkId, stopping at
+ * the end of the file. Called without the read lock: each chunk is read
+ * from NAND into a reserved entry with the lock dropped.
+ */
+static void yaffs_ReadAhead(yaffs_Object *obj, int chunkId)
+{
+	yaffs_Device *dev = obj->myDev;
+	__u32 fileSize = obj->variant.fileVariant.fileSize;
+	yaffs_ReadCache *rc;
+	int lastChunk;
+	__u32 lastStart;
+	int end;
+	int chunk;
+
+	if (dev->nReadAhead <= 0 || fileSize == 0)
+		return;
+
+	yaffs_AddrToChunk(dev, fileSize - 1, &lastChunk, &lastStart);
+	lastChunk++;
+
+	end = chunkId + dev->nReadAhead;
+	if (end > lastChunk)
+		end = lastChunk;
+
+	yaffs_LockRead(dev);
+
+	if (dev->rdAheadObject != obj || dev->rdAheadEnd <= chunkId ||
+	    dev->rdAheadEnd > end + 1) {
+		dev->rdAheadObject = obj;
+		dev->rdAheadEnd = chunkId + 1;
+	}
+
+	while (dev->rdAheadEnd <= end) {
+		chunk = dev->rdAheadEnd++;
+		if (yaffs_FindReadCache(obj, chunk))
+			continue;
+
+		rc = yaffs_ReserveReadCache(dev);
+		if (!rc)
+			break;
+		dev->rdAheadReads++;
+
+		yaffs_UnlockRead(dev);
+		yaffs_ReadChunkDataFromObject(obj, chunk, rc->data);
+		yaffs_LockRead(dev);
+
+		yaffs_PublishReadCache(obj, chunk, rc, 1);
+	}
+
+	yaffs_UnlockRead(dev);
+}
+
+/* Copy part of a chunk out of the read cache. Called with the read lock
+ * held. Returns 1 on a hit. On a miss, *rcp is an entry reserved for the
+ * caller to fill once it has dropped the lock, or NULL if none was free.
+ * *readAhead is set if the caller should go on to yaffs_ReadAhead().
+ */
+static int yaffs_ReadChunkFromCache(yaffs_Object *in, int chunkId,
+				    __u8 *buffer, __u32 start, int nBytes,
+				    yaffs_ReadCache **rcp, int *readAhead)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_ReadCache *rc;
+	int sequential;
+	int hit = 0;
+
+	sequential = (dev->rdLastObject == in &&
+		      dev->rdLastChunk + 1 == chunkId);
+
+	*readAhead = 0;
+	*rcp = NULL;
+
+	rc = yaffs_FindReadCache(in, chunkId);
+	if (rc) {
+		dev->rdCacheHits++;
+		if (rc->readAhead) {
+			/* The read ahead paid off, so keep it going */
+			dev->rdAheadHits++;
+			rc->readAhead = 0;
+			*readAhead = 1;
+		}
+		yaffs_UseReadCache(dev, rc);
+		memcpy(buffer, &rc->data[start], nBytes);
+		hit = 1;
+	} else {
+		dev->rdCacheMisses++;
+		*rcp = yaffs_ReserveReadCache(dev);
+		*readAhead = sequential;
+	}
+
+	dev->rdLastObject = in;
+	dev->rdLastChunk = chunkId;
+
+	return hit;
+}
+
+/* Read a chunk that is about to be partly overwritten, from the read cache
+ * if it is there.
+ */
+static void yaffs_ReadChunkForUpdate(yaffs_Object *in, int chunkId,
+				     __u8 *buffer)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_ReadCache *rc = yaffs_FindReadCache(in, chunkId);
+
+	if (rc) {
+		dev->rdCacheHits++;
+		memcpy(buffer, rc->data, dev->nDataBytesPerChunk);
+	} else {
+		yaffs_ReadChunkDataFromObject(in, chunkId, buffer);
+	}
+}
+
+static void yaffs_InvalidateReadCache(yaffs_Object *obj, int chunkId)
+{
+	yaffs_ReadCache *rc = yaffs_FindReadCache(obj, chunkId);
+
+	if (rc)
+		yaffs_DropReadCache(obj->myDev, rc);
+}
+
+static void yaffs_InvalidateWholeReadCache(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	int i;
+
+	for (i = 0; i < dev->nReadCaches; i++) {
+		if (dev->rdCache[i].object == obj)
+			yaffs_DropReadCache(dev, &dev->rdCache[i]);
+	}
+
+	if (dev->rdLastObject == obj)
+		dev->rdLastObject = NULL;
+	if (dev->rdAheadObject == obj)
+		dev->rdAheadObject = NULL;
 }
 
 /*--------------------- Checkpointing --------------------*/
@@ -4688,6 +5204,9 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	int n = nBytes;
 	int nDone = 0;
 	yaffs_ChunkCache *cache;
+	yaffs_ReadCache *rc;
+	int readCached;
+	int readAhead;
 
 	yaffs_Device *dev;
 
@@ -4707,52 +5226,83 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 		else
 			nToCopy = dev->nDataBytesPerChunk - start;
 
+		/* Other readers may be in here too, so the cache is only
+		 * touched under the read lock.
+		 */
+		yaffs_LockRead(dev);
+
 		cache = yaffs_FindChunkCache(in, chunk);
 
-		/* If the chunk is already in the cache or it is less than a whole chunk
-		 * or we're using inband tags then use the cache (if there is caching)
-		 * else bypass the cache.
+		/* With a read cache, everything not in the short op cache
+		 * goes through that. A miss is filled below, after the
+		 * read lock is dropped.
 		 */
-		if (cache || nToCopy != dev->nDataBytesPerChunk || dev->inbandTags) {
-			if (dev->nShortOpCaches > 0) {
+		readCached = 0;
+		readAhead = 0;
+		rc = NULL;
+		if (!cache && dev->nReadCaches > 0)
+			readCached = yaffs_ReadChunkFromCache(in, chunk, buffer,
+						start, nToCopy, &rc, &readAhead);
+
+		/* If the chunk is not in the cache and it is less than a whole
+		 * chunk or we're using inband tags then load it into the cache
+		 * (if there is caching and a chunk can be had without a flush).
+		 */
+		if (!cache && !readCached && !rc && dev->nShortOpCaches > 0 &&
+		    (nToCopy != dev->nDataBytesPerChunk || dev->inbandTags)) {
+			cache = yaffs_GrabChunkCacheForRead(dev);
+			if (cache) {
+				cache->object = in;
+				cache->chunkId = chunk;
+				cache->dirty = 0;
+				cache->locked = 0;
+				yaffs_ReadChunkDataFromObject(in, chunk,
+							      cache->data);
+				cache->nBytes = 0;
+			}
+		}
 
-				/* If we can't find the data in the cache, then load it up. */
+		if (cache) {
+			yaffs_UseChunkCache(dev, cache, 0);
 
-				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->
-								      data);
-					cache->nBytes = 0;
-				}
+			cache->locked = 1;
 
-				yaffs_UseChunkCache(dev, cache, 0);
+			memcpy(buffer, &cache->data[start], nToCopy);
 
-				cache->locked = 1;
+			cache->locked = 0;
+		}
 
+		yaffs_UnlockRead(dev);
 
-				memcpy(buffer, &cache->data[start], nToCopy);
+		if (rc) {
+			yaffs_ReadChunkDataFromObject(in, chunk, rc->data);
+			memcpy(buffer, &rc->data[start], nToCopy);
 
-				cache->locked = 0;
-			} else {
-				/* Read into the local buffer then copy..*/
+			yaffs_LockRead(dev);
+			yaffs_PublishReadCache(in, chunk, rc, 0);
+			yaffs_UnlockRead(dev);
+			readCached = 1;
+		}
 
-				__u8 *localBuffer =
-				    yaffs_GetTempBuffer(dev, __LINE__);
-				yaffs_ReadChunkDataFromObject(in, chunk,
-							      localBuffer);
+		if (readAhead)
+			yaffs_ReadAhead(in, chunk);
 
-				memcpy(buffer, &localBuffer[start], nToCopy);
+		if (cache || readCached) {
+			/* Already copied out of the cache */
+		} else if (nToCopy != dev->nDataBytesPerChunk ||
+			   dev->inbandTags) {
+			/* Read into the local buffer then copy..*/
 
+			__u8 *localBuffer =
+			    yaffs_GetTempBuffer(dev, __LINE__);
+			yaffs_ReadChunkDataFromObject(in, chunk,
+						      localBuffer);
 
-				yaffs_ReleaseTempBuffer(dev, localBuffer,
-							__LINE__);
-			}
+			memcpy(buffer, &localBuffer[start], nToCopy);
 
+
+			yaffs_ReleaseTempBuffer(dev, localBuffer,
+						__LINE__);
 		} else {
 
 			/* A full chunk. Read directly into the supplied buffer. */
@@ -4854,9 +5404,8 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 					cache->chunkId = chunk;
 					cache->dirty = 0;
 					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->
-								      data);
+					yaffs_ReadChunkForUpdate(in, chunk,
+								 cache->data);
 				} else if (cache &&
 					!cache->dirty &&
 					!yaffs_CheckSpaceForAllocation(in->myDev)) {
@@ -4899,8 +5448,8 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				__u8 *localBuffer =
 				    yaffs_GetTempBuffer(dev, __LINE__);
 
-				yaffs_ReadChunkDataFromObject(in, chunk,
-							      localBuffer);
+				yaffs_ReadChunkForUpdate(in, chunk,
+							 localBuffer);
 
 
 
@@ -5008,7 +5557,7 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 	yaffs_FlushFilesChunkCache(in);
 	yaffs_InvalidateWholeChunkCache(in);
 
-	yaffs_CheckGarbageCollection(dev);
+	yaffs_CheckGarbageCollection(dev, 0);
 
 	if (in->variantType != YAFFS_OBJECT_TYPE_FILE)
 		return YAFFS_FAIL;
@@ -6048,8 +6597,19 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		in->lazyLoaded ? "not yet" : "already"));
 #endif
 
+	if (!in->lazyLoaded || in->hdrChunk <= 0) {
+#ifdef __KERNEL__
+		smp_rmb();	/* Pairs with the smp_wmb() below */
+#endif
+		return;
+	}
+
+	/* Lookups share the gross lock, so two of them can race to load the
+	 * same object. Only clear lazyLoaded once the details are in place.
+	 */
+	yaffs_LockRead(dev);
+
 	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
@@ -6082,7 +6642,14 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		}
 
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+
+#ifdef __KERNEL__
+		smp_wmb();
+#endif
+		in->lazyLoaded = 0;
 	}
+
+	yaffs_UnlockRead(dev);
 }
 
 static int yaffs_ScanBackwards(yaffs_Device *dev)
@@ -6119,6 +6686,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
 
+	yaffs_ExtendedTags *blockTags = NULL;
+	int haveBlockTags;
+
 	if (!dev->isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
 		  (TSTR("yaffs_ScanBackwards is only for YAFFS2!" TENDSTR)));
@@ -6150,6 +6720,13 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
+	/* If the driver can read a whole block's tags in one go, use that
+	 * rather than a NAND read per chunk. Not fatal if we can't have it.
+	 */
+	if (dev->readBlockTagsFromNAND)
+		blockTags = YMALLOC(dev->nChunksPerBlock *
+				    sizeof(yaffs_ExtendedTags));
+
 	/* Scan all the blocks to determine their state */
 	for (blk = dev->internalStartBlock; blk <= dev->internalEndBlock; blk++) {
 		bi = yaffs_GetBlockInfo(dev, blk);
@@ -6265,6 +6842,13 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		haveBlockTags = blockTags &&
+			state == YAFFS_BLOCK_STATE_NEEDS_SCANNING &&
+			yaffs_ReadBlockTagsFromNAND(dev, blk, blockTags) ==
+				YAFFS_OK;
+		if (haveBlockTags)
+			dev->scanBlockReads++;
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->nChunksPerBlock - 1;
@@ -6277,8 +6861,13 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (haveBlockTags) {
+				tags = blockTags[c];
+			} else {
+				result = yaffs_ReadChunkWithTagsFromNAND(dev,
+							chunk, NULL, &tags);
+				dev->scanChunkReads++;
+			}
 
 			/* Let's have a good look at this chunk... */
 
@@ -6732,6 +7321,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	else
 		YFREE(blockIndex);
 
+	if (blockTags)
+		YFREE(blockTags);
+
 	/* Ok, we've done all the scanning.
 	 * Fix up the hard link chains.
 	 * We should now have scanned all the objects, now it's time to add these
@@ -7491,6 +8083,22 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 
 	dev->cacheHits = 0;
 
+	dev->rdCache = NULL;
+	dev->rdCacheBuckets = NULL;
+	YINIT_LIST_HEAD(&dev->rdCacheLRU);
+	dev->rdLastObject = NULL;
+	dev->rdLastChunk = 0;
+	dev->rdAheadEnd = 0;
+	dev->rdCacheHits = 0;
+	dev->rdCacheMisses = 0;
+	dev->rdAheadReads = 0;
+	dev->rdAheadHits = 0;
+	dev->rdAheadWasted = 0;
+
+	/* Not having a read cache is not fatal */
+	if (!init_failed && dev->nReadCaches > 0)
+		yaffs_InitialiseReadCache(dev);
+
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->nChunksPerBlock * sizeof(__u32));
 		if (!dev->gcCleanupList)
@@ -7609,6 +8217,8 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			dev->srCache = NULL;
 		}
 
+		yaffs_DeinitialiseReadCache(dev);
+
 		YFREE(dev->gcCleanupList);
 
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
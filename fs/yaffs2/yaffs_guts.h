@@ -92,6 +92,11 @@
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Write latency histogram: bucket 0 counts writes under 1 us, bucket i
+ * writes in [2^(i-1), 2^i) us, and the last one everything longer.
+ */
+#define YAFFS_WRITE_HIST_BUCKETS	20
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -126,6 +131,20 @@ typedef struct {
 #endif
 } yaffs_ChunkCache;
 
+/* ReadCache holds clean chunks for reads. Unlike the short op cache it can
+ * be large, so entries are hashed on (object, chunk) and kept on an LRU list.
+ * An entry being filled from NAND is on neither list and owned by the reader
+ * that reserved it.
+ */
+typedef struct {
+	struct ylist_head hashLink;	/* in a read cache hash bucket */
+	struct ylist_head lruLink;	/* most recently used first */
+	struct yaffs_ObjectStruct *object;	/* NULL if the entry is free */
+	int chunkId;
+	int readAhead;		/* Read ahead and not used yet */
+	__u8 *data;
+} yaffs_ReadCache;
+
 
 
 /* Tags structures in RAM
@@ -556,6 +575,11 @@ struct yaffs_DeviceStruct {
 				 * the number of short op caches (don't use too many)
 				 */
 
+	int nReadCaches;	/* If <= 0, then the read cache is disabled, else
+				 * the number of chunks it holds.
+				 */
+	int nReadAhead;		/* Chunks to read ahead on sequential reads */
+
 	int useHeaderFileSize;	/* Flag to determine if we should use file sizes from the header */
 
 	int emptyLostAndFound;  /* Flasg to determine if lst+found should be emptied on init */
@@ -590,6 +614,11 @@ struct yaffs_DeviceStruct {
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
+	/* Optional. Reads the tags of every chunk in a block in one go
+	 * so that scanning need not issue a NAND read per chunk.
+	 */
+	int (*readBlockTagsFromNAND) (struct yaffs_DeviceStruct *dev,
+				      int blockNo, yaffs_ExtendedTags *tags);
 #endif
 
 	int isYaffs2;
@@ -636,8 +665,34 @@ struct yaffs_DeviceStruct {
 #ifdef __KERNEL__
 
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
-	struct semaphore grossLock;	/* Gross locking semaphore */
+	struct rw_semaphore grossLock;	/* Gross lock. Shared by lookups and
+					 * reads, exclusive for anything that
+					 * changes the file system.
+					 */
 	struct rw_semaphore dirLock; /* Lock the directory structure */
+
+	/* Finer locks for the state that readers still update while they
+	 * share the gross lock. Nested inside the gross lock in this order.
+	 */
+	struct mutex readLock;		/* Chunk cache, lazy object loading */
+	struct mutex nandLock;		/* NAND reads, spareBuffer and the
+					 * block info they mark on ECC errors
+					 */
+	spinlock_t tempLock;		/* Temp buffer pool */
+	spinlock_t searchLock;		/* searchContexts list */
+
+	/* Gross lock statistics, readers update them concurrently */
+	atomic_t grossReadLocks;
+	atomic_t grossReadWaits;	/* Shared takes that had to wait */
+	atomic_t grossReadWaitJiffies;
+	int grossWriteLocks;
+	int grossWriteWaits;
+	unsigned long checkpointTime;	/* jiffies of the last sync checkpoint */
+	unsigned mountMs;		/* Time yaffs_GutsInitialise took */
+	int mountScanned;		/* Mounted by scanning, not checkpoint */
+	unsigned writeHist[YAFFS_WRITE_HIST_BUCKETS]; /* yaffs_file_write */
+	struct task_struct *bgThread;	/* Background GC thread */
+	int bgIdle;			/* It is waiting for new garbage to wake it */
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 
@@ -716,6 +771,15 @@ struct yaffs_DeviceStruct {
 
 	__u32 *gcCleanupList;	/* objects to delete at the end of a GC. */
 	int nonAggressiveSkip;	/* GC state/mode */
+	int backgroundGC;	/* Set by the OS layer while a background GC
+				 * thread runs; foreground writes then skip
+				 * passive GC.
+				 */
+	__u16 *eraseCounts;	/* Per-block erases since mount, for GC wear
+				 * levelling. Not in yaffs_BlockInfo, which is
+				 * checkpointed as is.
+				 */
+	__u32 eraseCountSum;
 
 	/* Statistcs */
 	int nPageWrites;
@@ -725,6 +789,7 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -733,6 +798,8 @@ struct yaffs_DeviceStruct {
 	int tagsEccUnfixed;
 	int nDeletions;
 	int nUnmarkedDeletions;
+	int scanBlockReads;	/* Blocks whose tags were read in one go */
+	int scanChunkReads;	/* Tags read one chunk at a time */
 
 	int hasPendingPrioritisedGCs; /* We think this device might have pending prioritised gcs */
 
@@ -753,6 +820,20 @@ struct yaffs_DeviceStruct {
 
 	int cacheHits;
 
+	yaffs_ReadCache *rdCache;
+	struct ylist_head *rdCacheBuckets;
+	int rdCacheBucketMask;
+	struct ylist_head rdCacheLRU;
+	yaffs_Object *rdLastObject;	/* Sequential read detection */
+	int rdLastChunk;
+	yaffs_Object *rdAheadObject;	/* Object being read ahead */
+	int rdAheadEnd;		/* First chunk not yet read ahead */
+	int rdCacheHits;
+	int rdCacheMisses;
+	int rdAheadReads;
+	int rdAheadHits;
+	int rdAheadWasted;	/* Read ahead, then dropped without a hit */
+
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
 	yaffs_Object *deletedDir;	/* Directory where deleted objects are sent to disappear. */
@@ -893,6 +974,20 @@ void yfsd_WinFileTimeNow(__u32 target[2]);
 #ifdef __KERNEL__
 
 void yaffs_HandleDeferedFree(yaffs_Object *obj);
+
+#define yaffs_LockRead(dev)	mutex_lock(&(dev)->readLock)
+#define yaffs_UnlockRead(dev)	mutex_unlock(&(dev)->readLock)
+#define yaffs_LockNand(dev)	mutex_lock(&(dev)->nandLock)
+#define yaffs_UnlockNand(dev)	mutex_unlock(&(dev)->nandLock)
+#define yaffs_LockTemp(dev)	spin_lock(&(dev)->tempLock)
+#define yaffs_UnlockTemp(dev)	spin_unlock(&(dev)->tempLock)
+#else
+#define yaffs_LockRead(dev)	do { } while (0)
+#define yaffs_UnlockRead(dev)	do { } while (0)
+#define yaffs_LockNand(dev)	do { } while (0)
+#define yaffs_UnlockNand(dev)	do { } while (0)
+#define yaffs_LockTemp(dev)	do { } while (0)
+#define yaffs_UnlockTemp(dev)	do { } while (0)
 #endif
 
 /* Debug dump  */
@@ -906,6 +1001,8 @@ void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn);
 int yaffs_CheckFF(__u8 *buffer, int nBytes);
 void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi);
 
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev);
+
 __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo);
 void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer, int lineNo);
 
@@ -187,6 +187,58 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		return YAFFS_FAIL;
 }
 
+/* Reads the packed tags of a whole block with one multi-page OOB read.
+ * Only an error-free read is used: drivers report ECC status for the
+ * whole request, not per page, so on any error let the caller fall back
+ * to per-chunk reads.
+ */
+int nandmtd2_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockNo,
+				   yaffs_ExtendedTags *tags)
+{
+#if (MTD_VERSION_CODE > MTD_VERSION(2, 6, 17))
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+	struct mtd_oob_ops ops;
+	yaffs_PackedTags2 pt;
+	__u8 *oob;
+	int retval;
+	int c;
+
+	loff_t addr = ((loff_t) blockNo) * dev->nChunksPerBlock *
+			dev->totalBytesPerChunk;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR("nandmtd2_ReadBlockTagsFromNAND block %d" TENDSTR), blockNo));
+
+	if (dev->inbandTags || mtd->oobavail < sizeof(pt))
+		return YAFFS_FAIL;
+
+	oob = YMALLOC(dev->nChunksPerBlock * mtd->oobavail);
+	if (!oob)
+		return YAFFS_FAIL;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = dev->nChunksPerBlock * mtd->oobavail;
+	ops.len = ops.ooblen;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = oob;
+	retval = mtd->read_oob(mtd, addr, &ops);
+
+	if (retval == 0) {
+		for (c = 0; c < dev->nChunksPerBlock; c++) {
+			memcpy(&pt, &oob[c * mtd->oobavail], sizeof(pt));
+			yaffs_UnpackTags2(&tags[c], &pt);
+		}
+	}
+
+	YFREE(oob);
+
+	return retval == 0 ? YAFFS_OK : YAFFS_FAIL;
+#else
+	return YAFFS_FAIL;
+#endif
+}
+
 int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo)
 {
 	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
@@ -29,6 +29,12 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 
 	int realignedChunkInNAND = chunkInNAND - dev->chunkOffset;
 
+	/* Readers sharing the gross lock come through here concurrently.
+	 * The driver's spare buffer and the block info we mark on ECC
+	 * errors are shared, so take them one at a time.
+	 */
+	yaffs_LockNand(dev);
+
 	dev->nPageReads++;
 
 	/* If there are no tags provided, use local tags to get prioritised gc working */
@@ -50,6 +56,33 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		yaffs_HandleChunkError(dev, bi);
 	}
 
+	yaffs_UnlockNand(dev);
+
+	return result;
+}
+
+/* Reads the tags of all the chunks in a block, if the driver can do that
+ * in one go. Returns YAFFS_FAIL if it can't, or if the read reported an
+ * error; the caller then falls back to reading the chunks one at a time
+ * so that each chunk gets its own ECC result.
+ */
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockNo,
+					yaffs_ExtendedTags *tags)
+{
+	int result;
+
+	if (!dev->readBlockTagsFromNAND)
+		return YAFFS_FAIL;
+
+	yaffs_LockNand(dev);
+
+	dev->nPageReads += dev->nChunksPerBlock;
+
+	result = dev->readBlockTagsFromNAND(dev, blockNo - dev->blockOffset,
+					    tags);
+
+	yaffs_UnlockNand(dev);
+
 	return result;
 }
 
@@ -174,6 +174,12 @@ struct android_pmem_platform_data
 	 * indicates that this region should be mapped/unmaped as needed
 	 */
 	int map_on_demand;
+	/*
+	 * only with unstable, user-space regions: lend the memory of this
+	 * region to the page allocator for movable pages while the device
+	 * is not open, migrating them out again when it is opened
+	 */
+	unsigned movable;
 };
 
 int pmem_setup(struct android_pmem_platform_data *pdata,
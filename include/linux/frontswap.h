@@ -23,6 +23,8 @@ extern int __frontswap_put_page(struct page *page);
 extern int __frontswap_get_page(struct page *page);
 extern void __frontswap_flush_page(unsigned, pgoff_t);
 extern void __frontswap_flush_area(unsigned);
+extern int frontswap_writeback_page(unsigned type, pgoff_t offset);
+extern void frontswap_writeback_flush(unsigned type);
 
 #ifndef CONFIG_FRONTSWAP
 /* all inline routines become no-ops and all externs are ignored */
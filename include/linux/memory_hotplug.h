@@ -219,6 +219,8 @@ extern void reserve_hotplug_pages(unsigned long start_pfn,
 				unsigned long nr_pages);
 extern void unreserve_hotplug_pages(unsigned long start_pfn,
 				unsigned long nr_pages);
+extern int reclaim_hotplug_pages(unsigned long start_pfn,
+				unsigned long nr_pages, unsigned long timeout);
 #endif /* __LINUX_MEMORY_HOTPLUG_H */
 extern int physical_remove_memory(u64 start, u64 size);
 extern int arch_physical_remove_memory(u64 start, u64 size);
@@ -291,11 +291,13 @@ extern void mem_cgroup_get_shmem_target(struct inode *inode, pgoff_t pgoff,
 #endif
 
 extern void swap_unplug_io_fn(struct backing_dev_info *, struct page *);
+extern void swap_unplug_device(unsigned type);
 
 #ifdef CONFIG_SWAP
 /* linux/mm/page_io.c */
 extern int swap_readpage(struct page *);
 extern int swap_writepage(struct page *page, struct writeback_control *wbc);
+extern int __swap_writepage(struct page *page, struct writeback_control *wbc);
 extern void end_swap_bio_read(struct bio *bio, int err);
 
 /* linux/mm/swap_state.c */
@@ -0,0 +1,83 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoint for the victim search: how many candidates were looked at
+ * and how long it took.
+ */
+TRACE_EVENT(lowmem_select,
+
+	TP_PROTO(int min_adj, int scanned, pid_t pid, u64 latency_ns),
+
+	TP_ARGS(min_adj, scanned, pid, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(	int,	min_adj		)
+		__field(	int,	scanned		)
+		__field(	pid_t,	pid		)
+		__field(	u64,	latency_ns	)
+	),
+
+	TP_fast_assign(
+		__entry->min_adj	= min_adj;
+		__entry->scanned	= scanned;
+		__entry->pid		= pid;
+		__entry->latency_ns	= latency_ns;
+	),
+
+	TP_printk("min_adj=%d scanned=%d selected=%d latency=%llu ns",
+		__entry->min_adj, __entry->scanned, __entry->pid,
+		(unsigned long long)__entry->latency_ns)
+);
+
+/*
+ * Tracepoint for a kill, with the reason it was chosen: the minfree
+ * level that was crossed and the free/file page counts at the time.
+ */
+TRACE_EVENT(lowmem_kill,
+
+	TP_PROTO(struct task_struct *p, int oom_adj, int tasksize,
+		 int min_adj, int minfree, int other_free, int other_file),
+
+	TP_ARGS(p, oom_adj, tasksize, min_adj, minfree, other_free,
+		other_file),
+
+	TP_STRUCT__entry(
+		__array(	char,	comm,	TASK_COMM_LEN	)
+		__field(	pid_t,	pid			)
+		__field(	int,	oom_adj			)
+		__field(	int,	tasksize		)
+		__field(	int,	min_adj			)
+		__field(	int,	minfree			)
+		__field(	int,	other_free		)
+		__field(	int,	other_file		)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		__entry->pid		= p->pid;
+		__entry->oom_adj	= oom_adj;
+		__entry->tasksize	= tasksize;
+		__entry->min_adj	= min_adj;
+		__entry->minfree	= minfree;
+		__entry->other_free	= other_free;
+		__entry->other_file	= other_file;
+	),
+
+	TP_printk("comm=%s pid=%d oom_adj=%d size=%d min_adj=%d "
+		  "minfree=%d free=%d file=%d",
+		__entry->comm, __entry->pid, __entry->oom_adj,
+		__entry->tasksize, __entry->min_adj, __entry->minfree,
+		__entry->other_free, __entry->other_file)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -23,6 +23,9 @@
 #include <linux/uaccess.h>
 #include <linux/frontswap.h>
 #include <linux/swapfile.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/backing-dev.h>
 
 /*
  * frontswap_ops is set by frontswap_register_ops to contain the pointers
@@ -43,6 +46,7 @@ static unsigned long frontswap_gets;
 static unsigned long frontswap_succ_puts;
 static unsigned long frontswap_failed_puts;
 static unsigned long frontswap_flushes;
+static unsigned long frontswap_writebacks;
 
 /*
  * register operations for frontswap, returning previous thus allowing
@@ -153,6 +157,70 @@ void __frontswap_flush_area(unsigned type)
 	memset(sis->frontswap_map, 0, sis->max / sizeof(long));
 }
 
+/*
+ * Move the data frontswap holds for swaptype and offset to the swap device
+ * proper, so that the backend can make room for newer pages. The page is
+ * brought into the swap cache (filled from frontswap by swap_readpage),
+ * flushed from frontswap and queued for write without waiting for the I/O.
+ * Returns 0 if a write was queued. The caller should end a batch of these
+ * with frontswap_writeback_flush().
+ */
+int frontswap_writeback_page(unsigned type, pgoff_t offset)
+{
+	swp_entry_t entry = swp_entry(type, offset);
+	struct swap_info_struct *sis = swap_info[type];
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+	};
+	struct page *page;
+	int ret = -EAGAIN;
+	bool stored;
+
+	/*
+	 * swapoff frees frontswap_map once SWP_WRITEOK is clear. Further on,
+	 * the locked swap cache page keeps swapoff from getting that far.
+	 */
+	spin_lock(&swap_lock);
+	stored = (sis->flags & SWP_WRITEOK) && frontswap_test(sis, offset);
+	spin_unlock(&swap_lock);
+	if (!stored)
+		return -ENOENT;
+
+	/* NULL if the swap entry has been freed meanwhile */
+	page = read_swap_cache_async(entry, GFP_KERNEL, NULL, 0);
+	if (page == NULL)
+		return -ENOENT;
+
+	lock_page(page);
+	/*
+	 * Leave alone pages someone else got hold of first: dirty ones
+	 * will be written by reclaim, through frontswap if there is room.
+	 */
+	if (!PageSwapCache(page) || page_private(page) != entry.val ||
+	    !PageUptodate(page) || PageDirty(page) || PageWriteback(page) ||
+	    !frontswap_test(sis, offset)) {
+		unlock_page(page);
+		goto out;
+	}
+	__frontswap_flush_page(type, offset);
+	/* Cold page: have it reclaimed as soon as the write completes */
+	SetPageReclaim(page);
+	ret = __swap_writepage(page, &wbc);
+	if (ret == 0)
+		frontswap_writebacks++;
+out:
+	page_cache_release(page);
+	return ret;
+}
+EXPORT_SYMBOL(frontswap_writeback_page);
+
+/* Start I/O on the writes frontswap_writeback_page() queued for 'type' */
+void frontswap_writeback_flush(unsigned type)
+{
+	swap_unplug_device(type);
+}
+EXPORT_SYMBOL(frontswap_writeback_flush);
+
 /*
  * Frontswap, like a true swap device, may unnecessarily retain pages
  * under certain circumstances; "shrink" frontswap is essentially a
@@ -296,12 +364,20 @@ static ssize_t flushes_show(struct kobject *kobj,
 }
 FRONTSWAP_ATTR_RO(flushes);
 
+static ssize_t writebacks_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", frontswap_writebacks);
+}
+FRONTSWAP_ATTR_RO(writebacks);
+
 static struct attribute *frontswap_attrs[] = {
 	&curr_pages_attr.attr,
 	&succ_puts_attr.attr,
 	&failed_puts_attr.attr,
 	&gets_attr.attr,
 	&flushes_attr.attr,
+	&writebacks_attr.attr,
 	NULL,
 };
 
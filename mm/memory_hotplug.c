@@ -992,6 +992,82 @@ void unreserve_hotplug_pages(unsigned long start_pfn, unsigned long nr_pages)
 	online_pages_range(start_pfn, nr_pages, &onlined_pages);
 }
 
+/*
+ * Take an online range back from the page allocator for a contiguous
+ * allocation, like offline_pages() but without touching the zone or the
+ * memory block state: isolate it, migrate the LRU pages in it elsewhere
+ * and pull the free pages off the free lists, marked Reserved.
+ * unreserve_hotplug_pages() gives the range back.
+ */
+int reclaim_hotplug_pages(unsigned long start_pfn, unsigned long nr_pages,
+			unsigned long timeout)
+{
+	unsigned long pfn, end_pfn, expire;
+	long isolated;
+	int ret, retry_max = 5;
+
+	nr_pages = ((nr_pages + pageblock_nr_pages - 1) >> pageblock_order)
+		<< pageblock_order;
+	end_pfn = start_pfn + nr_pages;
+	if (!nr_pages || !IS_ALIGNED(start_pfn, pageblock_nr_pages))
+		return -EINVAL;
+	if (!test_pages_in_a_zone(start_pfn, end_pfn))
+		return -EINVAL;
+
+	lock_system_sleep();
+
+	ret = start_isolate_page_range(start_pfn, end_pfn);
+	if (ret)
+		goto out;
+
+	expire = jiffies + timeout;
+	lru_add_drain_all();
+	while ((pfn = scan_lru_pages(start_pfn, end_pfn))) {
+		ret = -EAGAIN;
+		if (time_after(jiffies, expire))
+			goto failed;
+		ret = -EINTR;
+		if (fatal_signal_pending(current))
+			goto failed;
+
+		ret = do_migrate_range(pfn, end_pfn);
+		if (ret) {
+			if (ret < 0 && --retry_max == 0)
+				goto failed;
+			yield();
+		}
+		lru_add_drain_all();
+		cond_resched();
+		drain_all_pages();
+	}
+	/* pages on their way to being freed sit on the pcp lists */
+	lru_add_drain_all();
+	drain_all_pages();
+
+	isolated = check_pages_isolated(start_pfn, end_pfn);
+	if (isolated < 0) {
+		ret = -EBUSY;
+		goto failed;
+	}
+	offline_isolated_pages(start_pfn, end_pfn);
+	undo_isolate_page_range(start_pfn, end_pfn);
+
+	/* online_page() adds these back when the range is unreserved */
+	totalram_pages -= isolated;
+#ifdef CONFIG_HIGHMEM
+	if (PageHighMem(pfn_to_page(start_pfn)))
+		totalhigh_pages -= isolated;
+#endif
+	ret = 0;
+	goto out;
+
+failed:
+	undo_isolate_page_range(start_pfn, end_pfn);
+out:
+	unlock_system_sleep();
+	return ret;
+}
+
 #else
 int remove_memory(u64 start, u64 size)
 {
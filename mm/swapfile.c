@@ -124,6 +124,21 @@ void swap_unplug_io_fn(struct backing_dev_info *unused_bdi, struct page *page)
 	up_read(&swap_unplug_sem);
 }
 
+/*
+ * Start the I/O queued on the device of swaptype 'type', without a page
+ * to go by (swap_unplug_io_fn needs one).
+ */
+void swap_unplug_device(unsigned type)
+{
+	struct swap_info_struct *sis = swap_info[type];
+
+	down_read(&swap_unplug_sem);
+	if (sis->flags & SWP_WRITEOK)
+		blk_run_backing_dev(
+			sis->bdev->bd_inode->i_mapping->backing_dev_info, NULL);
+	up_read(&swap_unplug_sem);
+}
+
 /*
  * swapon tell device that all the old swap contents can be discarded,
  * to allow the swap device to optimize its wear-levelling.